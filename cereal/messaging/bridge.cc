@@ -1,21 +1,52 @@
 #include <iostream>
 #include <string>
+#include <algorithm>
 #include <cassert>
 #include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
 #include <map>
 
 typedef void (*sighandler_t)(int sig);
 
 #include "services.h"
 
+#include "bridge.h"
 #include "impl_msgq.h"
 #include "impl_zmq.h"
 
+// Max messages of one service forwarded per poll wakeup
+#define BRIDGE_BATCH_SIZE 100
+#define SUBSCRIPTIONS_INTERVAL_MS 100
+#define STATS_INTERVAL_MS 1000
+
+struct Topic {
+  std::string name;
+  SubSocket *sub_sock;
+  ZMQPubSocket *pub_sock;
+  bool subscribed = false;
+  BridgeBatch batch;
+
+  // Since the last stats report
+  uint64_t msgs = 0;
+  uint64_t bytes = 0;
+  uint64_t dropped = 0;
+  uint64_t latency_sum = 0;
+  uint64_t latency_max = 0;
+};
+
 void sigpipe_handler(int sig) {
   assert(sig == SIGPIPE);
   std::cout << "SIGPIPE received" << std::endl;
 }
 
+static inline uint64_t nanos_since_boot() {
+  struct timespec t;
+  clock_gettime(CLOCK_BOOTTIME, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
 static std::vector<std::string> get_services() {
   std::vector<std::string> name_list;
 
@@ -28,36 +59,116 @@ static std::vector<std::string> get_services() {
   return name_list;
 }
 
+static uint64_t get_log_mono_time(const char *data, size_t size) {
+  try {
+    capnp::FlatArrayMessageReader msg(kj::ArrayPtr<const capnp::word>((const capnp::word *)data, size / sizeof(capnp::word)));
+    return msg.getRoot<cereal::Event>().getLogMonoTime();
+  } catch (...) {
+    return 0;
+  }
+}
+
+// Forwards the pending messages of the topic once the batch is known to be intact
+static void forward(Topic &topic, bool stats) {
+  uint64_t now = stats ? nanos_since_boot() : 0;
+  topic.msgs += bridge_forward(topic.sub_sock, topic.pub_sock, BRIDGE_BATCH_SIZE, topic.batch, topic.dropped);
+
+  for (size_t i = 0; i < topic.batch.size; i++) {
+    std::string &msg = topic.batch.msgs[i];
+    topic.bytes += msg.size();
+    if (stats) {
+      uint64_t log_mono_time = get_log_mono_time(msg.data(), msg.size());
+      if (log_mono_time > 0 && log_mono_time < now) {
+        topic.latency_sum += now - log_mono_time;
+        topic.latency_max = std::max(topic.latency_max, now - log_mono_time);
+      }
+    }
+  }
+}
+
+static void print_stats(std::vector<Topic> &topics, double dt) {
+  for (auto &topic : topics) {
+    if (topic.msgs > 0 || topic.dropped > 0) {
+      printf("%-28s %8.1f msg/s %10.1f kB/s  latency avg %7.3f ms max %7.3f ms  dropped %lu\n",
+             topic.name.c_str(), topic.msgs / dt, topic.bytes / dt / 1024.0,
+             topic.msgs > 0 ? topic.latency_sum / topic.msgs / 1e6 : 0.0, topic.latency_max / 1e6,
+             (unsigned long)topic.dropped);
+    }
+    topic.msgs = topic.bytes = topic.dropped = 0;
+    topic.latency_sum = topic.latency_max = 0;
+  }
+  fflush(stdout);
+}
 
-int main(void){
+int main(int argc, char *argv[]){
   signal(SIGPIPE, (sighandler_t)sigpipe_handler);
 
+  bool stats = argc > 1 && std::string(argv[1]) == "--stats";
   auto endpoints = get_services();
 
-  std::map<SubSocket*, PubSocket*> sub2pub;
+  std::vector<Topic> topics(endpoints.size());
+  std::map<SubSocket*, Topic*> sub2topic;
 
   Context *zmq_context = new ZMQContext();
   Context *msgq_context = new MSGQContext();
-  Poller *poller = new MSGQPoller();
 
-  for (auto endpoint: endpoints){
-    SubSocket * msgq_sock = new MSGQSubSocket();
-    msgq_sock->connect(msgq_context, endpoint, "127.0.0.1", false);
-    poller->registerSocket(msgq_sock);
+  for (size_t i = 0; i < endpoints.size(); i++){
+    Topic &topic = topics[i];
+    topic.name = endpoints[i];
 
-    PubSocket * zmq_sock = new ZMQPubSocket();
-    zmq_sock->connect(zmq_context, endpoint);
+    topic.sub_sock = new MSGQSubSocket();
+    topic.sub_sock->connect(msgq_context, topic.name, "127.0.0.1", false);
 
-    sub2pub[msgq_sock] = zmq_sock;
+    topic.pub_sock = new ZMQPubSocket(true);
+    topic.pub_sock->connect(zmq_context, topic.name);
+
+    sub2topic[topic.sub_sock] = &topic;
   }
 
+  // Only services with a remote subscriber are polled, the poller is rebuilt when that changes
+  Poller *poller = NULL;
+  int subscriptions_timer = -1, stats_timer = -1;
+  bool rebuild = true;
+  uint64_t last_stats = nanos_since_boot();
 
   while (true){
+    if (rebuild){
+      delete poller;
+      poller = new MSGQPoller();
+      subscriptions_timer = poller->registerTimer(SUBSCRIPTIONS_INTERVAL_MS);
+      if (stats){
+        stats_timer = poller->registerTimer(STATS_INTERVAL_MS);
+      }
+      for (auto &topic : topics){
+        if (topic.subscribed){
+          poller->registerSocket(topic.sub_sock);
+        }
+      }
+      rebuild = false;
+    }
+
     for (auto sub_sock : poller->poll(100)){
-      Message * msg = sub_sock->receive();
-      if (msg == NULL) continue;
-      sub2pub[sub_sock]->sendMessage(msg);
-      delete msg;
+      forward(*sub2topic[sub_sock], stats);
+    }
+
+    if (poller->timerExpirations(subscriptions_timer) > 0){
+      for (auto &topic : topics){
+        bool subscribed = topic.pub_sock->has_subscribers();
+        if (subscribed && !topic.subscribed){
+          // Skip what was published while nobody was listening
+          topic.sub_sock->receive_batch(SIZE_MAX, [](char *data, size_t size) {});
+        }
+        if (subscribed != topic.subscribed){
+          topic.subscribed = subscribed;
+          rebuild = true;
+        }
+      }
+    }
+
+    if (stats && poller->timerExpirations(stats_timer) > 0){
+      uint64_t now = nanos_since_boot();
+      print_stats(topics, (now - last_stats) / 1e9);
+      last_stats = now;
     }
   }
   return 0;
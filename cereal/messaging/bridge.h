@@ -0,0 +1,45 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "messaging.h"
+
+// Messages of one service received in a batch, copied out of the queue.
+// The strings are kept between batches to reuse their buffers.
+struct BridgeBatch {
+  std::vector<std::string> msgs;
+  size_t size = 0;
+
+  // Receives up to max pending messages. Returns their number, or -1 and an empty
+  // batch if they were overwritten while being copied
+  int receive(SubSocket *sub, size_t max) {
+    size = 0;
+    int ret = sub->receive_batch(max, [&](char *data, size_t len) {
+      if (size == msgs.size()) msgs.emplace_back();
+      msgs[size++].assign(data, len);
+    });
+    if (ret < 0) size = 0;
+    return ret;
+  }
+};
+
+// Forwards up to max pending messages from sub to pub, each as a message of its own so
+// conflating subscribers keep working. Nothing of an overwritten batch is sent.
+// Returns the number of messages forwarded, the ones lost are added to dropped.
+static inline size_t bridge_forward(SubSocket *sub, PubSocket *pub, size_t max, BridgeBatch &batch, uint64_t &dropped) {
+  if (batch.receive(sub, max) < 0) {
+    dropped++;
+    return 0;
+  }
+
+  size_t sent = 0;
+  for (size_t i = 0; i < batch.size; i++) {
+    if (pub->send(batch.msgs[i].data(), batch.msgs[i].size()) < 0) {
+      dropped++;
+    } else {
+      sent++;
+    }
+  }
+  return sent;
+}
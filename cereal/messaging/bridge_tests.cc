@@ -0,0 +1,94 @@
+#include <string>
+#include <vector>
+
+#include "catch2/catch.hpp"
+#include "bridge.h"
+#include "impl_msgq.h"
+
+// Hands out a fixed batch, optionally reporting it as overwritten afterwards
+class FakeSubSocket : public SubSocket {
+public:
+  std::vector<std::string> pending;
+  bool overwritten = false;
+
+  int connect(Context *context, std::string endpoint, std::string address, bool conflate, bool check_endpoint) { return 0; }
+  void setTimeout(int timeout) {}
+  Message *receive(bool non_blocking) { return nullptr; }
+  void *getRawSocket() { return nullptr; }
+  int receive_batch(size_t max, const std::function<void(char *data, size_t size)> &callback) {
+    size_t n = std::min(max, pending.size());
+    for (size_t i = 0; i < n; i++) {
+      callback(pending[i].data(), pending[i].size());
+    }
+    pending.erase(pending.begin(), pending.begin() + n);
+    return overwritten ? -1 : n;
+  }
+};
+
+// Records every send as one message
+class FakePubSocket : public PubSocket {
+public:
+  std::vector<std::string> sent;
+
+  int connect(Context *context, std::string endpoint, bool check_endpoint) { return 0; }
+  int sendMessage(Message *message) { return send(message->getData(), message->getSize()); }
+  int send(char *data, size_t size) {
+    sent.emplace_back(data, size);
+    return size;
+  }
+  bool all_readers_updated() { return true; }
+};
+
+TEST_CASE("bridge_forward sends every message on its own"){
+  FakeSubSocket sub;
+  FakePubSocket pub;
+  BridgeBatch batch;
+  uint64_t dropped = 0;
+
+  sub.pending = {"a", "bb", "ccc"};
+  REQUIRE(bridge_forward(&sub, &pub, 100, batch, dropped) == 3);
+  REQUIRE(pub.sent == std::vector<std::string>{"a", "bb", "ccc"});
+  REQUIRE(dropped == 0);
+
+  // The next batch reuses the strings without leaking the previous contents
+  sub.pending = {"d"};
+  REQUIRE(bridge_forward(&sub, &pub, 100, batch, dropped) == 1);
+  REQUIRE(batch.size == 1);
+  REQUIRE(pub.sent.back() == "d");
+}
+
+TEST_CASE("bridge_forward sends nothing of an overwritten batch"){
+  FakeSubSocket sub;
+  FakePubSocket pub;
+  BridgeBatch batch;
+  uint64_t dropped = 0;
+
+  sub.pending = {"a", "b"};
+  sub.overwritten = true;
+  REQUIRE(bridge_forward(&sub, &pub, 100, batch, dropped) == 0);
+  REQUIRE(pub.sent.empty());
+  REQUIRE(batch.size == 0);
+  REQUIRE(dropped == 1);
+}
+
+TEST_CASE("bridge_forward drains a msgq socket in batches"){
+  MSGQContext ctx;
+  MSGQPubSocket pub_sock;
+  MSGQSubSocket sub_sock;
+  REQUIRE(pub_sock.connect(&ctx, "test_bridge", false) == 0);
+  REQUIRE(sub_sock.connect(&ctx, "test_bridge", "127.0.0.1", false, false) == 0);
+
+  for (int i = 0; i < 5; i++) {
+    std::string msg = "msg" + std::to_string(i);
+    pub_sock.send(msg.data(), msg.size());
+  }
+
+  FakePubSocket pub;
+  BridgeBatch batch;
+  uint64_t dropped = 0;
+  REQUIRE(bridge_forward(&sub_sock, &pub, 3, batch, dropped) == 3);
+  REQUIRE(bridge_forward(&sub_sock, &pub, 3, batch, dropped) == 2);
+  REQUIRE(bridge_forward(&sub_sock, &pub, 3, batch, dropped) == 0);
+  REQUIRE(pub.sent == std::vector<std::string>{"msg0", "msg1", "msg2", "msg3", "msg4"});
+  REQUIRE(dropped == 0);
+}
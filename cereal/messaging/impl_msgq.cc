@@ -1,9 +1,15 @@
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 #include <iostream>
 #include <cstdlib>
 #include <csignal>
 #include <cerrno>
+#include <chrono>
+#include <unistd.h>
+#ifndef __APPLE__
+#include <sys/epoll.h>
+#endif
 
 #include "services.h"
 #include "impl_msgq.h"
@@ -35,6 +41,15 @@ static size_t get_size(std::string endpoint){
   return sz;
 }
 
+static size_t get_num_readers(std::string endpoint){
+  for (const auto& it : services) {
+    if (it.name == endpoint) {
+      return it.num_readers;
+    }
+  }
+  return DEFAULT_NUM_READERS;
+}
+
 
 MSGQContext::MSGQContext() {
 }
@@ -45,21 +60,31 @@ MSGQContext::~MSGQContext() {
 void MSGQMessage::init(size_t sz) {
   size = sz;
   data = new char[size];
+  owned = true;
 }
 
 void MSGQMessage::init(char * d, size_t sz) {
   size = sz;
   data = new char[size];
+  owned = true;
   memcpy(data, d, size);
 }
 
 void MSGQMessage::takeOwnership(char * d, size_t sz) {
   size = sz;
   data = d;
+  owned = true;
+}
+
+void MSGQMessage::borrow(char * d, size_t sz) {
+  close();
+  size = sz;
+  data = d;
+  owned = false;
 }
 
 void MSGQMessage::close() {
-  if (size > 0){
+  if (size > 0 && owned){
     delete[] data;
   }
   size = 0;
@@ -78,7 +103,7 @@ int MSGQSubSocket::connect(Context *context, std::string endpoint, std::string a
   }
 
   q = new msgq_queue_t;
-  int r = msgq_new_queue(q, endpoint.c_str(), get_size(endpoint));
+  int r = msgq_new_queue(q, endpoint.c_str(), get_size(endpoint), get_num_readers(endpoint));
   if (r != 0){
     return r;
   }
@@ -95,7 +120,7 @@ int MSGQSubSocket::connect(Context *context, std::string endpoint, std::string a
 }
 
 
-Message * MSGQSubSocket::receive(bool non_blocking){
+int MSGQSubSocket::recv(msgq_msg_t *msg, bool non_blocking, bool borrow){
   msgq_do_exit = 0;
 
   void (*prev_handler_sigint)(int);
@@ -105,11 +130,8 @@ Message * MSGQSubSocket::receive(bool non_blocking){
     prev_handler_sigterm = std::signal(SIGTERM, sig_handler);
   }
 
-  msgq_msg_t msg;
-
-  MSGQMessage *r = NULL;
-
-  int rc = msgq_msg_recv(&msg, q);
+  auto recv_fn = borrow ? msgq_msg_recv_borrow : msgq_msg_recv;
+  int rc = recv_fn(msg, q);
 
   // Hack to implement blocking read with a poller. Don't use this
   while (!non_blocking && rc == 0 && msgq_do_exit == 0){
@@ -119,7 +141,7 @@ Message * MSGQSubSocket::receive(bool non_blocking){
     int t = (timeout != -1) ? timeout : 100;
 
     int n = msgq_poll(items, 1, t);
-    rc = msgq_msg_recv(&msg, q);
+    rc = recv_fn(msg, q);
 
     // The poll indicated a message was ready, but the receive failed. Try again
     if (n == 1 && rc == 0){
@@ -139,18 +161,58 @@ Message * MSGQSubSocket::receive(bool non_blocking){
 
   errno = msgq_do_exit ? EINTR : 0;
 
-  if (rc > 0){
-    if (msgq_do_exit){
-      msgq_msg_close(&msg); // Free unused message on exit
+  if (rc > 0 && msgq_do_exit){
+    if (borrow){
+      msgq_msg_release(q);
     } else {
-      r = new MSGQMessage;
-      r->takeOwnership(msg.data, msg.size);
+      msgq_msg_close(msg); // Free unused message on exit
     }
+    rc = 0;
+  }
+
+  return rc;
+}
+
+Message * MSGQSubSocket::receive(bool non_blocking){
+  msgq_msg_t msg;
+  MSGQMessage *r = NULL;
+
+  if (recv(&msg, non_blocking, false) > 0){
+    r = new MSGQMessage;
+    r->takeOwnership(msg.data, msg.size);
   }
 
   return (Message*)r;
 }
 
+Message * MSGQSubSocket::receive_borrow(bool non_blocking){
+  msgq_msg_t msg;
+
+  if (recv(&msg, non_blocking, true) <= 0){
+    return NULL;
+  }
+
+  // Reuse a single message object, it only points into the queue
+  if (borrowed == NULL){
+    borrowed = new MSGQMessage;
+  }
+  ((MSGQMessage*)borrowed)->borrow(msg.data, msg.size);
+
+  return borrowed;
+}
+
+bool MSGQSubSocket::borrow_valid(){
+  return msgq_msg_borrow_valid(q);
+}
+
+void MSGQSubSocket::release_borrow(){
+  msgq_msg_release(q);
+}
+
+int MSGQSubSocket::receive_batch(size_t max, const std::function<void(char *data, size_t size)> &callback){
+  return msgq_msg_recv_many(q, max, callback);
+}
+
 void MSGQSubSocket::setTimeout(int t){
   timeout = t;
 }
@@ -170,7 +232,7 @@ int MSGQPubSocket::connect(Context *context, std::string endpoint, bool check_en
   }
 
   q = new msgq_queue_t;
-  int r = msgq_new_queue(q, endpoint.c_str(), get_size(endpoint));
+  int r = msgq_new_queue(q, endpoint.c_str(), get_size(endpoint), get_num_readers(endpoint));
   if (r != 0){
     return r;
   }
@@ -196,6 +258,14 @@ int MSGQPubSocket::send(char *data, size_t size){
   return msgq_msg_send(&msg, q);
 }
 
+char * MSGQPubSocket::reserve(size_t size){
+  return msgq_msg_reserve(q, size);
+}
+
+int MSGQPubSocket::commit(){
+  return msgq_msg_commit(q);
+}
+
 bool MSGQPubSocket::all_readers_updated() {
   return msgq_all_readers_updated(q);
 }
@@ -216,15 +286,141 @@ void MSGQPoller::registerSocket(SubSocket * socket){
   num_polls++;
 }
 
-std::vector<SubSocket*> MSGQPoller::poll(int timeout){
-  std::vector<SubSocket*> r;
+void MSGQPoller::registerFd(int fd){
+  assert(num_fds + 1 < MAX_POLLERS);
+#ifdef __APPLE__
+  poll_fds[num_fds].fd = fd;
+  poll_fds[num_fds].events = POLLIN;
+#else
+  if (epoll_fd < 0){
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    assert(epoll_fd >= 0);
+  }
+
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  int ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+  assert(ret == 0);
+#endif
+  num_fds++;
+}
+
+void MSGQPoller::pollFds(int timeout){
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+
+#ifdef __APPLE__
+  // No epoll_pwait, and a message doesn't interrupt poll(), so the fds are polled in
+  // slices of MSGQ_FD_POLL_INTERVAL_MS with the queues checked in between
+  while (true){
+    int num = msgq_poll(polls, num_polls, 0);
+    int ms = 0;
+    if (num == 0 && timeout != 0){
+      ms = MSGQ_FD_POLL_INTERVAL_MS;
+      if (timeout != -1){
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+        ms = std::min<int64_t>(std::max<int64_t>(left, 0), ms);
+      }
+    }
+
+    int n = ::poll(poll_fds, num_fds, ms);
+    for (size_t i = 0; n > 0 && i < num_fds; i++){
+      if (poll_fds[i].revents){
+        ready_fds.push_back(poll_fds[i].fd);
+      }
+    }
+
+    if (num == 0){
+      num = msgq_poll(polls, num_polls, 0);
+    }
+
+    if (num > 0 || n > 0 || timeout == 0){
+      break;
+    }
+    if (timeout != -1 && std::chrono::steady_clock::now() >= deadline){
+      break;
+    }
+  }
+#else
+  // Queues are parked in signal mode like a multi-queue msgq_poll, but SIGUSR2 is only
+  // unblocked inside epoll_pwait. A message sent after the ready check interrupts the
+  // wait, one sent before it is seen by the check.
+  sigset_t mask, old_mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+
+  sigset_t wait_mask = old_mask;
+  sigdelset(&wait_mask, SIGUSR2);
+
+  struct epoll_event events[MAX_POLLERS];
+
+  while (true){
+    for (size_t i = 0; i < num_polls; i++){
+      msgq_park(polls[i].q, MSGQ_WAIT_SIGNAL);
+    }
+
+    // Don't block when a queue is already ready, but still collect the ready fds
+    int num = msgq_poll(polls, num_polls, 0);
+    int ms = 0;
+    if (num == 0 && timeout != 0){
+      // Without a timeout, wake up every 100 ms anyway to notice evictions
+      ms = 100;
+      if (timeout != -1){
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+        ms = std::max<int64_t>(left, 0);
+      }
+    }
+
+    int n = epoll_pwait(epoll_fd, events, MAX_POLLERS, ms, &wait_mask);
+
+    for (size_t i = 0; i < num_polls; i++){
+      msgq_unpark(polls[i].q);
+    }
+
+    for (int i = 0; i < n; i++){
+      ready_fds.push_back(events[i].data.fd);
+    }
+
+    if (num == 0){
+      num = msgq_poll(polls, num_polls, 0);
+    }
+
+    if (num > 0 || n > 0 || timeout == 0){
+      break;
+    }
+    if (timeout != -1 && std::chrono::steady_clock::now() >= deadline){
+      break;
+    }
+  }
+
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+#endif
+}
+
+void MSGQPoller::poll(int timeout, std::vector<SubSocket*> &ready){
+  ready.clear();
+  ready_fds.clear();
+
+  if (num_fds == 0){
+    msgq_poll(polls, num_polls, timeout);
+  } else {
+    pollFds(timeout);
+  }
 
-  msgq_poll(polls, num_polls, timeout);
   for (size_t i = 0; i < num_polls; i++){
     if (polls[i].revents){
-      r.push_back(sockets[i]);
+      ready.push_back(sockets[i]);
     }
   }
 
-  return r;
+  readTimers();
+}
+
+MSGQPoller::~MSGQPoller(){
+#ifndef __APPLE__
+  if (epoll_fd >= 0){
+    close(epoll_fd);
+  }
+#endif
 }
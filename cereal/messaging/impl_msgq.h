@@ -3,8 +3,13 @@
 #include "msgq.h"
 #include <zmq.h>
 #include <string>
+#ifdef __APPLE__
+#include <poll.h>
+#endif
 
 #define MAX_POLLERS 128
+// How often queues are checked while waiting on raw fds without epoll
+#define MSGQ_FD_POLL_INTERVAL_MS 10
 
 class MSGQContext : public Context {
 private:
@@ -17,12 +22,14 @@ public:
 
 class MSGQMessage : public Message {
 private:
-  char * data;
-  size_t size;
+  char * data = NULL;
+  size_t size = 0;
+  bool owned = true;
 public:
   void init(size_t size);
   void init(char *data, size_t size);
   void takeOwnership(char *data, size_t size);
+  void borrow(char *data, size_t size);
   size_t getSize(){return size;}
   char * getData(){return data;}
   void close();
@@ -33,11 +40,16 @@ class MSGQSubSocket : public SubSocket {
 private:
   msgq_queue_t * q = NULL;
   int timeout;
+  int recv(msgq_msg_t *msg, bool non_blocking, bool borrow);
 public:
   int connect(Context *context, std::string endpoint, std::string address, bool conflate=false, bool check_endpoint=true);
   void setTimeout(int timeout);
   void * getRawSocket() {return (void*)q;}
   Message *receive(bool non_blocking=false);
+  Message *receive_borrow(bool non_blocking=false);
+  bool borrow_valid();
+  void release_borrow();
+  int receive_batch(size_t max, const std::function<void(char *data, size_t size)> &callback);
   ~MSGQSubSocket();
 };
 
@@ -48,6 +60,8 @@ public:
   int connect(Context *context, std::string endpoint, bool check_endpoint=true);
   int sendMessage(Message *message);
   int send(char *data, size_t size);
+  char *reserve(size_t size);
+  int commit();
   bool all_readers_updated();
   ~MSGQPubSocket();
 };
@@ -57,9 +71,18 @@ private:
   std::vector<SubSocket*> sockets;
   msgq_pollitem_t polls[MAX_POLLERS];
   size_t num_polls = 0;
+  size_t num_fds = 0;
+#ifdef __APPLE__
+  struct pollfd poll_fds[MAX_POLLERS];
+#else
+  int epoll_fd = -1;
+#endif
+  void pollFds(int timeout);
 
 public:
   void registerSocket(SubSocket *socket);
-  std::vector<SubSocket*> poll(int timeout);
-  ~MSGQPoller(){};
+  void registerFd(int fd);
+  using Poller::poll;
+  void poll(int timeout, std::vector<SubSocket*> &ready);
+  ~MSGQPoller();
 };
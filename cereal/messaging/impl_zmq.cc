@@ -108,7 +108,7 @@ ZMQSubSocket::~ZMQSubSocket(){
 }
 
 int ZMQPubSocket::connect(Context *context, std::string endpoint, bool check_endpoint){
-  sock = zmq_socket(context->getRawContext(), ZMQ_PUB);
+  sock = zmq_socket(context->getRawContext(), xpub ? ZMQ_XPUB : ZMQ_PUB);
   if (sock == NULL){
     return -1;
   }
@@ -136,6 +136,18 @@ bool ZMQPubSocket::all_readers_updated() {
   return false;
 }
 
+bool ZMQPubSocket::has_subscribers() {
+  assert(xpub);
+
+  // XPUB only passes the first subscribe and the last unsubscribe per topic.
+  // The first byte is 1 for subscribe and 0 for unsubscribe, followed by the topic.
+  char buf[256];
+  while (zmq_recv(sock, buf, sizeof(buf), ZMQ_DONTWAIT) > 0){
+    num_subscriptions += (buf[0] == 1) ? 1 : -1;
+  }
+  return num_subscriptions > 0;
+}
+
 ZMQPubSocket::~ZMQPubSocket(){
   zmq_close(sock);
 }
@@ -150,19 +162,34 @@ void ZMQPoller::registerSocket(SubSocket * socket){
   num_polls++;
 }
 
-std::vector<SubSocket*> ZMQPoller::poll(int timeout){
-  std::vector<SubSocket*> r;
+void ZMQPoller::registerFd(int fd){
+  assert(num_polls + 1 < MAX_POLLERS);
+  polls[num_polls].socket = NULL;
+  polls[num_polls].fd = fd;
+  polls[num_polls].events = ZMQ_POLLIN;
+
+  sockets.push_back(NULL);
+  num_polls++;
+}
+
+void ZMQPoller::poll(int timeout, std::vector<SubSocket*> &ready){
+  ready.clear();
+  ready_fds.clear();
 
   int rc = zmq_poll(polls, num_polls, timeout);
   if (rc < 0){
-    return r;
+    return;
   }
 
   for (size_t i = 0; i < num_polls; i++){
     if (polls[i].revents){
-      r.push_back(sockets[i]);
+      if (sockets[i] != NULL){
+        ready.push_back(sockets[i]);
+      } else {
+        ready_fds.push_back(polls[i].fd);
+      }
     }
   }
 
-  return r;
+  readTimers();
 }
@@ -43,11 +43,16 @@ class ZMQPubSocket : public PubSocket {
 private:
   void * sock;
   std::string full_endpoint;
+  bool xpub;
+  int num_subscriptions = 0;
 public:
+  // xpub tracks remote subscriptions, see has_subscribers()
+  ZMQPubSocket(bool xpub=false) : xpub(xpub) {}
   int connect(Context *context, std::string endpoint, bool check_endpoint=true);
   int sendMessage(Message *message);
   int send(char *data, size_t size);
   bool all_readers_updated();
+  bool has_subscribers();
   ~ZMQPubSocket();
 };
 
@@ -59,6 +64,8 @@ private:
 
 public:
   void registerSocket(SubSocket *socket);
-  std::vector<SubSocket*> poll(int timeout);
+  void registerFd(int fd);
+  using Poller::poll;
+  void poll(int timeout, std::vector<SubSocket*> &ready);
   ~ZMQPoller(){};
 };
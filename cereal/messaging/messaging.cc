@@ -1,3 +1,9 @@
+#include <cassert>
+#include <unistd.h>
+#ifndef __APPLE__
+#include <sys/timerfd.h>
+#endif
+
 #include "messaging.h"
 #include "impl_zmq.h"
 #include "impl_msgq.h"
@@ -44,6 +50,39 @@ SubSocket * SubSocket::create(Context * context, std::string endpoint, std::stri
   }
 }
 
+Message * SubSocket::receive_borrow(bool non_blocking){
+  delete borrowed;
+  borrowed = receive(non_blocking);
+  return borrowed;
+}
+
+void SubSocket::release_borrow(){
+  delete borrowed;
+  borrowed = nullptr;
+}
+
+char * PubSocket::reserve(size_t size){
+  reserved.resize(size);
+  return reserved.data();
+}
+
+int PubSocket::commit(){
+  return send(reserved.data(), reserved.size());
+}
+
+int SubSocket::receive_batch(size_t max, const std::function<void(char *data, size_t size)> &callback){
+  size_t count = 0;
+  while (count < max){
+    Message *msg = receive(true);
+    if (msg == NULL) break;
+
+    callback(msg->getData(), msg->getSize());
+    delete msg;
+    count++;
+  }
+  return count;
+}
+
 PubSocket * PubSocket::create(){
   PubSocket * s;
   if (messaging_use_zmq()){
@@ -76,6 +115,50 @@ Poller * Poller::create(){
   return p;
 }
 
+int Poller::registerTimer(int period_ms){
+#ifdef __APPLE__
+  // TODO: no timerfd on macOS
+  assert(false);
+  return -1;
+#else
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  assert(fd >= 0);
+
+  struct itimerspec spec = {};
+  spec.it_interval.tv_sec = period_ms / 1000;
+  spec.it_interval.tv_nsec = (period_ms % 1000) * 1000 * 1000;
+  spec.it_value = spec.it_interval;
+  int ret = timerfd_settime(fd, 0, &spec, NULL);
+  assert(ret == 0);
+
+  timers[fd] = 0;
+  registerFd(fd);
+  return fd;
+#endif
+}
+
+void Poller::readTimers(){
+  for (auto &t : timers){
+    t.second = 0;
+  }
+
+  for (int fd : ready_fds){
+    auto it = timers.find(fd);
+    if (it == timers.end()) continue;
+
+    uint64_t expirations = 0;
+    if (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations)){
+      it->second = expirations;
+    }
+  }
+}
+
+Poller::~Poller(){
+  for (auto &t : timers){
+    close(t.first);
+  }
+}
+
 Poller * Poller::create(std::vector<SubSocket*> sockets){
   Poller * p = Poller::create();
 
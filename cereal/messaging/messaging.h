@@ -1,5 +1,7 @@
 #pragma once
 #include <cstddef>
+#include <functional>
+#include <initializer_list>
 #include <map>
 #include <string>
 #include <vector>
@@ -37,10 +39,22 @@ public:
   virtual int connect(Context *context, std::string endpoint, std::string address, bool conflate=false, bool check_endpoint=true) = 0;
   virtual void setTimeout(int timeout) = 0;
   virtual Message *receive(bool non_blocking=false) = 0;
+  // Receive without copying the message out of the transport, if supported.
+  // The message is owned by the socket and only valid until the next receive,
+  // call borrow_valid() after reading it to check it wasn't overwritten.
+  virtual Message *receive_borrow(bool non_blocking=false);
+  virtual bool borrow_valid() { return true; }
+  // Done with the borrowed message, so the reader no longer holds it in the queue
+  virtual void release_borrow();
+  // Non-blocking receive of up to max pending messages, calling callback on each in place.
+  // Returns the number of messages, or -1 if they were overwritten while being read
+  virtual int receive_batch(size_t max, const std::function<void(char *data, size_t size)> &callback);
   virtual void * getRawSocket() = 0;
   static SubSocket * create();
   static SubSocket * create(Context * context, std::string endpoint, std::string address="127.0.0.1", bool conflate=false, bool check_endpoint=true);
-  virtual ~SubSocket(){};
+  virtual ~SubSocket(){ delete borrowed; };
+protected:
+  Message *borrowed = nullptr;
 };
 
 class PubSocket {
@@ -48,31 +62,66 @@ public:
   virtual int connect(Context *context, std::string endpoint, bool check_endpoint=true) = 0;
   virtual int sendMessage(Message *message) = 0;
   virtual int send(char *data, size_t size) = 0;
+  // Reserve a buffer of exactly size bytes to serialize a message into, and send it with commit().
+  // Transports that support it hand out memory in the queue itself so no copy is needed
+  virtual char *reserve(size_t size);
+  virtual int commit();
   virtual bool all_readers_updated() = 0;
   static PubSocket * create();
   static PubSocket * create(Context * context, std::string endpoint, bool check_endpoint=true);
   static PubSocket * create(Context * context, std::string endpoint, int port, bool check_endpoint=true);
   virtual ~PubSocket(){};
+protected:
+  std::vector<char> reserved;
 };
 
 class Poller {
 public:
   virtual void registerSocket(SubSocket *socket) = 0;
-  virtual std::vector<SubSocket*> poll(int timeout) = 0;
+  // Also wake up when a raw fd (usb, unix socket, ...) is readable, see readyFds()
+  virtual void registerFd(int fd) = 0;
+  // Periodic timer, returns its fd as reported by readyFds(). poll() consumes the expirations
+  int registerTimer(int period_ms);
+  // Fills ready with the sockets that have a message, reusing its storage
+  virtual void poll(int timeout, std::vector<SubSocket*> &ready) = 0;
+  inline std::vector<SubSocket*> poll(int timeout) {
+    std::vector<SubSocket*> ready;
+    poll(timeout, ready);
+    return ready;
+  }
+  // Raw fds and timers that were ready in the last poll()
+  inline const std::vector<int> &readyFds() const { return ready_fds; }
+  // Number of times the timer fired since the previous poll()
+  inline uint64_t timerExpirations(int timer_fd) const { return timers.at(timer_fd); }
   static Poller * create();
   static Poller * create(std::vector<SubSocket*> sockets);
-  virtual ~Poller(){};
+  virtual ~Poller();
+protected:
+  void readTimers();
+  std::vector<int> ready_fds;
+  std::map<int, uint64_t> timers;
 };
 
+// Generated into services.h, the typed overloads below index arrays instead of looking up strings
+enum class ServiceId : uint16_t;
+
 class SubMaster {
 public:
   SubMaster(const std::vector<const char *> &service_list,
             const char *address = nullptr, const std::vector<const char *> &ignore_alive = {});
+  // The typed overloads take braced lists only, so {"a", "b"} can't also be read as a
+  // std::vector<ServiceId> built from a pair of char iterators
+  SubMaster(std::initializer_list<ServiceId> service_list,
+            const char *address = nullptr, std::initializer_list<ServiceId> ignore_alive = {});
   void update(int timeout = 1000);
   void update_msgs(uint64_t current_time, std::vector<std::pair<std::string, cereal::Event::Reader>> messages);
+  void update_msgs(uint64_t current_time, const std::vector<std::pair<ServiceId, cereal::Event::Reader>> &messages);
   inline bool allAlive(const std::vector<const char *> &service_list = {}) { return all_(service_list, false, true); }
   inline bool allValid(const std::vector<const char *> &service_list = {}) { return all_(service_list, true, false); }
   inline bool allAliveAndValid(const std::vector<const char *> &service_list = {}) { return all_(service_list, true, true); }
+  inline bool allAlive(std::initializer_list<ServiceId> service_list) { return all_(service_list, false, true); }
+  inline bool allValid(std::initializer_list<ServiceId> service_list) { return all_(service_list, true, false); }
+  inline bool allAliveAndValid(std::initializer_list<ServiceId> service_list) { return all_(service_list, true, true); }
   void drain();
   ~SubMaster();
 
@@ -84,12 +133,26 @@ public:
   uint64_t rcv_time(const char *name) const;
   cereal::Event::Reader &operator[](const char *name) const;
 
+  bool updated(ServiceId id) const;
+  bool alive(ServiceId id) const;
+  bool valid(ServiceId id) const;
+  uint64_t rcv_frame(ServiceId id) const;
+  uint64_t rcv_time(ServiceId id) const;
+  cereal::Event::Reader &operator[](ServiceId id) const;
+
 private:
+  struct SubMessage;
+  void subscribe_(ServiceId id, const char *address, bool ignore_alive);
   bool all_(const std::vector<const char *> &service_list, bool valid, bool alive);
+  bool all_(std::initializer_list<ServiceId> service_list, bool valid, bool alive);
+  void update_msg_(SubMessage *m, uint64_t current_time, cereal::Event::Reader event);
+  void update_alive_(uint64_t current_time);
+  SubMessage *get_(ServiceId id) const;
   Poller *poller_ = nullptr;
-  struct SubMessage;
+  std::vector<SubSocket *> ready_;
   std::map<SubSocket *, SubMessage *> messages_;
   std::map<std::string, SubMessage *> services_;
+  std::vector<SubMessage *> ids_;  // indexed by ServiceId, nullptr if not subscribed
 };
 
 class MessageBuilder : public capnp::MallocMessageBuilder {
@@ -111,6 +174,16 @@ public:
     return heapArray_.asBytes();
   }
 
+  size_t getSerializedSize() {
+    return capnp::computeSerializedSizeInWords(*this) * sizeof(capnp::word);
+  }
+
+  // Serialize into a caller provided buffer of getSerializedSize() bytes, without a heap array
+  void toBuffer(capnp::byte *buf, size_t size) {
+    kj::ArrayOutputStream stream(kj::arrayPtr(buf, size));
+    capnp::writeMessage(stream, *this);
+  }
+
 private:
   kj::Array<capnp::word> heapArray_;
 };
@@ -118,12 +191,18 @@ private:
 class PubMaster {
 public:
   PubMaster(const std::vector<const char *> &service_list);
+  PubMaster(std::initializer_list<ServiceId> service_list);
   inline int send(const char *name, capnp::byte *data, size_t size) { return sockets_.at(name)->send((char *)data, size); }
   int send(const char *name, MessageBuilder &msg);
+  inline int send(ServiceId id, capnp::byte *data, size_t size) { return get_(id)->send((char *)data, size); }
+  int send(ServiceId id, MessageBuilder &msg);
   ~PubMaster();
 
 private:
+  void publish_(ServiceId id);
+  PubSocket *get_(ServiceId id) const;
   std::map<std::string, PubSocket *> sockets_;
+  std::vector<PubSocket *> ids_;  // indexed by ServiceId, nullptr if not published
 };
 
 class AlignedBuffer {
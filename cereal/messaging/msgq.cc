@@ -8,9 +8,11 @@
 #include <algorithm>
 #include <cstdlib>
 #include <csignal>
+#include <climits>
 #include <random>
 
 #include <poll.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -19,6 +21,10 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <linux/futex.h>
+#endif
+
 #include <stdio.h>
 
 #include "msgq.h"
@@ -41,6 +47,59 @@ uint64_t msgq_get_uid(void){
   return uid;
 }
 
+static uint32_t msgq_get_tid(void){
+  #ifdef __APPLE__
+    return getpid();
+  #else
+    return syscall(SYS_gettid);
+  #endif
+}
+
+static uint64_t msgq_now(void){
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static void thread_signal(uint32_t tid) {
+  #ifndef SYS_tkill
+    // TODO: this won't work for multithreaded programs
+    kill(tid, SIGUSR2);
+  #else
+    syscall(SYS_tkill, tid, SIGUSR2);
+  #endif
+}
+
+static void futex_wait(std::atomic<uint32_t> *addr, uint32_t val, const struct timespec *ts){
+  #ifdef __linux__
+    // Word must be shared between processes, so no FUTEX_PRIVATE_FLAG
+    syscall(SYS_futex, addr, FUTEX_WAIT, val, ts, NULL, 0);
+  #else
+    // TODO: no futex on macOS, just sleep
+    if (addr->load() == val) nanosleep(ts, NULL);
+  #endif
+}
+
+static void futex_wake(std::atomic<uint32_t> *addr){
+  #ifdef __linux__
+    syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+  #endif
+}
+
+static void msgq_wake_reader(msgq_queue_t *q, uint64_t id){
+  // Readers that are not parked will see the new write pointer on their next poll
+  if (q->read_waits[id]->load() == MSGQ_WAIT_NONE){
+    return;
+  }
+
+  uint32_t wait = q->read_waits[id]->exchange(MSGQ_WAIT_NONE);
+  if (wait == MSGQ_WAIT_FUTEX){
+    futex_wake(q->read_waits[id]);
+  } else if (wait == MSGQ_WAIT_SIGNAL){
+    thread_signal(*q->read_waiter_tids[id]);
+  }
+}
+
 int msgq_msg_init_size(msgq_msg_t * msg, size_t size){
   msg->size = size;
   msg->data = new(std::nothrow) char[size];
@@ -69,6 +128,9 @@ int msgq_msg_close(msgq_msg_t * msg){
 
 void msgq_reset_reader(msgq_queue_t * q){
   int id = q->reader_id;
+  if (!*q->read_valids[id]){
+    q->reader_stats[id].resets++;
+  }
   q->read_valids[id]->store(true);
   q->read_pointers[id]->store(*q->write_pointer);
 }
@@ -82,9 +144,52 @@ void msgq_wait_for_subscriber(msgq_queue_t *q){
 }
 
 
-int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size){
+static size_t msgq_header_size(size_t num_readers){
+  return ALIGN_CACHELINE(sizeof(msgq_header_t)) + num_readers * (sizeof(msgq_reader_t) + sizeof(msgq_reader_stats_t));
+}
+
+// Setup pointers to the header segment
+static void msgq_map_queue(msgq_queue_t * q, char * mem, size_t size, size_t num_readers){
+  msgq_header_t *header = (msgq_header_t *)mem;
+  q->mmap_p = mem;
+  q->header = header;
+
+  q->num_readers = reinterpret_cast<std::atomic<uint64_t>*>(&header->num_readers);
+  q->write_pointer = reinterpret_cast<std::atomic<uint64_t>*>(&header->write_pointer);
+  q->write_uid = reinterpret_cast<std::atomic<uint64_t>*>(&header->write_uid);
+
+  msgq_reader_t *readers = (msgq_reader_t *)(mem + ALIGN_CACHELINE(sizeof(msgq_header_t)));
+  q->reader_stats = (msgq_reader_stats_t *)(readers + num_readers);
+  q->num_reader_slots = num_readers;
+  q->read_pointers.resize(num_readers);
+  q->read_valids.resize(num_readers);
+  q->read_uids.resize(num_readers);
+  q->read_waiter_tids.resize(num_readers);
+  q->read_waits.resize(num_readers);
+
+  for (size_t i = 0; i < num_readers; i++){
+    q->read_pointers[i] = reinterpret_cast<std::atomic<uint64_t>*>(&readers[i].read_pointer);
+    q->read_valids[i] = reinterpret_cast<std::atomic<uint64_t>*>(&readers[i].read_valid);
+    q->read_uids[i] = reinterpret_cast<std::atomic<uint64_t>*>(&readers[i].read_uid);
+    q->read_waiter_tids[i] = reinterpret_cast<std::atomic<uint64_t>*>(&readers[i].waiter_tid);
+    q->read_waits[i] = reinterpret_cast<std::atomic<uint32_t>*>(&readers[i].wait);
+  }
+
+  size_t header_size = msgq_header_size(num_readers);
+  q->data = mem + header_size;
+  q->size = size;
+  q->header_size = header_size;
+  q->reader_id = -1;
+  q->borrowed = false;
+  q->reserved_size = -1;
+  q->read_conflate = false;
+}
+
+int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size, size_t num_readers){
   assert(size < 0xFFFFFFFF); // Buffer must be smaller than 2^32 bytes
+  assert(num_readers > 0 && num_readers <= MAX_NUM_READERS);
   std::signal(SIGUSR2, sigusr2_handler);
+  q->mmap_p = NULL;
 
   const char * prefix = "/dev/shm/";
   char * full_path = new char[strlen(path) + strlen(prefix) + 1];
@@ -97,47 +202,95 @@ int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size){
     delete[] full_path;
     return -1;
   }
-  delete[] full_path;
 
-  int rc = ftruncate(fd, size + sizeof(msgq_header_t));
+  size_t header_size = msgq_header_size(num_readers);
+  size_t total_size = size + header_size;
+
+  // Only size a new segment, never resize one created with a different layout
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (st.st_size != 0 && (size_t)st.st_size != total_size)){
+    std::cout << "Error, " << full_path << " has a different size and is stale, stop all processes and delete " << full_path << std::endl;
+    delete[] full_path;
+    close(fd);
+    errno = EPROTO;
+    return -1;
+  }
+
+  int rc = ftruncate(fd, total_size);
   if (rc < 0){
+    delete[] full_path;
     close(fd);
     return -1;
   }
-  char * mem = (char*)mmap(NULL, size + sizeof(msgq_header_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  char * mem = (char*)mmap(NULL, total_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
   close(fd);
 
-  if (mem == NULL){
+  if (mem == MAP_FAILED){
+    delete[] full_path;
     return -1;
   }
-  q->mmap_p = mem;
 
   msgq_header_t *header = (msgq_header_t *)mem;
 
-  // Setup pointers to header segment
-  q->num_readers = reinterpret_cast<std::atomic<uint64_t>*>(&header->num_readers);
-  q->write_pointer = reinterpret_cast<std::atomic<uint64_t>*>(&header->write_pointer);
-  q->write_uid = reinterpret_cast<std::atomic<uint64_t>*>(&header->write_uid);
+  // First process to open the segment claims the format, others check it
+  uint64_t format, expected = 0;
+  PACK64(format, (MSGQ_MAGIC | MSGQ_VERSION), num_readers);
+  auto format_p = reinterpret_cast<std::atomic<uint64_t>*>(&header->format);
+  if (!std::atomic_compare_exchange_strong(format_p, &expected, format) && expected != format){
+    std::cout << "Error, " << full_path << " has format " << std::hex << expected << ", expected " << format << std::dec
+              << " and is stale, stop all processes and delete " << full_path << std::endl;
+    delete[] full_path;
+    munmap(mem, total_size);
+    errno = EPROTO;
+    return -1;
+  }
+  delete[] full_path;
+
+  msgq_map_queue(q, mem, size, num_readers);
+  q->endpoint = path;
 
-  for (size_t i = 0; i < NUM_READERS; i++){
-    q->read_pointers[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_pointers[i]);
-    q->read_valids[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_valids[i]);
-    q->read_uids[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_uids[i]);
+  return 0;
+}
+
+int msgq_open_readonly(msgq_queue_t * q, const char * path){
+  q->mmap_p = NULL;
+  std::string full_path = std::string("/dev/shm/") + path;
+
+  auto fd = open(full_path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return -1;
   }
 
-  q->data = mem + sizeof(msgq_header_t);
-  q->size = size;
-  q->reader_id = -1;
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(msgq_header_t)){
+    close(fd);
+    return -1;
+  }
+
+  char * mem = (char*)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED){
+    return -1;
+  }
 
+  uint32_t magic, num_readers;
+  UNPACK64(magic, num_readers, ((msgq_header_t *)mem)->format);
+  size_t header_size = msgq_header_size(num_readers);
+  if (magic != (MSGQ_MAGIC | MSGQ_VERSION) || num_readers == 0 || num_readers > MAX_NUM_READERS ||
+      (size_t)st.st_size <= header_size){
+    munmap(mem, st.st_size);
+    return -1;
+  }
+
+  msgq_map_queue(q, mem, st.st_size - header_size, num_readers);
   q->endpoint = path;
-  q->read_conflate = false;
 
   return 0;
 }
 
 void msgq_close_queue(msgq_queue_t *q){
   if (q->mmap_p != NULL){
-    munmap(q->mmap_p, q->size + sizeof(msgq_header_t));
+    munmap(q->mmap_p, q->size + q->header_size);
   }
 }
 
@@ -149,23 +302,17 @@ void msgq_init_publisher(msgq_queue_t * q) {
   *q->write_uid = uid;
   *q->num_readers = 0;
 
-  for (size_t i = 0; i < NUM_READERS; i++){
+  for (size_t i = 0; i < q->num_reader_slots; i++){
     *q->read_valids[i] = false;
     *q->read_uids[i] = 0;
+
+    // Wake up reader in case they are in a poll, so they reconnect
+    msgq_wake_reader(q, i);
   }
 
   q->write_uid_local = uid;
 }
 
-static void thread_signal(uint32_t tid) {
-  #ifndef SYS_tkill
-    // TODO: this won't work for multithreaded programs
-    kill(tid, SIGUSR2);
-  #else
-    syscall(SYS_tkill, tid, SIGUSR2);
-  #endif
-}
-
 void msgq_init_subscriber(msgq_queue_t * q) {
   assert(q != NULL);
   assert(q->num_readers != NULL);
@@ -178,18 +325,17 @@ void msgq_init_subscriber(msgq_queue_t * q) {
     uint64_t new_num_readers = cur_num_readers + 1;
 
     // No more slots available. Reset all subscribers to kick out inactive ones
-    if (new_num_readers > NUM_READERS){
+    if (new_num_readers > q->num_reader_slots){
       std::cout << "Warning, evicting all subscribers!" << std::endl;
       *q->num_readers = 0;
+      q->header->evictions++;
 
-      for (size_t i = 0; i < NUM_READERS; i++){
+      for (size_t i = 0; i < q->num_reader_slots; i++){
         *q->read_valids[i] = false;
-
-        uint64_t old_uid = *q->read_uids[i];
         *q->read_uids[i] = 0;
 
         // Wake up reader in case they are in a poll
-        thread_signal(old_uid & 0xFFFFFFFF);
+        msgq_wake_reader(q, i);
       }
 
       continue;
@@ -202,29 +348,33 @@ void msgq_init_subscriber(msgq_queue_t * q) {
                                             new_num_readers)){
       q->reader_id = cur_num_readers;
       q->read_uid_local = uid;
+      q->borrowed = false;
 
       // We start with read_valid = false,
       // on the first read the read pointer will be synchronized with the write pointer
       *q->read_valids[cur_num_readers] = false;
       *q->read_pointers[cur_num_readers] = 0;
       *q->read_uids[cur_num_readers] = uid;
+      *q->read_waits[cur_num_readers] = MSGQ_WAIT_NONE;
+      memset(&q->reader_stats[cur_num_readers], 0, sizeof(msgq_reader_stats_t));
       break;
     }
   }
 
   //std::cout << "New subscriber id: " << q->reader_id << " uid: " << q->read_uid_local << " " << q->endpoint << std::endl;
   msgq_reset_reader(q);
+  q->reader_stats[q->reader_id].resets = 0;
 }
 
-int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
+char * msgq_msg_reserve(msgq_queue_t *q, size_t size){
   // Die if we are no longer the active publisher
   if (q->write_uid_local != *q->write_uid){
     std::cout << "Killing old publisher: " << q->endpoint << std::endl;
     errno = EADDRINUSE;
-    return -1;
+    return NULL;
   }
 
-  uint64_t total_msg_size = ALIGN(msg->size + sizeof(int64_t));
+  uint64_t total_msg_size = ALIGN(size + MSGQ_MSG_HEADER_SIZE);
 
   // We need to fit at least three messages in the queue,
   // then we can always safely access the last message
@@ -251,15 +401,16 @@ int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
       uint64_t read_cycles = read_pointer >> 32;
       read_pointer &= 0xFFFFFFFF;
 
-      if ((read_pointer > write_pointer) && (read_cycles != write_cycles)) {
+      if ((read_pointer > write_pointer) && (read_cycles != write_cycles) && *q->read_valids[i]) {
         *q->read_valids[i] = false;
+        q->header->invalidations++;
       }
     }
 
-    // Update global and local copies of write pointer and write_cycles
+    // Update local copies of write pointer and write_cycles,
+    // the global write pointer is only moved on commit
     write_pointer = 0;
     write_cycles = write_cycles + 1;
-    PACK64(*q->write_pointer, write_cycles, write_pointer);
 
     // Set actual pointer to the beginning of the data segment
     p = q->data;
@@ -267,41 +418,69 @@ int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
 
   // Invalidate readers that are in the area that will be written
   uint64_t start = write_pointer;
-  uint64_t end = ALIGN(start + sizeof(int64_t) + msg->size);
+  uint64_t end = ALIGN(start + MSGQ_MSG_HEADER_SIZE + size);
 
   for (uint64_t i = 0; i < num_readers; i++){
     uint32_t read_cycles, read_pointer;
     UNPACK64(read_cycles, read_pointer, *q->read_pointers[i]);
 
-    if ((read_pointer >= start) && (read_pointer < end) && (read_cycles != write_cycles)) {
+    if ((read_pointer >= start) && (read_pointer < end) && (read_cycles != write_cycles) && *q->read_valids[i]) {
       *q->read_valids[i] = false;
+      q->header->invalidations++;
     }
   }
 
+  q->reserved_size = size;
+  PACK64(q->reserved_write_pointer, write_cycles, write_pointer);
+  return p + MSGQ_MSG_HEADER_SIZE;
+}
 
-  // Write size tag
-  std::atomic<int64_t> *size_p = reinterpret_cast<std::atomic<int64_t>*>(p);
-  *size_p = msg->size;
+int msgq_msg_commit(msgq_queue_t *q){
+  assert(q->reserved_size >= 0); // Make sure a message was reserved
+  int64_t size = q->reserved_size;
+  q->reserved_size = -1;
 
-  // Copy data
-  memcpy(p + sizeof(int64_t), msg->data, msg->size);
+  uint32_t write_cycles, write_pointer;
+  UNPACK64(write_cycles, write_pointer, q->reserved_write_pointer);
+  char *p = q->data + write_pointer;
+
+  // Write publish time and size tag
+  *(uint64_t*)(p + sizeof(int64_t)) = msgq_now();
+  std::atomic<int64_t> *size_p = reinterpret_cast<std::atomic<int64_t>*>(p);
+  *size_p = size;
   __sync_synchronize();
 
   // Update write pointer
-  uint32_t new_ptr = ALIGN(write_pointer + msg->size + sizeof(int64_t));
+  uint32_t new_ptr = ALIGN(write_pointer + size + MSGQ_MSG_HEADER_SIZE);
   PACK64(*q->write_pointer, write_cycles, new_ptr);
+  q->header->msgs_written++;
+  q->header->bytes_written += size;
 
-  // Notify readers
+  // Notify readers. Only parked readers cost a syscall
+  uint64_t num_readers = *q->num_readers;
   for (uint64_t i = 0; i < num_readers; i++){
-    uint64_t reader_uid = *q->read_uids[i];
-    thread_signal(reader_uid & 0xFFFFFFFF);
+    msgq_wake_reader(q, i);
   }
 
-  return msg->size;
+  return size;
+}
+
+int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
+  char *p = msgq_msg_reserve(q, msg->size);
+  if (p == NULL){
+    return -1;
+  }
+
+  // Copy data
+  memcpy(p, msg->data, msg->size);
+
+  return msgq_msg_commit(q);
 }
 
 
 int msgq_msg_ready(msgq_queue_t * q){
+  msgq_msg_release(q);
+
  start:
   int id = q->reader_id;
   assert(id >= 0); // Make sure subscriber is initialized
@@ -328,7 +507,9 @@ int msgq_msg_ready(msgq_queue_t * q){
   return (read_pointer != write_pointer);
 }
 
-int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
+// Finds the next message for this reader without consuming it. Returns the message size
+// and the packed read pointer past the message, or 0 if no new message is available
+static int64_t msgq_msg_peek(msgq_queue_t * q, char ** data, uint64_t * next_read_pointer){
  start:
   int id = q->reader_id;
   assert(id >= 0); // Make sure subscriber is initialized
@@ -355,7 +536,6 @@ int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
 
   // Check if new message is available
   if (read_pointer == write_pointer) {
-    msg->size = 0;
     return 0;
   }
 
@@ -381,7 +561,7 @@ int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
   assert((uint64_t)size < q->size);
   assert(size > 0);
 
-  uint32_t new_read_pointer = ALIGN(read_pointer + sizeof(std::int64_t) + size);
+  uint32_t new_read_pointer = ALIGN(read_pointer + MSGQ_MSG_HEADER_SIZE + size);
 
   // If conflate is true, check if this is the latest message, else start over
   if (q->read_conflate){
@@ -392,16 +572,46 @@ int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
     }
   }
 
+  *data = p + MSGQ_MSG_HEADER_SIZE;
+  PACK64(*next_read_pointer, read_cycles, new_read_pointer);
+  return size;
+}
+
+static void msgq_record_read(msgq_queue_t * q, const char * data, size_t size, uint64_t now){
+  msgq_reader_stats_t *stats = &q->reader_stats[q->reader_id];
+  stats->msgs_read++;
+  stats->bytes_read += size;
+
+  uint64_t sent = *(const uint64_t*)(data - sizeof(int64_t));
+  uint64_t us = (now > sent) ? (now - sent) / 1000 : 0;
+  int bucket = (us == 0) ? 0 : std::min(64 - __builtin_clzll(us), MSGQ_LATENCY_BUCKETS - 1);
+  stats->latency[bucket]++;
+}
+
+int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
+  msgq_msg_release(q);
+
+ start:
+  char * data;
+  uint64_t next_read_pointer;
+  int64_t size = msgq_msg_peek(q, &data, &next_read_pointer);
+
+  if (size == 0) {
+    msg->size = 0;
+    return 0;
+  }
+
   // Copy message
   if (msgq_msg_init_size(msg, size) < 0)
     return -1;
 
   __sync_synchronize();
-  memcpy(msg->data, p + sizeof(int64_t), size);
+  memcpy(msg->data, data, size);
   __sync_synchronize();
 
   // Update read pointer
-  PACK64(*q->read_pointers[id], read_cycles, new_read_pointer);
+  int id = q->reader_id;
+  *q->read_pointers[id] = next_read_pointer;
 
   // Check if the actual data that was copied is valid
   if (!*q->read_valids[id]){
@@ -410,44 +620,203 @@ int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
     goto start;
   }
 
-
+  msgq_record_read(q, data, size, msgq_now());
   return msg->size;
 }
 
+int msgq_msg_recv_borrow(msgq_msg_t * msg, msgq_queue_t * q){
+  msgq_msg_release(q);
 
+  // The read pointer stays on the borrowed message until it is released,
+  // so a publisher that overwrites it invalidates this reader
+  uint64_t next_read_pointer;
+  int64_t size = msgq_msg_peek(q, &msg->data, &next_read_pointer);
+  msg->size = size;
 
-int msgq_poll(msgq_pollitem_t * items, size_t nitems, int timeout){
-  int num = 0;
+  if (size > 0){
+    q->borrowed = true;
+    q->borrow_read_pointer = next_read_pointer;
+    msgq_record_read(q, msg->data, size, msgq_now());
+  }
 
-  // Check if messages ready
+  return size;
+}
+
+int msgq_msg_recv_many(msgq_queue_t * q, size_t max, const std::function<void(char *data, size_t size)> &callback){
+  msgq_msg_release(q);
+  if (max == 0){
+    return 0;
+  }
+
+  // The first message goes through all the eviction, validity and wraparound checks
+  char * data;
+  uint64_t next_read_pointer;
+  int64_t size = msgq_msg_peek(q, &data, &next_read_pointer);
+  if (size == 0){
+    return 0;
+  }
+
+  int id = q->reader_id;
+  uint32_t write_pointer = *q->write_pointer & 0xFFFFFFFF;
+
+  // Walk the rest of the committed messages without touching the shared read pointer.
+  // It stays on the first message, so a publisher lapping us during the batch invalidates this reader
+  size_t count = 0;
+  bool wrapped = false;
+  uint64_t now = msgq_now();
+  while (true){
+    callback(data, size);
+    msgq_record_read(q, data, size, now);
+    count++;
+
+    uint32_t read_cycles, read_pointer;
+    UNPACK64(read_cycles, read_pointer, next_read_pointer);
+    if (count == max || q->read_conflate || read_pointer == write_pointer){
+      break;
+    }
+
+    size = *reinterpret_cast<std::atomic<int64_t>*>(q->data + read_pointer);
+    if (size == -1 && !wrapped){
+      wrapped = true;
+      read_cycles++;
+      read_pointer = 0;
+      PACK64(next_read_pointer, read_cycles, read_pointer);
+      if (read_pointer == write_pointer){
+        break;
+      }
+      size = *reinterpret_cast<std::atomic<int64_t>*>(q->data);
+    }
+
+    // A bad size tag means we were lapped, stop here and let the validity check below report it
+    if (size <= 0 || read_pointer + MSGQ_MSG_HEADER_SIZE + size > q->size){
+      break;
+    }
+
+    data = q->data + read_pointer + MSGQ_MSG_HEADER_SIZE;
+    PACK64(next_read_pointer, read_cycles, ALIGN(read_pointer + MSGQ_MSG_HEADER_SIZE + size));
+  }
+
+  // Advance the read pointer once, and check once that nothing was overwritten
+  *q->read_pointers[id] = next_read_pointer;
+  if (!*q->read_valids[id]){
+    msgq_reset_reader(q);
+    return -1;
+  }
+
+  return count;
+}
+
+bool msgq_msg_borrow_valid(msgq_queue_t * q){
+  int id = q->reader_id;
+  return q->read_uid_local == *q->read_uids[id] && *q->read_valids[id];
+}
+
+void msgq_msg_release(msgq_queue_t * q){
+  if (!q->borrowed){
+    return;
+  }
+  q->borrowed = false;
+
+  // Don't touch the slot if it was handed to another reader in the meantime
+  int id = q->reader_id;
+  if (q->read_uid_local == *q->read_uids[id]){
+    *q->read_pointers[id] = q->borrow_read_pointer;
+  }
+}
+
+static int msgq_poll_ready(msgq_pollitem_t * items, size_t nitems){
+  int num = 0;
   for (size_t i = 0; i < nitems; i++) {
     items[i].revents = msgq_msg_ready(items[i].q);
     if (items[i].revents) num++;
   }
+  return num;
+}
+
+void msgq_park(msgq_queue_t * q, uint32_t wait){
+  int id = q->reader_id;
+  q->read_waiter_tids[id]->store(msgq_get_tid());
+  q->read_waits[id]->store(wait);
+}
+
+void msgq_unpark(msgq_queue_t * q){
+  q->read_waits[q->reader_id]->store(MSGQ_WAIT_NONE);
+}
+
+static void msgq_wait_futex(msgq_pollitem_t * items, const struct timespec *ts){
+  msgq_queue_t *q = items[0].q;
+
+  // Park before checking the write pointer, so a message sent in between
+  // clears the wait word and the futex wait returns immediately
+  msgq_park(q, MSGQ_WAIT_FUTEX);
+  if (msgq_poll_ready(items, 1) == 0){
+    futex_wait(q->read_waits[q->reader_id], MSGQ_WAIT_FUTEX, ts);
+  }
+  msgq_unpark(q);
+}
 
-  int ms = (timeout == -1) ? 100 : timeout;
-  struct timespec ts;
-  ts.tv_sec = ms / 1000;
-  ts.tv_nsec = (ms % 1000) * 1000 * 1000;
+static void msgq_wait_signal(msgq_pollitem_t * items, size_t nitems, const struct timespec *ts){
+  // A futex can only wait on a single word, so with multiple queues the
+  // publishers signal the parked thread instead. SIGUSR2 is blocked while
+  // parked, so it never interrupts unrelated blocking calls.
+  sigset_t mask, old_mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
 
+  for (size_t i = 0; i < nitems; i++) {
+    msgq_park(items[i].q, MSGQ_WAIT_SIGNAL);
+  }
 
-  while (num == 0) {
-    int ret;
+  if (msgq_poll_ready(items, nitems) == 0){
+    #ifdef __APPLE__
+      nanosleep(ts, NULL);
+    #else
+      sigtimedwait(&mask, NULL, ts);
+    #endif
+  }
 
-    ret = nanosleep(&ts, &ts);
+  for (size_t i = 0; i < nitems; i++) {
+    msgq_unpark(items[i].q);
+  }
 
-    // Check if messages ready
-    for (size_t i = 0; i < nitems; i++) {
-      if (items[i].revents == 0 && msgq_msg_ready(items[i].q)){
-        num += 1;
-        items[i].revents = 1;
-      }
+  #ifndef __APPLE__
+    // Consume wakeups that raced with unparking
+    struct timespec zero = {};
+    while (sigtimedwait(&mask, NULL, &zero) > 0) {}
+  #endif
+
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+}
+
+int msgq_poll(msgq_pollitem_t * items, size_t nitems, int timeout){
+  // Check if messages ready
+  int num = msgq_poll_ready(items, nitems);
+  if (num > 0 || timeout == 0 || nitems == 0){
+    return num;
+  }
+
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+
+  while (num == 0) {
+    // Without a timeout, wake up every 100 ms anyway to notice evictions
+    int64_t ns = 100 * 1000 * 1000;
+    if (timeout != -1){
+      ns = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - std::chrono::steady_clock::now()).count();
+      if (ns <= 0) break;
     }
 
-    // exit if we had a timeout and the sleep finished
-    if (timeout != -1 && ret == 0){
-      break;
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+
+    if (nitems == 1){
+      msgq_wait_futex(items, &ts);
+    } else {
+      msgq_wait_signal(items, nitems, &ts);
     }
+
+    num = msgq_poll_ready(items, nitems);
   }
 
   return num;
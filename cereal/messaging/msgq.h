@@ -3,37 +3,97 @@
 #include <cstring>
 #include <string>
 #include <atomic>
+#include <functional>
+#include <vector>
 
 #define DEFAULT_SEGMENT_SIZE (10 * 1024 * 1024)
-#define NUM_READERS 10
+#define DEFAULT_NUM_READERS 10
+#define MAX_NUM_READERS 64
+#define CACHELINE_SIZE 64
+
+// Bump when the shared memory layout changes
+#define MSGQ_VERSION 4
+#define MSGQ_MAGIC 0x4d510000 // "MQ"
 #define ALIGN(n) ((n + (8 - 1)) & -8)
+#define MSGQ_LATENCY_BUCKETS 20
+// Messages start with an int64 size tag followed by the uint64 publish time
+#define MSGQ_MSG_HEADER_SIZE (2 * sizeof(int64_t))
+#define ALIGN_CACHELINE(n) ((n + (CACHELINE_SIZE - 1)) & -CACHELINE_SIZE)
 
 #define UNPACK64(higher, lower, input) do {uint64_t tmp = input; higher = tmp >> 32; lower = tmp & 0xFFFFFFFF;} while (0)
 #define PACK64(output, higher, lower) output = ((uint64_t)higher << 32 ) | ((uint64_t)lower & 0xFFFFFFFF)
 
-struct  msgq_header_t {
+// Reader wait states, stored in read_waits. Publishers only wake readers that are parked
+#define MSGQ_WAIT_NONE 0
+#define MSGQ_WAIT_FUTEX 1  // parked in a futex wait on its read_waits word
+#define MSGQ_WAIT_SIGNAL 2 // parked in sigtimedwait on SIGUSR2, used when polling multiple queues
+
+// format is written by the first process that opens the queue, and holds the
+// version and the number of reader slots. Processes that disagree refuse to attach.
+// The write pointer, which changes on every send, gets its own cache line so
+// subscribers attaching and the publisher's checks don't bounce it.
+// The counters are only written by the publisher (or the evicting subscriber), next
+// to what it writes anyway. They're for monitoring and may be read slightly stale.
+struct msgq_header_t {
+  alignas(CACHELINE_SIZE) uint64_t format;
   uint64_t num_readers;
-  uint64_t write_pointer;
   uint64_t write_uid;
-  uint64_t read_pointers[NUM_READERS];
-  uint64_t read_valids[NUM_READERS];
-  uint64_t read_uids[NUM_READERS];
+  uint64_t evictions;     // times all subscribers were kicked out to free a slot
+
+  alignas(CACHELINE_SIZE) uint64_t write_pointer;
+  uint64_t msgs_written;
+  uint64_t bytes_written;
+  uint64_t invalidations; // times a reader was overwritten before it caught up
+};
+
+// Reader table follows the header, one cache line per reader to avoid false sharing
+struct alignas(CACHELINE_SIZE) msgq_reader_t {
+  uint64_t read_pointer;
+  uint64_t read_valid;
+  uint64_t read_uid;
+  uint64_t waiter_tid;
+  uint32_t wait;
+};
+
+// Per reader counters follow the reader table, only written by the reader itself.
+// latency[i] counts messages received within [2^(i-1), 2^i) us of being published,
+// the last bucket everything slower.
+struct alignas(CACHELINE_SIZE) msgq_reader_stats_t {
+  uint64_t msgs_read;
+  uint64_t bytes_read;
+  uint64_t resets;        // times the reader skipped ahead after being overwritten
+  uint32_t latency[MSGQ_LATENCY_BUCKETS];
 };
 
+static_assert(sizeof(msgq_header_t) == 2 * CACHELINE_SIZE, "msgq header is not cache line padded");
+static_assert(sizeof(msgq_reader_t) == CACHELINE_SIZE, "msgq reader slot is not one cache line");
+static_assert(sizeof(msgq_reader_stats_t) == 2 * CACHELINE_SIZE, "msgq reader stats are not cache line padded");
+
 struct msgq_queue_t {
+  msgq_header_t *header;
+  msgq_reader_stats_t *reader_stats;
   std::atomic<uint64_t> *num_readers;
   std::atomic<uint64_t> *write_pointer;
   std::atomic<uint64_t> *write_uid;
-  std::atomic<uint64_t> *read_pointers[NUM_READERS];
-  std::atomic<uint64_t> *read_valids[NUM_READERS];
-  std::atomic<uint64_t> *read_uids[NUM_READERS];
+  std::vector<std::atomic<uint64_t>*> read_pointers;
+  std::vector<std::atomic<uint64_t>*> read_valids;
+  std::vector<std::atomic<uint64_t>*> read_uids;
+  std::vector<std::atomic<uint64_t>*> read_waiter_tids;
+  std::vector<std::atomic<uint32_t>*> read_waits;
+  size_t num_reader_slots;
   char * mmap_p;
   char * data;
   size_t size;
+  size_t header_size;
   int reader_id;
   uint64_t read_uid_local;
   uint64_t write_uid_local;
 
+  bool borrowed;
+  uint64_t borrow_read_pointer;
+  int64_t reserved_size;
+  uint64_t reserved_write_pointer;
+
   bool read_conflate;
   std::string endpoint;
 };
@@ -55,14 +115,43 @@ int msgq_msg_init_size(msgq_msg_t *msg, size_t size);
 int msgq_msg_init_data(msgq_msg_t *msg, char * data, size_t size);
 int msgq_msg_close(msgq_msg_t *msg);
 
-int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size);
+int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size, size_t num_readers=DEFAULT_NUM_READERS);
 void msgq_close_queue(msgq_queue_t *q);
+
+// Maps an existing queue read-only, for monitoring its header and stats. Returns -1
+// if the file is not a queue of this version. Only the pointers may be used, not
+// any of the send or receive functions.
+int msgq_open_readonly(msgq_queue_t * q, const char * path);
 void msgq_init_publisher(msgq_queue_t * q);
 void msgq_init_subscriber(msgq_queue_t * q);
 
 int msgq_msg_send(msgq_msg_t *msg, msgq_queue_t *q);
+
+// Serialize straight into the queue. msgq_msg_reserve returns a pointer (8-byte aligned)
+// to write a message of exactly size bytes to, or NULL if the publisher was replaced.
+// Readers don't see the message until msgq_msg_commit.
+char * msgq_msg_reserve(msgq_queue_t *q, size_t size);
+int msgq_msg_commit(msgq_queue_t *q);
 int msgq_msg_recv(msgq_msg_t *msg, msgq_queue_t *q);
+
+// Zero-copy receive. msg->data points into the shared segment (8-byte aligned) and
+// must not be closed. The message stays borrowed until the next recv, ready or poll
+// on the queue, or msgq_msg_release. Check msgq_msg_borrow_valid after reading the
+// data to detect that a publisher overwrote it in the meantime.
+int msgq_msg_recv_borrow(msgq_msg_t *msg, msgq_queue_t *q);
+bool msgq_msg_borrow_valid(msgq_queue_t *q);
+void msgq_msg_release(msgq_queue_t *q);
+
+// Batched zero-copy receive. Calls callback in place for up to max pending messages and
+// advances the read pointer once. Returns the number of messages, or -1 if a publisher
+// overwrote them during the batch, in which case the data passed to callback is suspect.
+int msgq_msg_recv_many(msgq_queue_t *q, size_t max, const std::function<void(char *data, size_t size)> &callback);
 int msgq_msg_ready(msgq_queue_t * q);
 int msgq_poll(msgq_pollitem_t * items, size_t nitems, int timeout);
 
+// Publish that this thread waits for the queue, publishers wake it with a futex wake
+// or SIGUSR2 depending on wait. Park before checking msgq_msg_ready to not miss a message.
+void msgq_park(msgq_queue_t * q, uint32_t wait);
+void msgq_unpark(msgq_queue_t * q);
+
 bool msgq_all_readers_updated(msgq_queue_t *q);
@@ -0,0 +1,195 @@
+// Live view of the msgq queues in /dev/shm: throughput, reader lag, invalidations,
+// evictions and publish to receive latency. Attaches read-only, so it never
+// disturbs publishers or subscribers.
+//
+// usage: msgq_stats [--once] [-v] [service ...]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+
+#include "msgq.h"
+
+struct QueueState {
+  msgq_queue_t q;
+  uint64_t msgs_written = 0;
+  uint64_t bytes_written = 0;
+  uint64_t invalidations = 0;
+  std::vector<msgq_reader_stats_t> readers;
+};
+
+static uint64_t reader_lag(msgq_queue_t *q, size_t id){
+  uint32_t write_cycles, write_pointer;
+  UNPACK64(write_cycles, write_pointer, *q->write_pointer);
+  uint32_t read_cycles, read_pointer;
+  UNPACK64(read_cycles, read_pointer, *q->read_pointers[id]);
+
+  if (read_cycles == write_cycles){
+    return (write_pointer > read_pointer) ? write_pointer - read_pointer : 0;
+  }
+  return q->size - read_pointer + write_pointer;
+}
+
+static uint64_t delta(uint64_t cur, uint64_t prev){
+  // The counters restart when a slot is handed to a new reader
+  return (cur >= prev) ? cur - prev : cur;
+}
+
+static std::string latency_str(const uint64_t *hist, double percentile){
+  uint64_t total = 0;
+  for (int i = 0; i < MSGQ_LATENCY_BUCKETS; i++){
+    total += hist[i];
+  }
+  if (total == 0){
+    return "-";
+  }
+
+  uint64_t cum = 0;
+  int bucket = 0;
+  for (; bucket < MSGQ_LATENCY_BUCKETS - 1; bucket++){
+    cum += hist[bucket];
+    if (cum >= percentile * total) break;
+  }
+
+  // Upper bound of the bucket
+  char buf[32];
+  const char *cmp = (bucket == MSGQ_LATENCY_BUCKETS - 1) ? ">" : "<";
+  uint64_t us = 1ULL << ((bucket == MSGQ_LATENCY_BUCKETS - 1) ? bucket - 1 : bucket);
+  if (us < 1000){
+    snprintf(buf, sizeof(buf), "%s%luus", cmp, (unsigned long)us);
+  } else {
+    snprintf(buf, sizeof(buf), "%s%.1fms", cmp, us / 1000.0);
+  }
+  return buf;
+}
+
+static void scan_queues(std::map<std::string, QueueState> &queues, const std::vector<std::string> &filter){
+  DIR *dir = opendir("/dev/shm");
+  if (dir == NULL){
+    return;
+  }
+
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL){
+    std::string name = entry->d_name;
+    if (name[0] == '.' || queues.count(name) > 0) continue;
+    if (filter.size() > 0 && std::find(filter.begin(), filter.end(), name) == filter.end()) continue;
+
+    QueueState state;
+    if (msgq_open_readonly(&state.q, name.c_str()) == 0){
+      state.msgs_written = state.q.header->msgs_written;
+      state.bytes_written = state.q.header->bytes_written;
+      state.invalidations = state.q.header->invalidations;
+      state.readers.assign(state.q.reader_stats, state.q.reader_stats + state.q.num_reader_slots);
+      queues[name] = state;
+    }
+  }
+  closedir(dir);
+}
+
+static void print_queues(std::map<std::string, QueueState> &queues, double dt, bool verbose){
+  printf("%-28s %8s %9s %10s %7s %12s %8s %6s %8s %8s\n",
+         "QUEUE", "SIZE", "MSG/S", "KB/S", "READERS", "MAX LAG", "INVAL/S", "EVICT", "LAT P50", "LAT P99");
+
+  for (auto &kv : queues){
+    QueueState &s = kv.second;
+    msgq_queue_t *q = &s.q;
+
+    uint64_t msgs = delta(q->header->msgs_written, s.msgs_written);
+    uint64_t bytes = delta(q->header->bytes_written, s.bytes_written);
+    uint64_t invalidations = delta(q->header->invalidations, s.invalidations);
+    s.msgs_written = q->header->msgs_written;
+    s.bytes_written = q->header->bytes_written;
+    s.invalidations = q->header->invalidations;
+
+    size_t num_readers = std::min<uint64_t>(*q->num_readers, q->num_reader_slots);
+    uint64_t max_lag = 0;
+    uint64_t hist[MSGQ_LATENCY_BUCKETS] = {};
+    std::vector<std::string> reader_lines;
+
+    for (size_t i = 0; i < q->num_reader_slots; i++){
+      msgq_reader_stats_t cur = q->reader_stats[i];
+      msgq_reader_stats_t &prev = s.readers[i];
+
+      uint64_t reader_hist[MSGQ_LATENCY_BUCKETS];
+      for (int b = 0; b < MSGQ_LATENCY_BUCKETS; b++){
+        reader_hist[b] = delta(cur.latency[b], prev.latency[b]);
+        hist[b] += reader_hist[b];
+      }
+
+      if (i < num_readers && *q->read_valids[i]){
+        uint64_t lag = reader_lag(q, i);
+        max_lag = std::max(max_lag, lag);
+
+        if (verbose){
+          char line[256];
+          snprintf(line, sizeof(line), "  reader %-19zu %8s %9.1f %10.1f %7s %12lu %8s %6lu %8s %8s",
+                   i, "", delta(cur.msgs_read, prev.msgs_read) / dt, delta(cur.bytes_read, prev.bytes_read) / dt / 1024.0,
+                   "", (unsigned long)lag, "", (unsigned long)cur.resets,
+                   latency_str(reader_hist, 0.5).c_str(), latency_str(reader_hist, 0.99).c_str());
+          reader_lines.push_back(line);
+        }
+      }
+      prev = cur;
+    }
+
+    char lag_str[32];
+    snprintf(lag_str, sizeof(lag_str), "%lu (%2.0f%%)", (unsigned long)max_lag, 100.0 * max_lag / q->size);
+    printf("%-28s %7luk %9.1f %10.1f %7zu %12s %8.1f %6lu %8s %8s\n",
+           kv.first.c_str(), (unsigned long)(q->size / 1024), msgs / dt, bytes / dt / 1024.0, num_readers, lag_str,
+           invalidations / dt, (unsigned long)q->header->evictions,
+           latency_str(hist, 0.5).c_str(), latency_str(hist, 0.99).c_str());
+    for (auto &line : reader_lines){
+      printf("%s\n", line.c_str());
+    }
+  }
+  fflush(stdout);
+}
+
+int main(int argc, char *argv[]){
+  bool once = false, verbose = false;
+  std::vector<std::string> filter;
+  for (int i = 1; i < argc; i++){
+    if (strcmp(argv[i], "--once") == 0){
+      once = true;
+    } else if (strcmp(argv[i], "-v") == 0){
+      verbose = true;
+    } else {
+      filter.push_back(argv[i]);
+    }
+  }
+
+  std::map<std::string, QueueState> queues;
+  scan_queues(queues, filter);
+
+  auto last = std::chrono::steady_clock::now();
+  while (true){
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    auto now = std::chrono::steady_clock::now();
+    double dt = std::chrono::duration<double>(now - last).count();
+    last = now;
+
+    if (!once){
+      printf("\033[H\033[2J");
+    }
+    print_queues(queues, dt, verbose);
+    if (once){
+      break;
+    }
+
+    // Pick up queues created in the meantime, rates start on the next refresh
+    scan_queues(queues, filter);
+  }
+
+  for (auto &kv : queues){
+    msgq_close_queue(&kv.second.q);
+  }
+  return 0;
+}
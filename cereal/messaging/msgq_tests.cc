@@ -0,0 +1,734 @@
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+
+#include "catch2/catch.hpp"
+#include "msgq.h"
+#include "messaging.h"
+#include "services.h"
+
+static uint64_t nanos_now(){
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void send_timestamp(msgq_queue_t *q){
+  uint64_t t = nanos_now();
+  msgq_msg_t msg;
+  msgq_msg_init_data(&msg, (char*)&t, sizeof(t));
+  msgq_msg_send(&msg, q);
+  msgq_msg_close(&msg);
+}
+
+TEST_CASE("msgq_poll returns immediately when a message is ready"){
+  msgq_queue_t writer, reader;
+  msgq_new_queue(&writer, "test_queue", 1024);
+  msgq_new_queue(&reader, "test_queue", 1024);
+  msgq_init_publisher(&writer);
+  msgq_init_subscriber(&reader);
+
+  send_timestamp(&writer);
+
+  msgq_pollitem_t items[1];
+  items[0].q = &reader;
+  REQUIRE(msgq_poll(items, 1, 0) == 1);
+  REQUIRE(items[0].revents == 1);
+
+  msgq_close_queue(&writer);
+  msgq_close_queue(&reader);
+}
+
+TEST_CASE("msgq_poll times out without a message"){
+  msgq_queue_t writer, reader;
+  msgq_new_queue(&writer, "test_queue", 1024);
+  msgq_new_queue(&reader, "test_queue", 1024);
+  msgq_init_publisher(&writer);
+  msgq_init_subscriber(&reader);
+
+  msgq_pollitem_t items[1];
+  items[0].q = &reader;
+
+  uint64_t start = nanos_now();
+  REQUIRE(msgq_poll(items, 1, 50) == 0);
+  REQUIRE(nanos_now() - start >= 50 * 1000000ULL);
+  REQUIRE(*reader.read_waits[reader.reader_id] == MSGQ_WAIT_NONE);
+
+  msgq_close_queue(&writer);
+  msgq_close_queue(&reader);
+}
+
+TEST_CASE("msgq_poll wakes parked readers"){
+  const char *paths[] = {"test_queue_0", "test_queue_1", "test_queue_2"};
+  const size_t n = GENERATE(1, 3);
+
+  msgq_queue_t writers[3], readers[3];
+  msgq_pollitem_t items[3];
+  for (size_t i = 0; i < n; i++){
+    msgq_new_queue(&writers[i], paths[i], 1024);
+    msgq_new_queue(&readers[i], paths[i], 1024);
+    msgq_init_publisher(&writers[i]);
+    msgq_init_subscriber(&readers[i]);
+    items[i].q = &readers[i];
+  }
+
+  std::thread t([&](){
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    send_timestamp(&writers[n - 1]);
+  });
+
+  // Wakeup must come from the publisher, not the timeout
+  uint64_t start = nanos_now();
+  REQUIRE(msgq_poll(items, n, 5000) == 1);
+  REQUIRE(nanos_now() - start < 1000 * 1000000ULL);
+  REQUIRE(items[n - 1].revents == 1);
+  t.join();
+
+  for (size_t i = 0; i < n; i++){
+    REQUIRE(*readers[i].read_waits[readers[i].reader_id] == MSGQ_WAIT_NONE);
+    msgq_close_queue(&writers[i]);
+    msgq_close_queue(&readers[i]);
+  }
+}
+
+TEST_CASE("Signal parked readers interrupt epoll_pwait"){
+  msgq_queue_t writer, reader;
+  msgq_new_queue(&writer, "test_queue", 1024);
+  msgq_new_queue(&reader, "test_queue", 1024);
+  msgq_init_publisher(&writer);
+  msgq_init_subscriber(&reader);
+
+  // Same sequence as MSGQPoller with registered fds
+  int efd = eventfd(0, EFD_CLOEXEC);
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.fd = efd;
+  REQUIRE(epoll_ctl(epfd, EPOLL_CTL_ADD, efd, &ev) == 0);
+
+  sigset_t mask, old_mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+  sigset_t wait_mask = old_mask;
+  sigdelset(&wait_mask, SIGUSR2);
+
+  msgq_park(&reader, MSGQ_WAIT_SIGNAL);
+  REQUIRE(msgq_msg_ready(&reader) == 0);
+
+  std::thread t([&](){
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    send_timestamp(&writer);
+  });
+
+  uint64_t start = nanos_now();
+  struct epoll_event events[1];
+  REQUIRE(epoll_pwait(epfd, events, 1, 5000, &wait_mask) == -1);
+  REQUIRE(errno == EINTR);
+  REQUIRE(nanos_now() - start < 1000 * 1000000ULL);
+  msgq_unpark(&reader);
+  REQUIRE(msgq_msg_ready(&reader) == 1);
+
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+  t.join();
+  close(epfd);
+  close(efd);
+  msgq_close_queue(&writer);
+  msgq_close_queue(&reader);
+}
+
+TEST_CASE("msgq_msg_send does not wake readers that are not parked"){
+  msgq_queue_t writer, reader;
+  msgq_new_queue(&writer, "test_queue", 1024);
+  msgq_new_queue(&reader, "test_queue", 1024);
+  msgq_init_publisher(&writer);
+  msgq_init_subscriber(&reader);
+
+  // Would abort the test process if a SIGUSR2 arrived without a handler
+  auto prev = std::signal(SIGUSR2, SIG_DFL);
+  for (int i = 0; i < 10; i++){
+    send_timestamp(&writer);
+  }
+  std::signal(SIGUSR2, prev);
+
+  msgq_close_queue(&writer);
+  msgq_close_queue(&reader);
+}
+
+TEST_CASE("msgq_new_queue rejects a different layout"){
+  msgq_queue_t q1, q2;
+  REQUIRE(msgq_new_queue(&q1, "test_queue_format", 1024, 10) == 0);
+
+  // Same size but different reader table
+  REQUIRE(msgq_new_queue(&q2, "test_queue_format", 1024, 16) == -1);
+  // Different size
+  REQUIRE(msgq_new_queue(&q2, "test_queue_format", 2048, 10) == -1);
+
+  REQUIRE(msgq_new_queue(&q2, "test_queue_format", 1024, 10) == 0);
+  msgq_close_queue(&q2);
+  msgq_close_queue(&q1);
+  unlink("/dev/shm/test_queue_format");
+}
+
+TEST_CASE("Reader table is sized per queue"){
+  const size_t num_readers = 16;
+  msgq_queue_t writer;
+  msgq_queue_t readers[num_readers];
+  msgq_new_queue(&writer, "test_queue_readers", 1024, num_readers);
+  msgq_init_publisher(&writer);
+
+  for (size_t i = 0; i < num_readers; i++){
+    msgq_new_queue(&readers[i], "test_queue_readers", 1024, num_readers);
+    msgq_init_subscriber(&readers[i]);
+    REQUIRE(readers[i].reader_id == (int)i);
+
+    // Every reader has its own cache line
+    REQUIRE((uintptr_t)readers[i].read_pointers[i] % CACHELINE_SIZE == 0);
+  }
+  REQUIRE(*writer.num_readers == num_readers);
+
+  // No reader was evicted
+  send_timestamp(&writer);
+  for (size_t i = 0; i < num_readers; i++){
+    REQUIRE(*readers[i].read_uids[i] == readers[i].read_uid_local);
+    REQUIRE(msgq_msg_ready(&readers[i]) == 1);
+    msgq_close_queue(&readers[i]);
+  }
+  msgq_close_queue(&writer);
+  unlink("/dev/shm/test_queue_readers");
+}
+
+TEST_CASE("Queue stats count messages, invalidations and latency"){
+  msgq_queue_t writer, reader, monitor;
+  msgq_new_queue(&writer, "test_queue_stats", 1024);
+  msgq_new_queue(&reader, "test_queue_stats", 1024);
+  msgq_init_publisher(&writer);
+  msgq_init_subscriber(&reader);
+
+  for (int i = 0; i < 3; i++){
+    send_timestamp(&writer);
+  }
+  REQUIRE(msgq_msg_recv_many(&reader, SIZE_MAX, [](char *data, size_t size) {}) == 3);
+
+  // The monitor sees the same counters through a read-only mapping
+  REQUIRE(msgq_open_readonly(&monitor, "test_queue_stats") == 0);
+  REQUIRE(monitor.size == 1024);
+  REQUIRE(monitor.header->msgs_written == 3);
+  REQUIRE(monitor.header->bytes_written == 3 * sizeof(uint64_t));
+
+  msgq_reader_stats_t *stats = &monitor.reader_stats[reader.reader_id];
+  REQUIRE(stats->msgs_read == 3);
+  REQUIRE(stats->bytes_read == 3 * sizeof(uint64_t));
+  REQUIRE(stats->resets == 0);
+  uint64_t received = 0;
+  for (int i = 0; i < MSGQ_LATENCY_BUCKETS; i++){
+    received += stats->latency[i];
+  }
+  REQUIRE(received == 3);
+
+  // Lapping the reader invalidates it once, and it resets on the next read
+  for (int i = 0; i < 100; i++){
+    send_timestamp(&writer);
+  }
+  REQUIRE(monitor.header->invalidations == 1);
+  REQUIRE(msgq_msg_ready(&reader) == 0);
+  REQUIRE(stats->resets == 1);
+
+  msgq_close_queue(&monitor);
+  msgq_close_queue(&writer);
+  msgq_close_queue(&reader);
+  unlink("/dev/shm/test_queue_stats");
+}
+
+TEST_CASE("msgq_msg_recv_borrow reads in place"){
+  msgq_queue_t writer, reader;
+  msgq_new_queue(&writer, "test_queue", 1024);
+  msgq_new_queue(&reader, "test_queue", 1024);
+  msgq_init_publisher(&writer);
+  msgq_init_subscriber(&reader);
+
+  char data[] = "hello world";
+  msgq_msg_t msg;
+  msgq_msg_init_data(&msg, data, sizeof(data));
+  msgq_msg_send(&msg, &writer);
+  msgq_msg_close(&msg);
+
+  msgq_msg_t borrowed;
+  REQUIRE(msgq_msg_recv_borrow(&borrowed, &reader) == sizeof(data));
+  REQUIRE(borrowed.data >= reader.data);
+  REQUIRE(borrowed.data < reader.data + reader.size);
+  REQUIRE((uintptr_t)borrowed.data % 8 == 0);
+  REQUIRE(memcmp(borrowed.data, data, sizeof(data)) == 0);
+  REQUIRE(msgq_msg_borrow_valid(&reader));
+
+  // Still borrowed until released
+  REQUIRE(reader.borrowed);
+  msgq_msg_release(&reader);
+  REQUIRE(msgq_msg_ready(&reader) == 0);
+  REQUIRE(msgq_msg_recv_borrow(&borrowed, &reader) == 0);
+
+  msgq_close_queue(&writer);
+  msgq_close_queue(&reader);
+}
+
+TEST_CASE("msgq_msg_borrow_valid detects overwrite"){
+  msgq_queue_t writer, reader;
+  msgq_new_queue(&writer, "test_queue", 1024);
+  msgq_new_queue(&reader, "test_queue", 1024);
+  msgq_init_publisher(&writer);
+  msgq_init_subscriber(&reader);
+
+  char data[128] = {};
+  msgq_msg_t msg;
+  msgq_msg_init_data(&msg, data, sizeof(data));
+  msgq_msg_send(&msg, &writer);
+
+  msgq_msg_t borrowed;
+  REQUIRE(msgq_msg_recv_borrow(&borrowed, &reader) == sizeof(data));
+
+  // Wrap around the queue and overwrite the borrowed message
+  for (int i = 0; i < 10; i++){
+    msgq_msg_send(&msg, &writer);
+  }
+  msgq_msg_close(&msg);
+
+  REQUIRE(!msgq_msg_borrow_valid(&reader));
+
+  msgq_close_queue(&writer);
+  msgq_close_queue(&reader);
+}
+
+// Receive cost per message, copying recv + aligning copy as done by SubMaster
+// vs borrowing in place. Run with: ./test_runner "[benchmark]"
+static void benchmark_recv(bool borrow, size_t msg_size){
+  const int N = 100000;
+  msgq_queue_t writer, reader;
+  msgq_new_queue(&writer, "test_queue_bench", 64 * 1024 * 1024);
+  msgq_new_queue(&reader, "test_queue_bench", 64 * 1024 * 1024);
+  msgq_init_publisher(&writer);
+  msgq_init_subscriber(&reader);
+
+  std::vector<char> data(msg_size, 1);
+  std::vector<uint64_t> aligned(msg_size / sizeof(uint64_t) + 1);
+  uint64_t copies = 0, bytes = 0, checksum = 0;
+  uint64_t elapsed = 0;
+
+  for (int i = 0; i < N; i++){
+    msgq_msg_t msg;
+    msg.data = data.data();
+    msg.size = data.size();
+    msgq_msg_send(&msg, &writer);
+
+    uint64_t start = nanos_now();
+    if (borrow){
+      msgq_msg_recv_borrow(&msg, &reader);
+      checksum += ((uint64_t*)msg.data)[0];
+      REQUIRE(msgq_msg_borrow_valid(&reader));
+    } else {
+      msgq_msg_recv(&msg, &reader);
+      memcpy(aligned.data(), msg.data, msg.size);
+      checksum += aligned[0];
+      msgq_msg_close(&msg);
+      copies += 2;
+      bytes += 2 * msg_size;
+    }
+    elapsed += nanos_now() - start;
+  }
+  REQUIRE(checksum != 0);
+
+  printf("%s %zu bytes: %.1f copies/msg, %.0f bytes copied/msg, %.0f ns/msg\n", borrow ? "borrow" : "copy", msg_size,
+         (double)copies / N, (double)bytes / N, (double)elapsed / N);
+
+  msgq_close_queue(&writer);
+  msgq_close_queue(&reader);
+}
+
+TEST_CASE("Benchmark msgq receive copies", "[.][benchmark]"){
+  for (size_t sz : {64, 1024, 64 * 1024}){
+    benchmark_recv(false, sz);
+    benchmark_recv(true, sz);
+  }
+}
+
+TEST_CASE("msgq_msg_reserve and msgq_msg_commit"){
+  msgq_queue_t writer, reader;
+  msgq_new_queue(&writer, "test_queue", 1024);
+  msgq_new_queue(&reader, "test_queue", 1024);
+  msgq_init_publisher(&writer);
+  msgq_init_subscriber(&reader);
+
+  for (int i = 0; i < 20; i++){
+    size_t sz = 8 * (i % 5 + 1);
+    char *p = msgq_msg_reserve(&writer, sz);
+    REQUIRE(p != NULL);
+    REQUIRE((uintptr_t)p % 8 == 0);
+    memset(p, i, sz);
+
+    // Nothing is visible before the commit
+    REQUIRE(msgq_msg_ready(&reader) == 0);
+    REQUIRE(msgq_msg_commit(&writer) == (int)sz);
+
+    msgq_msg_t msg;
+    REQUIRE(msgq_msg_recv(&msg, &reader) == (int)sz);
+    for (size_t j = 0; j < sz; j++){
+      REQUIRE(msg.data[j] == i);
+    }
+    msgq_msg_close(&msg);
+  }
+
+  msgq_close_queue(&writer);
+  msgq_close_queue(&reader);
+}
+
+TEST_CASE("msgq_msg_recv_many drains all messages in one pass"){
+  msgq_queue_t writer, reader;
+  msgq_new_queue(&writer, "test_queue", 1024);
+  msgq_new_queue(&reader, "test_queue", 1024);
+  msgq_init_publisher(&writer);
+  msgq_init_subscriber(&reader);
+
+  // Several batches, crossing the wraparound
+  int next = 0;
+  for (int batch = 0; batch < 10; batch++){
+    for (int i = 0; i < 5; i++){
+      uint64_t v = batch * 5 + i;
+      msgq_msg_t msg;
+      msg.data = (char*)&v;
+      msg.size = sizeof(v);
+      msgq_msg_send(&msg, &writer);
+    }
+
+    // Respects max
+    REQUIRE(msgq_msg_recv_many(&reader, 2, [&](char *data, size_t size){
+      REQUIRE(size == sizeof(uint64_t));
+      REQUIRE(*(uint64_t*)data == (uint64_t)next++);
+    }) == 2);
+
+    REQUIRE(msgq_msg_recv_many(&reader, 100, [&](char *data, size_t size){
+      REQUIRE((uintptr_t)data % 8 == 0);
+      REQUIRE(*(uint64_t*)data == (uint64_t)next++);
+    }) == 3);
+    REQUIRE(msgq_msg_ready(&reader) == 0);
+  }
+  REQUIRE(next == 50);
+
+  msgq_close_queue(&writer);
+  msgq_close_queue(&reader);
+}
+
+TEST_CASE("msgq_msg_recv_many detects overwrite during the batch"){
+  msgq_queue_t writer, reader;
+  msgq_new_queue(&writer, "test_queue", 1024);
+  msgq_new_queue(&reader, "test_queue", 1024);
+  msgq_init_publisher(&writer);
+  msgq_init_subscriber(&reader);
+
+  char data[128] = {};
+  msgq_msg_t msg;
+  msg.data = data;
+  msg.size = sizeof(data);
+  msgq_msg_send(&msg, &writer);
+  msgq_msg_send(&msg, &writer);
+
+  // Publisher laps the reader while it is still in the callback
+  bool lapped = false;
+  REQUIRE(msgq_msg_recv_many(&reader, 100, [&](char *, size_t){
+    if (lapped) return;
+    for (int i = 0; i < 10; i++) msgq_msg_send(&msg, &writer);
+    lapped = true;
+  }) == -1);
+
+  msgq_close_queue(&writer);
+  msgq_close_queue(&reader);
+}
+
+TEST_CASE("SubMaster and PubMaster by ServiceId"){
+  PubMaster pm({ServiceId::carState, ServiceId::controlsState});
+  SubMaster sm({ServiceId::carState, ServiceId::controlsState});
+
+  MessageBuilder msg;
+  msg.initEvent().initCarState().setVEgo(12.5);
+  REQUIRE(pm.send(ServiceId::carState, msg) > 0);
+  sm.update(1000);
+
+  REQUIRE(sm.updated(ServiceId::carState));
+  REQUIRE(!sm.updated(ServiceId::controlsState));
+  REQUIRE(sm[ServiceId::carState].getCarState().getVEgo() == 12.5f);
+
+  // The typed and the name lookups see the same service
+  REQUIRE(sm.updated("carState"));
+  REQUIRE(sm.rcv_frame(ServiceId::carState) == sm.rcv_frame("carState"));
+  REQUIRE(&sm[ServiceId::carState] == &sm["carState"]);
+}
+
+TEST_CASE("SubMaster all checks by ServiceId match the name lookups"){
+  SubMaster sm({ServiceId::carState});
+
+  MessageBuilder msg;
+  msg.initEvent().initCarState();
+  sm.update_msgs(1000000000ULL, {{ServiceId::carState, msg.getRoot<cereal::Event>().asReader()}});
+  REQUIRE(sm.allAliveAndValid({ServiceId::carState}));
+  REQUIRE(sm.allAliveAndValid({"carState"}));
+
+  // A service that isn't subscribed is never alive or valid
+  REQUIRE(!sm.allAlive({ServiceId::carState, ServiceId::controlsState}));
+  REQUIRE(!sm.allAlive({"carState", "controlsState"}));
+  REQUIRE(!sm.allValid({ServiceId::controlsState}));
+  REQUIRE(!sm.allValid({"controlsState"}));
+
+  msg.initEvent(false).initCarState();
+  sm.update_msgs(1000000000ULL, {{ServiceId::carState, msg.getRoot<cereal::Event>().asReader()}});
+  REQUIRE(!sm.allValid({ServiceId::carState}));
+  REQUIRE(!sm.allValid({"carState"}));
+  REQUIRE(sm.allAlive({ServiceId::carState}));
+}
+
+// Wakeup latency of a blocked reader, futex wakeups vs the previous
+// SIGUSR2 + nanosleep loop. Run with: ./test_runner "[benchmark]"
+static void benchmark_wakeup(bool signal_path){
+  const int N = 2000;
+  msgq_queue_t writer, reader;
+  msgq_new_queue(&writer, "test_queue_wakeup", 1024 * 1024);
+  msgq_new_queue(&reader, "test_queue_wakeup", 1024 * 1024);
+  msgq_init_publisher(&writer);
+  msgq_init_subscriber(&reader);
+
+  std::vector<uint64_t> latencies;
+  std::atomic<uint32_t> reader_tid(0);
+  std::atomic<bool> parked(false);
+
+  std::thread t([&](){
+    reader_tid = syscall(SYS_gettid);
+    msgq_pollitem_t items[1];
+    items[0].q = &reader;
+
+    while ((int)latencies.size() < N){
+      if (signal_path){
+        struct timespec ts = {0, 100 * 1000 * 1000};
+        parked = true;
+        while (!msgq_msg_ready(&reader)) nanosleep(&ts, &ts);
+        parked = false;
+      } else {
+        parked = true;
+        msgq_poll(items, 1, -1);
+        parked = false;
+      }
+
+      msgq_msg_t msg;
+      while (msgq_msg_recv(&msg, &reader) > 0){
+        latencies.push_back(nanos_now() - *(uint64_t*)msg.data);
+        msgq_msg_close(&msg);
+      }
+    }
+  });
+
+  uint64_t start = nanos_now();
+  for (int i = 0; i < N; i++){
+    // Let the reader block before every message
+    while (!parked) std::this_thread::yield();
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+
+    send_timestamp(&writer);
+    if (signal_path) syscall(SYS_tkill, reader_tid.load(), SIGUSR2);
+  }
+  t.join();
+  double elapsed = (nanos_now() - start) * 1e-9;
+
+  std::sort(latencies.begin(), latencies.end());
+  printf("%s wakeup: p50 %.1f us, p99 %.1f us, %.0f msgs/sec\n", signal_path ? "signal" : "futex",
+         latencies[latencies.size() / 2] * 1e-3, latencies[latencies.size() * 99 / 100] * 1e-3, N / elapsed);
+
+  msgq_close_queue(&writer);
+  msgq_close_queue(&reader);
+}
+
+TEST_CASE("Benchmark msgq_poll wakeup latency", "[.][benchmark]"){
+  benchmark_wakeup(true);
+  benchmark_wakeup(false);
+}
+
+// Send cost, serializing into a heap array and copying it into the queue as
+// PubMaster used to vs serializing straight into a reserved slot
+static void benchmark_send(bool reserve, size_t msg_size){
+  const int N = 20000;
+  msgq_queue_t writer, reader;
+  msgq_new_queue(&writer, "test_queue_bench", 64 * 1024 * 1024);
+  msgq_new_queue(&reader, "test_queue_bench", 64 * 1024 * 1024);
+  msgq_init_publisher(&writer);
+  msgq_init_subscriber(&reader);
+
+  std::vector<char> segment(msg_size, 1);
+  std::vector<uint64_t> latencies;
+  uint64_t allocations = 0;
+
+  for (int i = 0; i < N; i++){
+    uint64_t start = nanos_now();
+    if (reserve){
+      char *p = msgq_msg_reserve(&writer, msg_size);
+      memcpy(p, segment.data(), msg_size);
+      msgq_msg_commit(&writer);
+    } else {
+      char *flat = new char[msg_size];
+      allocations++;
+      memcpy(flat, segment.data(), msg_size);
+
+      msgq_msg_t msg;
+      msg.data = flat;
+      msg.size = msg_size;
+      msgq_msg_send(&msg, &writer);
+      delete[] flat;
+    }
+    latencies.push_back(nanos_now() - start);
+  }
+
+  std::sort(latencies.begin(), latencies.end());
+  printf("%s %zu bytes: %.1f allocations/send, p50 %.0f ns, p99 %.0f ns\n", reserve ? "reserve" : "heap", msg_size,
+         (double)allocations / N, (double)latencies[N / 2], (double)latencies[N * 99 / 100]);
+
+  msgq_close_queue(&writer);
+  msgq_close_queue(&reader);
+}
+
+TEST_CASE("Benchmark msgq send", "[.][benchmark]"){
+  for (size_t sz : {1024, 64 * 1024, 512 * 1024}){
+    benchmark_send(false, sz);
+    benchmark_send(true, sz);
+  }
+}
+
+// Opens a hardware counter for this thread and threads started after it, -1 if not permitted
+static int perf_open(uint64_t config){
+  struct perf_event_attr attr = {};
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = config;
+  attr.disabled = 1;
+  attr.inherit = 1;
+  attr.exclude_kernel = 1;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static double perf_read(int fd, int n){
+  uint64_t count = 0;
+  if (fd < 0 || read(fd, &count, sizeof(count)) != sizeof(count)) return NAN;
+  return (double)count / n;
+}
+
+// One publisher and n busy readers on a single queue. With every reader on its
+// own cache line the cost per message should stay flat as readers are added
+static void benchmark_readers(size_t num_readers){
+  const int N = 200000;
+  msgq_queue_t writer;
+  std::vector<msgq_queue_t> readers(num_readers);
+  msgq_new_queue(&writer, "test_queue_scaling", 64 * 1024 * 1024);
+  msgq_init_publisher(&writer);
+  for (auto &r : readers){
+    msgq_new_queue(&r, "test_queue_scaling", 64 * 1024 * 1024);
+    msgq_init_subscriber(&r);
+  }
+
+  int cache_misses = perf_open(PERF_COUNT_HW_CACHE_MISSES);
+  int cycles = perf_open(PERF_COUNT_HW_CPU_CYCLES);
+  for (int fd : {cache_misses, cycles}){
+    if (fd >= 0) ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+
+  std::atomic<int> received(0);
+  std::vector<std::thread> threads;
+  uint64_t start = nanos_now();
+  for (auto &r : readers){
+    threads.emplace_back([&](){
+      int count = 0;
+      msgq_msg_t msg;
+      while (count < N){
+        if (msgq_msg_recv_borrow(&msg, &r) > 0) count++;
+      }
+      msgq_msg_release(&r);
+      received += count;
+    });
+  }
+
+  char data[64] = {};
+  for (int i = 0; i < N; i++){
+    msgq_msg_t msg;
+    msg.data = data;
+    msg.size = sizeof(data);
+    msgq_msg_send(&msg, &writer);
+  }
+  for (auto &t : threads) t.join();
+  double elapsed = (nanos_now() - start) * 1e-9;
+
+  for (int fd : {cache_misses, cycles}){
+    if (fd >= 0) ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+  }
+  REQUIRE(received == N * (int)num_readers);
+
+  printf("%2zu readers: %.0f msgs/sec, %.1f cache misses/msg, %.0f cycles/msg\n", num_readers,
+         N / elapsed, perf_read(cache_misses, N), perf_read(cycles, N));
+
+  for (int fd : {cache_misses, cycles}){
+    if (fd >= 0) close(fd);
+  }
+  for (auto &r : readers) msgq_close_queue(&r);
+  msgq_close_queue(&writer);
+}
+
+TEST_CASE("Benchmark msgq reader scaling", "[.][benchmark]"){
+  for (size_t n : {1, 4, 10}){
+    benchmark_readers(n);
+  }
+}
+
+// Draining a socket, one allocating receive per message as loggerd used to vs one batch
+static void benchmark_drain(bool batch){
+  const int N = 1000, ROUNDS = 100;
+  msgq_queue_t writer, reader;
+  msgq_new_queue(&writer, "test_queue_bench", 64 * 1024 * 1024);
+  msgq_new_queue(&reader, "test_queue_bench", 64 * 1024 * 1024);
+  msgq_init_publisher(&writer);
+  msgq_init_subscriber(&reader);
+
+  char data[256] = {};
+  uint64_t bytes = 0, elapsed = 0;
+  for (int r = 0; r < ROUNDS; r++){
+    for (int i = 0; i < N; i++){
+      msgq_msg_t msg;
+      msg.data = data;
+      msg.size = sizeof(data);
+      msgq_msg_send(&msg, &writer);
+    }
+
+    uint64_t start = nanos_now();
+    if (batch){
+      msgq_msg_recv_many(&reader, N, [&](char *, size_t size){ bytes += size; });
+    } else {
+      msgq_msg_t msg;
+      while (msgq_msg_recv(&msg, &reader) > 0){
+        bytes += msg.size;
+        msgq_msg_close(&msg);
+      }
+    }
+    elapsed += nanos_now() - start;
+  }
+  REQUIRE(bytes == (uint64_t)N * ROUNDS * sizeof(data));
+
+  printf("%s drain: %.0f msgs/sec\n", batch ? "batch" : "single", (double)N * ROUNDS / (elapsed * 1e-9));
+
+  msgq_close_queue(&writer);
+  msgq_close_queue(&reader);
+}
+
+TEST_CASE("Benchmark msgq drain", "[.][benchmark]"){
+  benchmark_drain(false);
+  benchmark_drain(true);
+}
@@ -2,6 +2,7 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string>
+#include <algorithm>
 #include <mutex>
 
 #include "services.h"
@@ -15,6 +16,8 @@ static inline uint64_t nanos_since_boot() {
   return t.tv_sec * 1000000000ULL + t.tv_nsec;
 }
 
+static const size_t num_services = sizeof(services) / sizeof(services[0]);
+
 static const service *get_service(const char *name) {
   for (const auto &it : services) {
     if (strcmp(it.name, name) == 0) return &it;
@@ -52,52 +55,78 @@ struct SubMaster::SubMessage {
   uint64_t rcv_time = 0, rcv_frame = 0;
   void *allocated_msg_reader = nullptr;
   capnp::FlatArrayMessageReader *msg_reader = nullptr;
-  AlignedBuffer aligned_buf;
+  AlignedBuffer aligned_buf, next_buf;
   cereal::Event::Reader event;
 };
 
 SubMaster::SubMaster(const std::vector<const char *> &service_list, const char *address,
                      const std::vector<const char *> &ignore_alive) {
   poller_ = Poller::create();
+  ids_.resize(num_services, nullptr);
   for (auto name : service_list) {
     const service *serv = get_service(name);
     assert(serv != nullptr);
-    SubSocket *socket = SubSocket::create(message_context.context(), name, address ? address : "127.0.0.1", true);
-    assert(socket != 0);
-    poller_->registerSocket(socket);
-    SubMessage *m = new SubMessage{
-      .name = name,
-      .socket = socket,
-      .freq = serv->frequency,
-      .ignore_alive = inList(ignore_alive, name),
-      .allocated_msg_reader = malloc(sizeof(capnp::FlatArrayMessageReader))};
-    m->msg_reader = new (m->allocated_msg_reader) capnp::FlatArrayMessageReader({});
-    messages_[socket] = m;
-    services_[name] = m;
+    subscribe_((ServiceId)(serv - services), address, inList(ignore_alive, name));
   }
 }
 
+SubMaster::SubMaster(std::initializer_list<ServiceId> service_list, const char *address,
+                     std::initializer_list<ServiceId> ignore_alive) {
+  poller_ = Poller::create();
+  ids_.resize(num_services, nullptr);
+  for (auto id : service_list) {
+    bool ignore = std::find(ignore_alive.begin(), ignore_alive.end(), id) != ignore_alive.end();
+    subscribe_(id, address, ignore);
+  }
+}
+
+void SubMaster::subscribe_(ServiceId id, const char *address, bool ignore_alive) {
+  const service *serv = &services[(size_t)id];
+  SubSocket *socket = SubSocket::create(message_context.context(), serv->name, address ? address : "127.0.0.1", true);
+  assert(socket != 0);
+  poller_->registerSocket(socket);
+  SubMessage *m = new SubMessage{
+    .name = serv->name,
+    .socket = socket,
+    .freq = serv->frequency,
+    .ignore_alive = ignore_alive,
+    .allocated_msg_reader = malloc(sizeof(capnp::FlatArrayMessageReader))};
+  m->msg_reader = new (m->allocated_msg_reader) capnp::FlatArrayMessageReader({});
+  messages_[socket] = m;
+  services_[serv->name] = m;
+  ids_[(size_t)id] = m;
+}
+
 void SubMaster::update(int timeout) {
   for (auto &kv : messages_) kv.second->updated = false;
 
-  auto sockets = poller_->poll(timeout);
+  poller_->poll(timeout, ready_);
   uint64_t current_time = nanos_since_boot();
+  if (++frame == UINT64_MAX) frame = 1;
 
-  std::vector<std::pair<std::string, cereal::Event::Reader>> messages;
-
-  for (auto s : sockets) {
-    Message *msg = s->receive(true);
-    if (msg == nullptr) continue;
-
+  for (auto s : ready_) {
     SubMessage *m = messages_.at(s);
 
+    // The event is read long after the next message arrives, so copy it out of the queue once
+    // and release it right away. Keep the previous event intact in case the copy turns out to
+    // be overwritten, and receive again then, like a copying receive does.
+    kj::ArrayPtr<const capnp::word> words;
+    bool received = false;
+    while (Message *msg = s->receive_borrow(true)) {
+      words = m->next_buf.align(msg);
+      received = s->borrow_valid();
+      s->release_borrow();
+      if (received) break;
+    }
+    if (!received) continue;
+    std::swap(m->aligned_buf, m->next_buf);
+
     m->msg_reader->~FlatArrayMessageReader();
-    m->msg_reader = new (m->allocated_msg_reader) capnp::FlatArrayMessageReader(m->aligned_buf.align(msg));
-    delete msg;
-    messages.push_back({m->name, m->msg_reader->getRoot<cereal::Event>()});
+    m->msg_reader = new (m->allocated_msg_reader) capnp::FlatArrayMessageReader(words);
+    update_msg_(m, current_time, m->msg_reader->getRoot<cereal::Event>());
   }
 
-  update_msgs(current_time, messages);
+  update_alive_(current_time);
 }
 
 void SubMaster::update_msgs(uint64_t current_time, std::vector<std::pair<std::string, cereal::Event::Reader>> messages){
@@ -108,15 +137,36 @@ void SubMaster::update_msgs(uint64_t current_time, std::vector<std::pair<std::st
     if (m_find == services_.end()){
       continue;
     }
-    SubMessage *m = m_find->second;
-    m->event = kv.second;
-    m->updated = true;
-    m->rcv_time = current_time;
-    m->rcv_frame = frame;
-    m->valid = m->event.getValid();
-    if (SIMULATION) m->alive = true;
+    update_msg_(m_find->second, current_time, kv.second);
+  }
+
+  update_alive_(current_time);
+}
+
+void SubMaster::update_msgs(uint64_t current_time, const std::vector<std::pair<ServiceId, cereal::Event::Reader>> &messages){
+  if (++frame == UINT64_MAX) frame = 1;
+
+  for(auto &kv : messages) {
+    SubMessage *m = ids_[(size_t)kv.first];
+    if (m == nullptr){
+      continue;
+    }
+    update_msg_(m, current_time, kv.second);
   }
 
+  update_alive_(current_time);
+}
+
+void SubMaster::update_msg_(SubMessage *m, uint64_t current_time, cereal::Event::Reader event) {
+  m->event = event;
+  m->updated = true;
+  m->rcv_time = current_time;
+  m->rcv_frame = frame;
+  m->valid = m->event.getValid();
+  if (SIMULATION) m->alive = true;
+}
+
+void SubMaster::update_alive_(uint64_t current_time) {
   if (!SIMULATION) {
     for (auto &kv : messages_) {
       SubMessage *m = kv.second;
@@ -136,6 +186,15 @@ bool SubMaster::all_(const std::vector<const char *> &service_list, bool valid,
   return service_list.size() == 0 ? found == messages_.size() : found == service_list.size();
 }
 
+bool SubMaster::all_(std::initializer_list<ServiceId> service_list, bool valid, bool alive) {
+  for (auto id : service_list) {
+    // Like the name lookup, a service that isn't subscribed never counts as alive or valid
+    SubMessage *m = ids_.at((size_t)id);
+    if (m == nullptr || (valid && !m->valid) || (alive && !(m->alive || m->ignore_alive))) return false;
+  }
+  return true;
+}
+
 void SubMaster::drain() {
   while (true) {
     auto polls = poller_->poll(0);
@@ -143,8 +202,7 @@ void SubMaster::drain() {
       break;
 
     for (auto sock : polls) {
-      Message *msg = sock->receive(true);
-      delete msg;
+      sock->receive_batch(SIZE_MAX, [](char *, size_t) {});
     }
   }
 }
@@ -173,6 +231,36 @@ cereal::Event::Reader &SubMaster::operator[](const char *name) const {
   return services_.at(name)->event;
 };
 
+SubMaster::SubMessage *SubMaster::get_(ServiceId id) const {
+  SubMessage *m = ids_.at((size_t)id);
+  assert(m != nullptr);
+  return m;
+}
+
+bool SubMaster::updated(ServiceId id) const {
+  return get_(id)->updated;
+}
+
+bool SubMaster::alive(ServiceId id) const {
+  return get_(id)->alive;
+}
+
+bool SubMaster::valid(ServiceId id) const {
+  return get_(id)->valid;
+}
+
+uint64_t SubMaster::rcv_frame(ServiceId id) const {
+  return get_(id)->rcv_frame;
+}
+
+uint64_t SubMaster::rcv_time(ServiceId id) const {
+  return get_(id)->rcv_time;
+}
+
+cereal::Event::Reader &SubMaster::operator[](ServiceId id) const {
+  return get_(id)->event;
+}
+
 SubMaster::~SubMaster() {
   delete poller_;
   for (auto &kv : messages_) {
@@ -185,17 +273,51 @@ SubMaster::~SubMaster() {
 }
 
 PubMaster::PubMaster(const std::vector<const char *> &service_list) {
+  ids_.resize(num_services, nullptr);
   for (auto name : service_list) {
-    assert(get_service(name) != nullptr);
-    PubSocket *socket = PubSocket::create(message_context.context(), name);
-    assert(socket);
-    sockets_[name] = socket;
+    const service *serv = get_service(name);
+    assert(serv != nullptr);
+    publish_((ServiceId)(serv - services));
   }
 }
 
+PubMaster::PubMaster(std::initializer_list<ServiceId> service_list) {
+  ids_.resize(num_services, nullptr);
+  for (auto id : service_list) {
+    publish_(id);
+  }
+}
+
+void PubMaster::publish_(ServiceId id) {
+  const char *name = services[(size_t)id].name;
+  PubSocket *socket = PubSocket::create(message_context.context(), name);
+  assert(socket);
+  sockets_[name] = socket;
+  ids_[(size_t)id] = socket;
+}
+
+PubSocket *PubMaster::get_(ServiceId id) const {
+  PubSocket *socket = ids_.at((size_t)id);
+  assert(socket != nullptr);
+  return socket;
+}
+
+static int send_builder(PubSocket *socket, MessageBuilder &msg) {
+  // Serialize the segments straight into the socket's reserved slot
+  size_t size = msg.getSerializedSize();
+  char *buf = socket->reserve(size);
+  if (buf == nullptr) return -1;
+
+  msg.toBuffer((capnp::byte *)buf, size);
+  return socket->commit();
+}
+
 int PubMaster::send(const char *name, MessageBuilder &msg) {
-  auto bytes = msg.toBytes();
-  return send(name, bytes.begin(), bytes.size());
+  return send_builder(sockets_.at(name), msg);
+}
+
+int PubMaster::send(ServiceId id, MessageBuilder &msg) {
+  return send_builder(get_(id), msg);
 }
 
 PubMaster::~PubMaster() {
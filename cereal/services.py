@@ -5,6 +5,7 @@ from typing import Optional
 TICI = os.path.isfile('/TICI')
 RESERVED_PORT = 8022  # sshd
 STARTING_PORT = 8001
+DEFAULT_NUM_READERS = 10  # keep in sync with messaging/msgq.h
 
 
 def new_port(port: int):
@@ -13,22 +14,24 @@ def new_port(port: int):
 
 
 class Service:
-  def __init__(self, port: int, should_log: bool, frequency: float, decimation: Optional[int] = None):
+  def __init__(self, port: int, should_log: bool, frequency: float, decimation: Optional[int] = None,
+               num_readers: int = DEFAULT_NUM_READERS):
     self.port = port
     self.should_log = should_log
     self.frequency = frequency
     self.decimation = decimation
+    self.num_readers = num_readers
 
 
 services = {
-  "roadCameraState": (True, 20., 1),  # should_log, frequency, decimation (optional)
-  "sensorEvents": (True, 100., 100),
+  "roadCameraState": (True, 20., 1),  # should_log, frequency, decimation (optional), msgq reader slots (optional)
+  "sensorEvents": (True, 100., 100, 16),
   "gpsNMEA": (True, 9.),
-  "deviceState": (True, 2., 1),
-  "can": (True, 100.),
-  "controlsState": (True, 100., 100),
+  "deviceState": (True, 2., 1, 16),
+  "can": (True, 100., None, 16),
+  "controlsState": (True, 100., 100, 16),
   "features": (True, 0.),
-  "pandaState": (True, 2., 1),
+  "pandaState": (True, 2., 1, 16),
   "radarState": (True, 20., 5),
   "roadEncodeIdx": (True, 20., 1),
   "liveTracks": (True, 20.),
@@ -36,8 +39,8 @@ services = {
   "logMessage": (True, 0.),
   "liveCalibration": (True, 4., 4),
   "androidLog": (True, 0., 1),
-  "carState": (True, 100., 10),
-  "carControl": (True, 100., 10),
+  "carState": (True, 100., 10, 16),
+  "carControl": (True, 100., 10, 16),
   "longitudinalPlan": (True, 20., 2),
   "liveLocation": (True, 0., 1),
   "procLog": (True, 0.5),
@@ -47,7 +50,7 @@ services = {
   "liveMpc": (False, 20.),
   "liveLongitudinalMpc": (False, 20.),
   "ubloxRaw": (True, 20.),
-  "liveLocationKalman": (True, 20., 2),
+  "liveLocationKalman": (True, 20., 2, 16),
   "uiLayoutState": (True, 0.),
   "liveParameters": (True, 20., 2),
   "cameraOdometry": (True, 20., 5),
@@ -62,7 +65,7 @@ services = {
   "offroadLayout": (False, 0.),
   "wideRoadEncodeIdx": (True, 20., 1),
   "wideRoadCameraState": (True, 20., 1),
-  "modelV2": (True, 20., 20),
+  "modelV2": (True, 20., 20, 16),
   "managerState": (True, 2., 1),
 
   "testModel": (False, 0.),
@@ -78,13 +81,20 @@ def build_header():
   h += "/* THIS IS AN AUTOGENERATED FILE, PLEASE EDIT services.py */\n"
   h += "#ifndef __SERVICES_H\n"
   h += "#define __SERVICES_H\n"
-  h += "struct service { char name[0x100]; int port; bool should_log; int frequency; int decimation; };\n"
+  h += "#include <cstdint>\n"
+  h += "struct service { char name[0x100]; int port; bool should_log; int frequency; int decimation; int num_readers; };\n"
   h += "static struct service services[] = {\n"
   for k, v in service_list.items():
     should_log = "true" if v.should_log else "false"
     decimation = -1 if v.decimation is None else v.decimation
-    h += '  { "%s", %d, %s, %d, %d },\n' % \
-         (k, v.port, should_log, v.frequency, decimation)
+    h += '  { "%s", %d, %s, %d, %d, %d },\n' % \
+         (k, v.port, should_log, v.frequency, decimation, v.num_readers)
+  h += "};\n"
+  h += "\n"
+  h += "// Index into services[], used for the O(1) SubMaster/PubMaster overloads\n"
+  h += "enum class ServiceId : uint16_t {\n"
+  for k in service_list.keys():
+    h += "  %s,\n" % k
   h += "};\n"
   h += "#endif\n"
   return h
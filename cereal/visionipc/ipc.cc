@@ -4,10 +4,17 @@
 #include <unistd.h>
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
+#include <time.h>
 
 #include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/syscall.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#endif
 
 #ifdef __APPLE__
 #define getsocket() socket(AF_UNIX, SOCK_STREAM, 0)
@@ -119,3 +126,29 @@ int ipc_sendrecv_with_fds(bool send, int fd, void *buf, size_t buf_size, int* fd
     return r;
   }
 }
+
+void ipc_futex_wait(std::atomic<uint32_t> *addr, uint32_t val, int timeout_ms) {
+#ifdef __linux__
+  struct timespec ts = {
+    .tv_sec = timeout_ms / 1000,
+    .tv_nsec = (timeout_ms % 1000) * 1000 * 1000,
+  };
+  // Word is shared between processes, so no FUTEX_PRIVATE_FLAG
+  syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+#else
+  // No futex, poll the word every IPC_FUTEX_POLL_US until it changes or the timeout is up
+  const struct timespec ts = {.tv_sec = 0, .tv_nsec = IPC_FUTEX_POLL_US * 1000};
+  for (int64_t waited_us = 0; addr->load() == val && waited_us < timeout_ms * 1000LL; waited_us += IPC_FUTEX_POLL_US) {
+    nanosleep(&ts, NULL);
+  }
+#endif
+}
+
+void ipc_futex_wake(std::atomic<uint32_t> *addr) {
+#ifdef __linux__
+  syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#else
+  // Waiters poll the word
+  (void)addr;
+#endif
+}
@@ -1,7 +1,16 @@
 #pragma once
+#include <atomic>
 #include <cstddef>
+#include <cstdint>
 
 int ipc_connect(const char* socket_path);
 int ipc_bind(const char* socket_path);
 int ipc_sendrecv_with_fds(bool send, int fd, void *buf, size_t buf_size, int* fds, int num_fds,
                           int *out_num_fds);
+
+// Without futexes (macOS) ipc_futex_wait polls the word at this interval instead
+#define IPC_FUTEX_POLL_US 1000
+
+// Futex on a word in shared memory, waits while *addr == val
+void ipc_futex_wait(std::atomic<uint32_t> *addr, uint32_t val, int timeout_ms);
+void ipc_futex_wake(std::atomic<uint32_t> *addr);
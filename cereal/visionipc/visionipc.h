@@ -1,18 +1,59 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
 #include <cstddef>
 
 constexpr int VISIONIPC_MAX_FDS = 64;
 
+// Client slots in a lease word, the top bit marks the server writing the buffer
+constexpr int VISIONIPC_MAX_CLIENTS = 63;
+constexpr uint64_t VISIONIPC_LEASE_WRITING = 1ULL << 63;
+// Leases older than this are from a hung client, the server reuses the buffer anyway
+constexpr uint64_t VISIONIPC_LEASE_TIMEOUT_NS = 1000ULL * 1000 * 1000;
+// Frames a client can fall behind before it starts missing them
+constexpr int VISIONIPC_FRAME_RING_SIZE = 16;
+
 struct VisionIpcBufExtra {
   uint32_t frame_id;
   uint64_t timestamp_sof;
   uint64_t timestamp_eof;
 };
 
-struct VisionIpcPacket {
-  uint64_t server_id;
-  size_t idx;
+// Metadata of a sent frame, written by the server under a seqlock: lock is odd while
+// the slot is being written, and a reader retries when lock changed while it copied.
+struct VisionIpcFrame {
+  std::atomic<uint64_t> lock;
+  uint64_t frame; // number of the frame in this slot, tells a reader it was lapped
+  uint64_t idx;
+  uint64_t seq;
   struct VisionIpcBufExtra extra;
 };
+
+// Shared by the server and its clients, one per stream. A client sets its slot bit in
+// lease[idx] while it reads buffer idx, and get_buffer only hands out buffers without
+// client bits. seq[idx] is bumped on every send, so a client can tell that a buffer
+// was rewritten before it got to lease it.
+//
+// It also carries the frame ring, so sending a frame needs no message: frame n is in
+// ring[n % VISIONIPC_FRAME_RING_SIZE] once frames > n. frame_futex changes with every
+// frame, clients with nothing left to read sleep on it and register in frame_waiters.
+struct VisionIpcLeaseTable {
+  std::atomic<int32_t> server_pid;
+
+  std::atomic<uint64_t> clients;
+  std::atomic<int32_t> client_pids[VISIONIPC_MAX_CLIENTS];
+  std::atomic<uint64_t> lease[VISIONIPC_MAX_FDS];
+  std::atomic<uint64_t> lease_time[VISIONIPC_MAX_FDS];
+  std::atomic<uint64_t> seq[VISIONIPC_MAX_FDS];
+
+  // For sizing the number of buffers
+  std::atomic<uint64_t> frames;     // frames sent
+  std::atomic<uint64_t> skips;      // held buffers skipped by get_buffer
+  std::atomic<uint64_t> drops;      // frames not sent because every buffer was held
+  std::atomic<uint64_t> overwrites; // frames rewritten before or while a client read them
+
+  std::atomic<uint32_t> frame_futex;
+  std::atomic<uint32_t> frame_waiters;
+  VisionIpcFrame ring[VISIONIPC_FRAME_RING_SIZE];
+};
@@ -1,119 +1,405 @@
+#include <algorithm>
 #include <chrono>
 #include <cassert>
+#include <cerrno>
+#include <csignal>
 #include <iostream>
 #include <thread>
 
+#include <sys/mman.h>
+
 #include "ipc.h"
 #include "visionipc_client.h"
-#include "visionipc_server.h"
 
-VisionIpcClient::VisionIpcClient(std::string name, VisionStreamType type, bool conflate, cl_device_id device_id, cl_context ctx) : name(name), type(type), device_id(device_id), ctx(ctx) {
-  msg_ctx = Context::create();
-  sock = SubSocket::create(msg_ctx, get_endpoint_name(name, type), "127.0.0.1", conflate, false);
+VisionIpcClient::VisionIpcClient(std::string name, VisionStreamType type, bool conflate, cl_device_id device_id, cl_context ctx) : name(name), type(type), conflate(conflate), device_id(device_id), ctx(ctx) {
+}
+
+static int acquire_lease_slot(VisionIpcLeaseTable *t){
+  for (int attempt = 0; attempt < 2; attempt++){
+    uint64_t clients = t->clients;
+    for (int i = 0; i < VISIONIPC_MAX_CLIENTS; i++){
+      if (clients & (1ULL << i)) continue;
+      if (t->clients.compare_exchange_strong(clients, clients | (1ULL << i))){
+        t->client_pids[i] = getpid();
+        return i;
+      }
+      i = -1; // clients was reloaded, start over
+    }
 
-  poller = Poller::create();
-  poller->registerSocket(sock);
+    // Free the slots of clients that died without disconnecting
+    for (int i = 0; i < VISIONIPC_MAX_CLIENTS; i++){
+      int32_t pid = t->client_pids[i];
+      if ((clients & (1ULL << i)) && pid > 0 && kill(pid, 0) < 0 && errno == ESRCH){
+        for (int idx = 0; idx < VISIONIPC_MAX_FDS; idx++){
+          t->lease[idx].fetch_and(~(1ULL << i));
+        }
+        t->client_pids[i] = 0;
+        t->clients.fetch_and(~(1ULL << i));
+      }
+    }
+  }
+
+  // Without a slot, frames are received unprotected like before
+  std::cout << "VisionIpcClient no free lease slot" << std::endl;
+  return -1;
 }
 
-// Connect is not thread safe. Do not use the buffers while calling connect
-bool VisionIpcClient::connect(bool blocking){
+static uint64_t lease_now(){
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void VisionIpcClient::disconnect(){
   connected = false;
+  release();
 
-  // Cleanup old buffers on reconnect
   for (size_t i = 0; i < num_buffers; i++){
     buffers[i].free();
   }
   num_buffers = 0;
 
+  if (leases != nullptr){
+    if (lease_slot >= 0){
+      leases->client_pids[lease_slot] = 0;
+      leases->clients.fetch_and(~(1ULL << lease_slot));
+      lease_slot = -1;
+    }
+    munmap(leases, sizeof(VisionIpcLeaseTable));
+    leases = nullptr;
+  }
+}
+
+// Runs on the connect thread for non-blocking connects, fills the pending_ connection
+bool VisionIpcClient::handshake(){
   // Connect to server socket and ask for all FDs of type
   std::string path = "/tmp/visionipc_" + name;
-
-  int socket_fd = -1;
-  while (socket_fd < 0) {
-    socket_fd = ipc_connect(path.c_str());
-
-    if (socket_fd < 0) {
-      if (blocking){
-        std::cout << "VisionIpcClient connecting" << std::endl;
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
-      } else {
-        return false;
-      }
-    }
+  int socket_fd = ipc_connect(path.c_str());
+  if (socket_fd < 0){
+    return false;
   }
 
   // Send stream type to server to request FDs
   int r = ipc_sendrecv_with_fds(true, socket_fd, &type, sizeof(type), nullptr, 0, nullptr);
   assert(r == sizeof(type));
 
-  // Get FDs
+  // Get FDs, the lease table comes after the buffers
   int fds[VISIONIPC_MAX_FDS];
   VisionBuf bufs[VISIONIPC_MAX_FDS];
-  r = ipc_sendrecv_with_fds(false, socket_fd, &bufs, sizeof(bufs), fds, VISIONIPC_MAX_FDS, &num_buffers);
+  int num_fds = 0;
+  r = ipc_sendrecv_with_fds(false, socket_fd, &bufs, sizeof(bufs), fds, VISIONIPC_MAX_FDS, &num_fds);
+  close(socket_fd);
+
+  pending_num_buffers = num_fds - 1;
+  assert(pending_num_buffers > 0);
+  assert(r == sizeof(VisionBuf) * pending_num_buffers);
 
-  assert(num_buffers > 0);
-  assert(r == sizeof(VisionBuf) * num_buffers);
+  pending_leases = (VisionIpcLeaseTable *)mmap(NULL, sizeof(VisionIpcLeaseTable), PROT_READ | PROT_WRITE, MAP_SHARED, fds[pending_num_buffers], 0);
+  assert(pending_leases != MAP_FAILED);
+  close(fds[pending_num_buffers]);
 
   // Import buffers
-  for (size_t i = 0; i < num_buffers; i++){
-    buffers[i] = bufs[i];
-    buffers[i].fd = fds[i];
-    buffers[i].import();
-    if (buffers[i].rgb) {
-      buffers[i].init_rgb(buffers[i].width, buffers[i].height, buffers[i].stride);
+  for (size_t i = 0; i < pending_num_buffers; i++){
+    VisionBuf &buf = pending_buffers[i];
+    buf = bufs[i];
+    buf.fd = fds[i];
+    buf.import();
+    if (buf.rgb) {
+      buf.init_rgb(buf.width, buf.height, buf.stride);
     } else {
-      buffers[i].init_yuv(buffers[i].width, buffers[i].height);
+      buf.init_yuv(buf.width, buf.height);
     }
 
-    if (device_id) buffers[i].init_cl(device_id, ctx);
+    if (device_id) buf.init_cl(device_id, ctx);
   }
+  return true;
+}
 
+void VisionIpcClient::install(){
+  num_buffers = pending_num_buffers;
+  for (size_t i = 0; i < num_buffers; i++){
+    buffers[i] = pending_buffers[i];
+  }
+
+  leases = pending_leases;
+  lease_slot = acquire_lease_slot(leases);
+
+  // Only frames sent from now on
+  frame_pos = leases->frames;
   connected = true;
+
+  double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - connect_start).count();
+  std::cout << "VisionIpcClient connected to " << name << " stream " << type << " in " << ms << " ms" << std::endl;
+}
+
+// Connect is not thread safe. Do not use the buffers while calling connect.
+// A non-blocking connect does the handshake on a thread and returns true on
+// a later call once it is done, recv returns nullptr in the meantime.
+bool VisionIpcClient::connect(bool blocking){
+  if (connect_thread.joinable()){
+    if (!blocking && !connect_done){
+      return false;
+    }
+    connect_thread.join();
+    if (connect_ok){
+      install();
+      return true;
+    }
+  } else {
+    disconnect();
+    connect_start = std::chrono::steady_clock::now();
+  }
+
+  if (!blocking){
+    connect_done = false;
+    connect_thread = std::thread([this](){
+      connect_ok = handshake();
+      connect_done = true;
+    });
+    return false;
+  }
+
+  while (!handshake()){
+    std::cout << "VisionIpcClient connecting" << std::endl;
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  install();
   return true;
 }
 
-VisionBuf * VisionIpcClient::recv(VisionIpcBufExtra * extra, const int timeout_ms){
-  auto p = poller->poll(timeout_ms);
+bool VisionIpcClient::lease(size_t idx, uint64_t seq){
+  if (lease_slot < 0){
+    return true;
+  }
 
-  if (!p.size()){
-    return nullptr;
+  uint64_t prev = leases->lease[idx].fetch_or(1ULL << lease_slot);
+  leases->lease_time[idx] = lease_now();
+  leased_idx = idx;
+
+  // The server is writing the next frame into it, or already wrote a newer frame
+  // that the frame's extra no longer belongs to
+  if ((prev & VISIONIPC_LEASE_WRITING) || leases->seq[idx] != seq){
+    leases->overwrites++;
+    release();
+    return false;
   }
+  return true;
+}
 
-  Message * r = sock->receive(true);
-  if (r == nullptr){
-    return nullptr;
+void VisionIpcClient::release(){
+  if (leased_idx >= 0 && lease_slot >= 0){
+    leases->lease[leased_idx].fetch_and(~(1ULL << lease_slot));
   }
+  leased_idx = -1;
+}
 
-  // Get buffer
-  assert(r->getSize() == sizeof(VisionIpcPacket));
-  VisionIpcPacket *packet = (VisionIpcPacket*)r->getData();
+static bool server_alive(VisionIpcLeaseTable *t){
+  int32_t pid = t->server_pid;
+  return pid > 0 && !(kill(pid, 0) < 0 && errno == ESRCH);
+}
+
+// Frames that are already pending are read without any syscall
+bool VisionIpcClient::wait(int timeout_ms){
+  if (leases == nullptr){
+    return false;
+  }
+  if (frame_pos < leases->frames){
+    return true;
+  }
 
-  assert(packet->idx < num_buffers);
-  VisionBuf * buf = &buffers[packet->idx];
+  // Registered before the futex word is read, so the server either sees
+  // the waiter or changes the word before the futex wait starts
+  leases->frame_waiters++;
+  uint32_t futex = leases->frame_futex;
+  if (frame_pos >= leases->frames && timeout_ms > 0){
+    ipc_futex_wait(&leases->frame_futex, futex, timeout_ms);
+  }
+  leases->frame_waiters--;
 
-  if (buf->server_id != packet->server_id){
+  if (frame_pos < leases->frames){
+    return true;
+  }
+  if (!server_alive(leases)){
     connected = false;
-    delete r;
+  }
+  return false;
+}
+
+VisionBuf * VisionIpcClient::recv(VisionIpcBufExtra * extra, const int timeout_ms){
+  release();
+  if (!wait(timeout_ms)){
+    return nullptr;
+  }
+
+  return receive(extra);
+}
+
+// Doesn't wait, and only gives up the current lease when there is a new frame
+VisionBuf * VisionIpcClient::receive(VisionIpcBufExtra * extra){
+  if (leases == nullptr){
     return nullptr;
   }
 
+  uint64_t frames, idx, seq;
+  VisionIpcBufExtra frame_extra;
+  while (true){
+    frames = leases->frames;
+    if (frame_pos >= frames){
+      return nullptr;
+    }
+
+    // Frames that were overwritten in the ring are gone
+    if (conflate){
+      frame_pos = frames - 1;
+    } else if (frames - frame_pos > VISIONIPC_FRAME_RING_SIZE){
+      frame_pos = frames - VISIONIPC_FRAME_RING_SIZE;
+    }
+
+    // Seqlock read, retried while the server writes the slot
+    VisionIpcFrame &f = leases->ring[frame_pos % VISIONIPC_FRAME_RING_SIZE];
+    uint64_t lock, frame;
+    do {
+      lock = f.lock.load(std::memory_order_acquire);
+      frame = f.frame;
+      idx = f.idx;
+      seq = f.seq;
+      frame_extra = f.extra;
+      std::atomic_thread_fence(std::memory_order_acquire);
+    } while ((lock & 1) || f.lock.load(std::memory_order_relaxed) != lock);
+
+    // The server lapped us while we were reading, start over from the new head
+    if (frame != frame_pos){
+      continue;
+    }
+    frame_pos++;
+    release();
+
+    // An overwritten buffer is skipped, the frame that replaced it follows in the ring
+    assert(idx < num_buffers);
+    if (lease(idx, seq)){
+      break;
+    }
+  }
+  VisionBuf * buf = &buffers[idx];
+
   if (extra) {
-    *extra = packet->extra;
+    *extra = frame_extra;
   }
 
   buf->sync(VISIONBUF_SYNC_TO_DEVICE);
-  delete r;
   return buf;
 }
 
 
 
-VisionIpcClient::~VisionIpcClient(){
-  for (size_t i = 0; i < num_buffers; i++){
-    buffers[i].free();
+VisionIpcMultiClient::VisionIpcMultiClient(std::string name, const std::vector<VisionStreamType> &types, uint64_t sync_tolerance_ns,
+                                           cl_device_id device_id, cl_context ctx) : sync_tolerance_ns(sync_tolerance_ns) {
+  // The clients only ever keep the latest frame
+  for (auto type : types){
+    clients.push_back(new VisionIpcClient(name, type, true, device_id, ctx));
+  }
+  pending.resize(clients.size(), nullptr);
+  pending_extra.resize(clients.size());
+}
+
+bool VisionIpcMultiClient::connect(bool blocking){
+  connected = false;
+  std::fill(pending.begin(), pending.end(), nullptr);
+
+  // Clients that are already connected keep their connection while the others catch up
+  for (auto client : clients){
+    if (!client->connected && !client->connect(blocking)){
+      return false;
+    }
+  }
+
+  connected = true;
+  return true;
+}
+
+bool VisionIpcMultiClient::match(VisionBuf ** bufs, VisionIpcBufExtra * extras){
+  uint64_t min_sof = UINT64_MAX, max_sof = 0;
+  for (size_t i = 0; i < clients.size(); i++){
+    if (pending[i] == nullptr) return false;
+    min_sof = std::min(min_sof, pending_extra[i].timestamp_sof);
+    max_sof = std::max(max_sof, pending_extra[i].timestamp_sof);
   }
 
-  delete sock;
-  delete poller;
-  delete msg_ctx;
+  if (max_sof - min_sof > sync_tolerance_ns){
+    // Frames too old to ever pair with the newest one wait for their successors
+    for (size_t i = 0; i < clients.size(); i++){
+      if (max_sof - pending_extra[i].timestamp_sof > sync_tolerance_ns){
+        pending[i] = nullptr;
+        stats.dropped++;
+      }
+    }
+    return false;
+  }
+
+  for (size_t i = 0; i < clients.size(); i++){
+    bufs[i] = pending[i];
+    if (extras) extras[i] = pending_extra[i];
+    pending[i] = nullptr;
+  }
+
+  stats.synced++;
+  stats.skew_max = std::max(stats.skew_max, max_sof - min_sof);
+  stats.skew_sum += max_sof - min_sof;
+  return true;
+}
+
+bool VisionIpcMultiClient::recv(VisionBuf ** bufs, VisionIpcBufExtra * extras, const int timeout_ms){
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+
+  while (true){
+    for (size_t i = 0; i < clients.size(); i++){
+      VisionIpcClient *client = clients[i];
+
+      VisionIpcBufExtra extra;
+      VisionBuf *buf = client->receive(&extra);
+      if (buf != nullptr){
+        if (pending[i] != nullptr) stats.dropped++;
+        pending[i] = buf;
+        pending_extra[i] = extra;
+      } else if (client->lease_slot >= 0 && client->leased_idx < 0){
+        // The lease on the pending frame was given up for a frame that turned out unusable
+        pending[i] = nullptr;
+      }
+    }
+
+    if (match(bufs, extras)){
+      return true;
+    }
+
+    auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+    if (remaining <= 0){
+      return false;
+    }
+
+    // Sleep on a stream that still owes a frame, no tuple can be complete without it
+    size_t i = 0;
+    while (i < clients.size() - 1 && pending[i] != nullptr) i++;
+    clients[i]->wait(remaining);
+    if (!clients[i]->connected){
+      connected = false;
+      return false;
+    }
+  }
+}
+
+VisionIpcMultiClient::~VisionIpcMultiClient(){
+  for (auto client : clients){
+    delete client;
+  }
+}
+
+VisionIpcClient::~VisionIpcClient(){
+  if (connect_thread.joinable()){
+    connect_thread.join();
+    if (connect_ok){
+      for (size_t i = 0; i < pending_num_buffers; i++){
+        pending_buffers[i].free();
+      }
+      munmap(pending_leases, sizeof(VisionIpcLeaseTable));
+    }
+  }
+  disconnect();
 }
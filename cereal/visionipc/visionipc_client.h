@@ -1,32 +1,85 @@
 #pragma once
-#include <vector>
+#include <atomic>
+#include <chrono>
 #include <string>
+#include <thread>
+#include <vector>
 #include <unistd.h>
 
-#include "messaging.h"
 #include "visionipc.h"
 #include "visionbuf.h"
 
 class VisionIpcClient {
+  friend class VisionIpcMultiClient;
+
 private:
   std::string name;
-  Context * msg_ctx;
-  SubSocket * sock;
-  Poller * poller;
-
   VisionStreamType type;
+  bool conflate;
 
   cl_device_id device_id = nullptr;
   cl_context ctx = nullptr;
 
-  void init_msgq(bool conflate);
+  int lease_slot = -1;
+  int leased_idx = -1;
+  uint64_t frame_pos = 0; // next frame to read from the ring
+
+  std::thread connect_thread;
+  std::atomic<bool> connect_done = false;
+  bool connect_ok = false;
+  std::chrono::steady_clock::time_point connect_start;
+
+  // Result of the handshake, installed by connect on the calling thread
+  int pending_num_buffers = 0;
+  VisionBuf pending_buffers[VISIONIPC_MAX_FDS];
+  VisionIpcLeaseTable *pending_leases = nullptr;
+
+  bool handshake();
+  void install();
+  bool lease(size_t idx, uint64_t seq);
+  void disconnect();
+  bool wait(int timeout_ms);
+  VisionBuf * receive(VisionIpcBufExtra * extra);
 
 public:
   bool connected = false;
   int num_buffers = 0;
   VisionBuf buffers[VISIONIPC_MAX_FDS];
+  VisionIpcLeaseTable *leases = nullptr;
   VisionIpcClient(std::string name, VisionStreamType type, bool conflate, cl_device_id device_id=nullptr, cl_context ctx=nullptr);
   ~VisionIpcClient();
+  // The returned buffer is leased until the next recv or release, the server won't reuse it in the meantime
   VisionBuf * recv(VisionIpcBufExtra * extra=nullptr, const int timeout_ms=100);
+  void release();
+  bool connect(bool blocking=true);
+};
+
+struct VisionIpcSyncStats {
+  uint64_t synced = 0;   // tuples returned
+  uint64_t dropped = 0;  // frames replaced or discarded before a match was found
+  uint64_t skew_max = 0; // largest timestamp_sof spread of a returned tuple, in ns
+  uint64_t skew_sum = 0; // for the mean, in ns
+};
+
+// Receives frames from several streams of one server, and returns them as tuples
+// whose timestamp_sof are within sync_tolerance_ns of each other.
+class VisionIpcMultiClient {
+private:
+  std::vector<VisionIpcClient*> clients;
+  std::vector<VisionBuf*> pending;
+  std::vector<VisionIpcBufExtra> pending_extra;
+  uint64_t sync_tolerance_ns;
+
+  bool match(VisionBuf ** bufs, VisionIpcBufExtra * extras);
+
+public:
+  bool connected = false;
+  VisionIpcSyncStats stats;
+  VisionIpcMultiClient(std::string name, const std::vector<VisionStreamType> &types, uint64_t sync_tolerance_ns,
+                       cl_device_id device_id=nullptr, cl_context ctx=nullptr);
+  ~VisionIpcMultiClient();
+  inline VisionIpcClient * get_client(size_t i) { return clients[i]; }
+  // Fills bufs and extras in the order of types. The buffers are leased until the next recv
+  bool recv(VisionBuf ** bufs, VisionIpcBufExtra * extras=nullptr, const int timeout_ms=100);
   bool connect(bool blocking=true);
 };
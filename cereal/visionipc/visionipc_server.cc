@@ -1,28 +1,45 @@
 #include <iostream>
 #include <chrono>
 #include <cassert>
+#include <limits>
 #include <random>
 
+#include <fcntl.h>
 #include <poll.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
-#include "messaging.h"
 #include "ipc.h"
 #include "visionipc_server.h"
 
-std::string get_endpoint_name(std::string name, VisionStreamType type){
-  if (messaging_use_zmq()){
-    assert(name == "camerad");
-    return std::to_string(9000 + static_cast<int>(type));
-  } else {
-    return "visionipc_" + name + "_" + std::to_string(type);
-  }
+static uint64_t lease_now(){
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
 }
 
-VisionIpcServer::VisionIpcServer(std::string name, cl_device_id device_id, cl_context ctx) : name(name), device_id(device_id), ctx(ctx) {
-  msg_ctx = Context::create();
+static VisionIpcLeaseTable *create_lease_table(std::string name, VisionStreamType type, int *fd){
+#ifdef __APPLE__
+  std::string path = "/tmp/visionipc_leases_" + name + "_" + std::to_string(type) + "_" + std::to_string(getpid());
+#else
+  std::string path = "/dev/shm/visionipc_leases_" + name + "_" + std::to_string(type) + "_" + std::to_string(getpid());
+#endif
+
+  *fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0777);
+  assert(*fd >= 0);
+  unlink(path.c_str());
+
+  int err = ftruncate(*fd, sizeof(VisionIpcLeaseTable));
+  assert(err == 0);
+  void *addr = mmap(NULL, sizeof(VisionIpcLeaseTable), PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+  assert(addr != MAP_FAILED);
+
+  // Zero filled by ftruncate
+  VisionIpcLeaseTable *t = (VisionIpcLeaseTable *)addr;
+  t->server_pid = getpid();
+  return t;
+}
 
+VisionIpcServer::VisionIpcServer(std::string name, cl_device_id device_id, cl_context ctx) : name(name), device_id(device_id), ctx(ctx) {
   std::random_device rd("/dev/urandom");
   std::uniform_int_distribution<uint64_t> distribution(0,std::numeric_limits<uint64_t>::max());
   server_id = distribution(rd);
@@ -45,8 +62,8 @@ void VisionIpcServer::create_buffers(VisionStreamType type, size_t num_buffers,
   }
 
 
-  // Create map + alloc requested buffers
-  for (size_t i = 0; i < num_buffers; i++){
+  // Create map + alloc requested buffers, and one more that isn't shared for dropped frames
+  for (size_t i = 0; i < num_buffers + 1; i++){
     VisionBuf* buf = new VisionBuf();
     buf->allocate(size);
     buf->idx = i;
@@ -56,14 +73,15 @@ void VisionIpcServer::create_buffers(VisionStreamType type, size_t num_buffers,
 
     rgb ? buf->init_rgb(width, height, stride) : buf->init_yuv(width, height);
 
-    buffers[type].push_back(buf);
+    if (i < num_buffers){
+      buffers[type].push_back(buf);
+    } else {
+      drop_buffers[type] = buf;
+    }
   }
 
   cur_idx[type] = 0;
-
-  // Create msgq publisher for each of the `name` + type combos
-  // TODO: compute port number directly if using zmq
-  sockets[type] = PubSocket::create(msg_ctx, get_endpoint_name(name, type), false);
+  leases[type] = create_lease_table(name, type, &lease_fds[type]);
 }
 
 
@@ -110,7 +128,7 @@ void VisionIpcServer::listener(){
       continue;
     }
 
-    int fds[VISIONIPC_MAX_FDS];
+    int fds[VISIONIPC_MAX_FDS + 1];
     int num_fds = buffers[type].size();
     VisionBuf bufs[VISIONIPC_MAX_FDS];
 
@@ -127,7 +145,10 @@ void VisionIpcServer::listener(){
       bufs[i].server_id = server_id;
     }
 
-    r = ipc_sendrecv_with_fds(true, fd, &bufs, sizeof(VisionBuf) * num_fds, fds, num_fds, nullptr);
+    // The lease table goes last
+    fds[num_fds] = lease_fds[type];
+
+    r = ipc_sendrecv_with_fds(true, fd, &bufs, sizeof(VisionBuf) * num_fds, fds, num_fds + 1, nullptr);
 
     close(fd);
   }
@@ -139,24 +160,70 @@ void VisionIpcServer::listener(){
 
 
 VisionBuf * VisionIpcServer::get_buffer(VisionStreamType type){
-  // Do we want to keep track if the buffer has been sent out yet and warn user?
   assert(buffers.count(type));
-  auto b = buffers[type];
-  return b[cur_idx[type]++ % b.size()];
+  auto &b = buffers[type];
+  VisionIpcLeaseTable *t = leases[type];
+
+  // Round-robin over the buffers no client is reading. The server bit stays set
+  // until send(), so clients don't lease the buffer while it is being written.
+  size_t start = cur_idx[type]++;
+  for (size_t i = 0; i < b.size(); i++){
+    size_t idx = (start + i) % b.size();
+    uint64_t lease = t->lease[idx] & VISIONIPC_LEASE_WRITING;
+    if (t->lease[idx].compare_exchange_strong(lease, VISIONIPC_LEASE_WRITING)){
+      cur_idx[type] = start + i + 1;
+      return b[idx];
+    }
+    t->skips++;
+  }
+
+  // Take back buffers from clients that hang on to them for too long
+  uint64_t now = lease_now();
+  for (size_t i = 0; i < b.size(); i++){
+    size_t idx = (start + i) % b.size();
+    if (now - t->lease_time[idx] > VISIONIPC_LEASE_TIMEOUT_NS){
+      t->lease[idx] = VISIONIPC_LEASE_WRITING;
+      t->overwrites++;
+      cur_idx[type] = start + i + 1;
+      return b[idx];
+    }
+  }
+
+  return drop_buffers[type];
 }
 
 void VisionIpcServer::send(VisionBuf * buf, VisionIpcBufExtra * extra, bool sync){
-  if (sync) buf->sync(VISIONBUF_SYNC_FROM_DEVICE);
   assert(buffers.count(buf->type));
-  assert(buf->idx < buffers[buf->type].size());
+  VisionIpcLeaseTable *t = leases[buf->type];
+  if (buf == drop_buffers[buf->type]){
+    t->drops++;
+    return;
+  }
 
-  // Send over correct msgq socket
-  VisionIpcPacket packet = {0};
-  packet.server_id = server_id;
-  packet.idx = buf->idx;
-  packet.extra = *extra;
+  if (sync) buf->sync(VISIONBUF_SYNC_FROM_DEVICE);
+  assert(buf->idx < buffers[buf->type].size());
 
-  sockets[buf->type]->send((char*)&packet, sizeof(packet));
+  // Clients can lease the buffer from now on
+  uint64_t seq = ++t->seq[buf->idx];
+  t->lease[buf->idx].fetch_and(~VISIONIPC_LEASE_WRITING);
+
+  // Publish the frame in the ring, the only writer is this stream's sender
+  uint64_t frame = t->frames;
+  VisionIpcFrame &f = t->ring[frame % VISIONIPC_FRAME_RING_SIZE];
+  f.lock.fetch_add(1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  f.frame = frame;
+  f.idx = buf->idx;
+  f.seq = seq;
+  f.extra = *extra;
+  f.lock.fetch_add(1, std::memory_order_release);
+  t->frames++;
+
+  // Only wake clients that are actually sleeping
+  t->frame_futex++;
+  if (t->frame_waiters > 0){
+    ipc_futex_wake(&t->frame_futex);
+  }
 }
 
 VisionIpcServer::~VisionIpcServer(){
@@ -170,10 +237,17 @@ VisionIpcServer::~VisionIpcServer(){
       delete b;
     }
   }
-
-  // Messaging cleanup
-  for( auto const& [type, sock] : sockets ) {
-    delete sock;
+  for( auto const& [type, b] : drop_buffers ) {
+    b->free();
+    delete b;
+  }
+  for( auto const& [type, t] : leases ) {
+    // Wake clients so they notice the server is gone
+    t->server_pid = 0;
+    t->frame_futex++;
+    ipc_futex_wake(&t->frame_futex);
+
+    munmap(t, sizeof(VisionIpcLeaseTable));
+    close(lease_fds[type]);
   }
-  delete msg_ctx;
 }
@@ -5,12 +5,9 @@
 #include <atomic>
 #include <map>
 
-#include "messaging.h"
 #include "visionipc.h"
 #include "visionbuf.h"
 
-std::string get_endpoint_name(std::string name, VisionStreamType type);
-
 class VisionIpcServer {
  private:
   cl_device_id device_id = nullptr;
@@ -25,8 +22,10 @@ class VisionIpcServer {
   std::map<VisionStreamType, std::vector<VisionBuf*> > buffers;
   std::map<VisionStreamType, std::map<VisionBuf*, size_t> > idxs;
 
-  Context * msg_ctx;
-  std::map<VisionStreamType, PubSocket*> sockets;
+  // Handed out when every buffer is leased, frames in it are dropped instead of sent
+  std::map<VisionStreamType, VisionBuf*> drop_buffers;
+  std::map<VisionStreamType, VisionIpcLeaseTable*> leases;
+  std::map<VisionStreamType, int> lease_fds;
 
   void listener(void);
 
@@ -39,4 +38,6 @@ class VisionIpcServer {
   void create_buffers(VisionStreamType type, size_t num_buffers, bool rgb, size_t width, size_t height);
   void send(VisionBuf * buf, VisionIpcBufExtra * extra, bool sync=true);
   void start_listener();
+
+  const VisionIpcLeaseTable * get_leases(VisionStreamType type) { return leases.at(type); }
 };
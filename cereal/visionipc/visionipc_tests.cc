@@ -1,7 +1,11 @@
 #include <thread>
 #include <chrono>
+#include <cstring>
+#include <iostream>
+#include <vector>
 
 #include "catch2/catch.hpp"
+#include "messaging.h"
 #include "visionipc_server.h"
 #include "visionipc_client.h"
 
@@ -22,6 +26,48 @@ TEST_CASE("Connecting"){
   REQUIRE(client.connected);
 }
 
+TEST_CASE("Non-blocking connect finishes in the background"){
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_YUV_BACK, 2, false, 100, 100);
+  server.start_listener();
+
+  VisionIpcClient client = VisionIpcClient("camerad", VISION_STREAM_YUV_BACK, false);
+  int attempts = 0;
+  while (!client.connect(false) && attempts < 100){
+    REQUIRE(client.recv(nullptr, 0) == nullptr);
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    attempts++;
+  }
+  REQUIRE(client.connected);
+  REQUIRE(client.num_buffers == 2);
+}
+
+TEST_CASE("Reconnecting to the same server"){
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_YUV_BACK, 2, false, 100, 100);
+  server.start_listener();
+
+  VisionIpcClient client = VisionIpcClient("camerad", VISION_STREAM_YUV_BACK, false);
+  REQUIRE(client.connect());
+
+  client.connected = false;
+  REQUIRE(client.connect());
+  REQUIRE(client.num_buffers == 2);
+
+  // Still receives frames after the reconnect
+  VisionIpcBufExtra extra = {0};
+  extra.frame_id = 7;
+  VisionBuf * buf = server.get_buffer(VISION_STREAM_YUV_BACK);
+  *((uint64_t*)buf->addr) = 1234;
+  server.send(buf, &extra);
+
+  VisionIpcBufExtra extra_recv = {0};
+  VisionBuf * recv_buf = client.recv(&extra_recv);
+  REQUIRE(recv_buf != nullptr);
+  REQUIRE(*(uint64_t*)recv_buf->addr == 1234);
+  REQUIRE(extra_recv.frame_id == 7);
+}
+
 TEST_CASE("Check buffers"){
   size_t width = 100, height = 200, num_buffers = 5;
   VisionIpcServer server("camerad");
@@ -81,20 +127,22 @@ TEST_CASE("Send single buffer"){
 
 TEST_CASE("Test no conflate"){
   VisionIpcServer server("camerad");
-  server.create_buffers(VISION_STREAM_YUV_BACK, 1, true, 100, 100);
+  server.create_buffers(VISION_STREAM_YUV_BACK, 2, true, 100, 100);
   server.start_listener();
 
   VisionIpcClient client = VisionIpcClient("camerad", VISION_STREAM_YUV_BACK, false);
   REQUIRE(client.connect());
   zmq_sleep();
 
-  VisionBuf * buf = server.get_buffer(VISION_STREAM_YUV_BACK);
-  REQUIRE(buf != nullptr);
-
+  // A frame is only delivered while its buffer still holds it, so each frame gets its own
   VisionIpcBufExtra extra = {0};
   extra.frame_id = 1;
+  VisionBuf * buf = server.get_buffer(VISION_STREAM_YUV_BACK);
+  REQUIRE(buf != nullptr);
   server.send(buf, &extra);
   extra.frame_id = 2;
+  buf = server.get_buffer(VISION_STREAM_YUV_BACK);
+  REQUIRE(buf != nullptr);
   server.send(buf, &extra);
 
   VisionIpcBufExtra extra_recv = {0};
@@ -133,3 +181,239 @@ TEST_CASE("Test conflate"){
   recv_buf = client.recv(&extra_recv);
   REQUIRE(recv_buf == nullptr);
 }
+
+TEST_CASE("Slow readers skip frames that left the ring"){
+  VisionIpcServer server("camerad");
+  // Enough buffers that the frames still in the ring weren't rewritten
+  server.create_buffers(VISION_STREAM_YUV_BACK, VISIONIPC_FRAME_RING_SIZE, false, 100, 100);
+  server.start_listener();
+
+  VisionIpcClient client = VisionIpcClient("camerad", VISION_STREAM_YUV_BACK, false);
+  REQUIRE(client.connect());
+
+  VisionIpcBufExtra extra = {0};
+  const int num_frames = VISIONIPC_FRAME_RING_SIZE + 4;
+  for (int i = 0; i < num_frames; i++){
+    extra.frame_id = i;
+    server.send(server.get_buffer(VISION_STREAM_YUV_BACK), &extra);
+  }
+
+  // Everything still in the ring arrives in order
+  for (int i = num_frames - VISIONIPC_FRAME_RING_SIZE; i < num_frames; i++){
+    VisionIpcBufExtra extra_recv = {0};
+    REQUIRE(client.recv(&extra_recv, 0) != nullptr);
+    REQUIRE(extra_recv.frame_id == i);
+  }
+  REQUIRE(client.recv(nullptr, 0) == nullptr);
+}
+
+TEST_CASE("Waiting client is woken by a frame from another thread"){
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_YUV_BACK, 2, false, 100, 100);
+  server.start_listener();
+
+  VisionIpcClient client = VisionIpcClient("camerad", VISION_STREAM_YUV_BACK, false);
+  REQUIRE(client.connect());
+
+  std::thread sender([&](){
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    VisionIpcBufExtra extra = {0};
+    extra.frame_id = 42;
+    server.send(server.get_buffer(VISION_STREAM_YUV_BACK), &extra);
+  });
+
+  VisionIpcBufExtra extra_recv = {0};
+  auto start = std::chrono::steady_clock::now();
+  VisionBuf * recv_buf = client.recv(&extra_recv, 5000);
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  sender.join();
+
+  REQUIRE(recv_buf != nullptr);
+  REQUIRE(extra_recv.frame_id == 42);
+  REQUIRE(elapsed < std::chrono::seconds(1));
+}
+
+TEST_CASE("Client notices the server going away"){
+  VisionIpcServer *server = new VisionIpcServer("camerad");
+  server->create_buffers(VISION_STREAM_YUV_BACK, 1, false, 100, 100);
+  server->start_listener();
+
+  VisionIpcClient client = VisionIpcClient("camerad", VISION_STREAM_YUV_BACK, false);
+  REQUIRE(client.connect());
+
+  delete server;
+  REQUIRE(client.recv(nullptr, 10) == nullptr);
+  REQUIRE(!client.connected);
+}
+
+TEST_CASE("Leased buffers are skipped"){
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_YUV_BACK, 2, false, 100, 100);
+  server.start_listener();
+
+  VisionIpcClient client = VisionIpcClient("camerad", VISION_STREAM_YUV_BACK, false);
+  REQUIRE(client.connect());
+  zmq_sleep();
+
+  VisionIpcBufExtra extra = {0};
+  VisionBuf * buf = server.get_buffer(VISION_STREAM_YUV_BACK);
+  server.send(buf, &extra);
+
+  VisionBuf * recv_buf = client.recv();
+  REQUIRE(recv_buf != nullptr);
+  REQUIRE(recv_buf->idx == buf->idx);
+
+  // The next two frames go to the other buffer while the client holds the first one
+  for (int i = 0; i < 2; i++){
+    VisionBuf * next = server.get_buffer(VISION_STREAM_YUV_BACK);
+    REQUIRE(next->idx != buf->idx);
+    server.send(next, &extra);
+  }
+  REQUIRE(server.get_leases(VISION_STREAM_YUV_BACK)->skips == 1);
+
+  // Released on the next recv
+  REQUIRE(client.recv() != nullptr);
+  REQUIRE(server.get_buffer(VISION_STREAM_YUV_BACK)->idx == buf->idx);
+}
+
+TEST_CASE("Frames are dropped when every buffer is leased"){
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_YUV_BACK, 1, false, 100, 100);
+  server.start_listener();
+
+  VisionIpcClient client = VisionIpcClient("camerad", VISION_STREAM_YUV_BACK, false);
+  REQUIRE(client.connect());
+  zmq_sleep();
+
+  VisionIpcBufExtra extra = {0};
+  extra.frame_id = 1;
+  VisionBuf * buf = server.get_buffer(VISION_STREAM_YUV_BACK);
+  *((uint64_t*)buf->addr) = 1234;
+  server.send(buf, &extra);
+
+  VisionBuf * recv_buf = client.recv();
+  REQUIRE(recv_buf != nullptr);
+
+  extra.frame_id = 2;
+  VisionBuf * drop_buf = server.get_buffer(VISION_STREAM_YUV_BACK);
+  REQUIRE(drop_buf != buf);
+  *((uint64_t*)drop_buf->addr) = 5678;
+  server.send(drop_buf, &extra);
+
+  // The leased frame is intact and the new one never arrives
+  REQUIRE(*(uint64_t*)recv_buf->addr == 1234);
+  REQUIRE(server.get_leases(VISION_STREAM_YUV_BACK)->drops == 1);
+  REQUIRE(client.recv(nullptr, 10) == nullptr);
+}
+
+TEST_CASE("Overwritten frames are counted"){
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_YUV_BACK, 1, false, 100, 100);
+  server.start_listener();
+
+  VisionIpcClient client = VisionIpcClient("camerad", VISION_STREAM_YUV_BACK, false);
+  REQUIRE(client.connect());
+  zmq_sleep();
+
+  VisionIpcBufExtra extra = {0};
+  for (int i = 0; i < 2; i++){
+    extra.frame_id = i;
+    VisionBuf * buf = server.get_buffer(VISION_STREAM_YUV_BACK);
+    server.send(buf, &extra);
+  }
+
+  // The first frame was rewritten before the client leased it, so it is skipped
+  // and the buffer comes with the extra of the frame it actually holds
+  VisionIpcBufExtra extra_recv = {0};
+  REQUIRE(client.recv(&extra_recv) != nullptr);
+  REQUIRE(extra_recv.frame_id == 1);
+  REQUIRE(client.leases->overwrites == 1);
+  REQUIRE(client.recv(nullptr, 10) == nullptr);
+  REQUIRE(client.leases->overwrites == 1);
+  REQUIRE(server.get_leases(VISION_STREAM_YUV_BACK)->frames == 2);
+}
+
+TEST_CASE("Multi-stream receive returns synced frames"){
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_YUV_BACK, 4, false, 100, 100);
+  server.create_buffers(VISION_STREAM_YUV_WIDE, 4, false, 100, 100);
+  server.start_listener();
+
+  const uint64_t tolerance = 1000;
+  VisionIpcMultiClient client("camerad", {VISION_STREAM_YUV_BACK, VISION_STREAM_YUV_WIDE}, tolerance);
+  REQUIRE(client.connect());
+  zmq_sleep();
+
+  auto send = [&](VisionStreamType type, uint32_t frame_id, uint64_t sof){
+    VisionIpcBufExtra extra = {0};
+    extra.frame_id = frame_id;
+    extra.timestamp_sof = sof;
+    server.send(server.get_buffer(type), &extra);
+  };
+
+  VisionBuf *bufs[2];
+  VisionIpcBufExtra extras[2];
+
+  // Only one stream, no tuple yet
+  send(VISION_STREAM_YUV_BACK, 1, 10000);
+  REQUIRE(!client.recv(bufs, extras, 10));
+
+  send(VISION_STREAM_YUV_WIDE, 1, 10000 + tolerance / 2);
+  REQUIRE(client.recv(bufs, extras));
+  REQUIRE(bufs[0]->type == VISION_STREAM_YUV_BACK);
+  REQUIRE(bufs[1]->type == VISION_STREAM_YUV_WIDE);
+  REQUIRE(extras[0].frame_id == 1);
+  REQUIRE(extras[1].frame_id == 1);
+
+  // A frame with nothing close to it on the other stream is dropped
+  send(VISION_STREAM_YUV_BACK, 2, 20000);
+  send(VISION_STREAM_YUV_WIDE, 3, 30000);
+  REQUIRE(!client.recv(bufs, extras, 10));
+  send(VISION_STREAM_YUV_BACK, 3, 30000);
+  REQUIRE(client.recv(bufs, extras));
+  REQUIRE(extras[0].frame_id == 3);
+  REQUIRE(extras[1].frame_id == 3);
+
+  REQUIRE(client.stats.synced == 2);
+  REQUIRE(client.stats.dropped == 1);
+  REQUIRE(client.stats.skew_max == tolerance / 2);
+}
+
+// Run with: ./test_runner "[benchmark]"
+TEST_CASE("Allocation and copy throughput", "[.][benchmark]"){
+  const size_t width = 1928, height = 1208, num_buffers = 20, num_frames = 200;
+
+  auto start = std::chrono::steady_clock::now();
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_YUV_BACK, num_buffers, false, width, height);
+  server.start_listener();
+  double alloc_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+  VisionIpcClient client = VisionIpcClient("camerad", VISION_STREAM_YUV_BACK, false);
+  REQUIRE(client.connect());
+  zmq_sleep();
+
+  size_t len = client.buffers[0].len;
+  std::vector<uint8_t> frame(len, 1), out(len);
+
+  start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < num_frames; i++){
+    VisionIpcBufExtra extra = {0};
+    extra.frame_id = i;
+    frame[0] = i;
+
+    VisionBuf * buf = server.get_buffer(VISION_STREAM_YUV_BACK);
+    memcpy(buf->addr, frame.data(), len);
+    server.send(buf, &extra);
+
+    VisionBuf * recv_buf = client.recv(&extra);
+    REQUIRE(recv_buf != nullptr);
+    memcpy(out.data(), recv_buf->addr, len);
+    REQUIRE(out[0] == (uint8_t)i);
+  }
+  double copy_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  std::cout << "create_buffers " << num_buffers << "x" << width << "x" << height << ": " << alloc_ms << " ms, "
+            << "copy in and out: " << num_frames / copy_s << " frames/s, "
+            << 2.0 * num_frames * len / copy_s / 1e9 << " GB/s" << std::endl;
+}
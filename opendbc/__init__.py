@@ -1,2 +1,4 @@
 import os
 DBC_PATH = os.path.dirname(os.path.abspath(__file__))
+# DBCs loaded at runtime are cached per user, see dbc_load
+DBC_CACHE_DIR = os.path.join(os.environ.get("XDG_CACHE_HOME") or os.path.expanduser("~/.cache"), "opendbc")
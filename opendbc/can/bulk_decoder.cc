@@ -0,0 +1,198 @@
+#include <cassert>
+#include <cstring>
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <thread>
+
+#include <kj/exception.h>
+
+#include "common.h"
+
+CANBulkDecoder::CANBulkDecoder(int abus, const std::string& dbc_name, const std::vector<SignalParseOptions> &signals,
+                               bool ignore_checksum, bool ignore_counter)
+  : bus(abus) {
+
+  dbc = dbc_lookup(dbc_name);
+  assert(dbc);
+  init_crc_lookup_tables();
+  const DBCIndex *dbc_idx = dbc_index(dbc);
+
+  for (size_t c = 0; c < signals.size(); c++) {
+    const SignalParseOptions &sigop = signals[c];
+    const Msg *msg = dbc_find_msg(dbc, sigop.address);
+    if (!msg) {
+      fprintf(stderr, "CANBulkDecoder: could not find message 0x%X in DBC %s\n", sigop.address, dbc_name.c_str());
+      assert(false);
+    }
+
+    auto it = std::find_if(states.begin(), states.end(), [&](const MessageState &s) { return s.address == msg->address; });
+    size_t s = it - states.begin();
+    if (it == states.end()) {
+      states.emplace_back();
+      columns.emplace_back();
+      MessageState &state = states.back();
+      state.init(msg);
+      state.ignore_checksum = ignore_checksum;
+      state.ignore_counter = ignore_counter;
+
+      // Checksums and counters are only checked on the signals that are parsed
+      for (int i = 0; i < msg->num_sigs; i++) {
+        SignalType type = msg->sigs[i].type;
+        bool is_counter = type == SignalType::HONDA_COUNTER || type == SignalType::VOLKSWAGEN_COUNTER || type == SignalType::PEDAL_COUNTER;
+        if (type != SignalType::DEFAULT && !(is_counter ? ignore_counter : ignore_checksum)) {
+          state.add_signal(msg, i);
+          columns.back().push_back(-1);
+        }
+      }
+    }
+
+    const Signal *sig = dbc_idx->find_signal(msg->address, sigop.name);
+    if (!sig) {
+      fprintf(stderr, "CANBulkDecoder: could not find signal %s of 0x%X in DBC %s\n", sigop.name, sigop.address, dbc_name.c_str());
+      assert(false);
+    }
+    states[s].add_signal(msg, sig - msg->sigs);
+    columns[s].push_back(c);
+  }
+  num_columns = signals.size();
+
+  // Sorted by address for the lookups, the columns follow their states
+  std::vector<size_t> order(states.size());
+  for (size_t i = 0; i < order.size(); i++) order[i] = i;
+  std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return states[a].address < states[b].address; });
+
+  std::vector<MessageState> sorted_states;
+  std::vector<std::vector<int>> sorted_columns;
+  for (size_t i : order) {
+    sorted_states.push_back(states[i]);
+    sorted_columns.push_back(columns[i]);
+  }
+  states.swap(sorted_states);
+  columns.swap(sorted_columns);
+}
+
+void CANBulkDecoder::init_segment(Segment &seg) {
+  seg.states = states;
+  seg.columns.resize(num_columns);
+
+  size_t num_vals = 0;
+  for (auto &state : seg.states) {
+    num_vals += state.parse_sigs.size();
+  }
+  seg.vals.assign(num_vals, 0);
+
+  size_t offset = 0;
+  for (auto &state : seg.states) {
+    state.vals = &seg.vals[offset];
+    offset += state.parse_sigs.size();
+  }
+}
+
+void CANBulkDecoder::decode_frame(Segment &seg, uint64_t sec, uint32_t address, const uint8_t *dat, size_t len) {
+  auto it = std::lower_bound(seg.states.begin(), seg.states.end(), address, [](const MessageState &s, uint32_t a) {
+    return s.address < a;
+  });
+  if (it == seg.states.end() || it->address != address || len > CANFD_MAX_SIZE) return;
+
+  uint8_t data[CANFD_MAX_SIZE] = {0};
+  memcpy(data, dat, len);
+  if (!it->parse(sec, 0, data)) return;
+
+  const std::vector<int> &cols = columns[it - seg.states.begin()];
+  for (size_t i = 0; i < cols.size(); i++) {
+    if (cols[i] < 0) continue;
+    CANBulkColumn &col = seg.columns[cols[i]];
+    col.ts.push_back(sec);
+    col.values.push_back(it->vals[i]);
+  }
+}
+
+template <typename F>
+CANBulkResult CANBulkDecoder::decode(size_t num_segments, int num_threads, F decode_segment) {
+  if (num_threads <= 0) {
+    num_threads = std::max(1U, std::thread::hardware_concurrency());
+  }
+  num_threads = std::min<size_t>(num_threads, std::max<size_t>(num_segments, 1));
+
+  // Each thread takes the next segment until there are none left
+  std::vector<Segment> segs(num_segments);
+  CANBulkResult ret;
+  ret.errors.resize(num_segments);
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    for (size_t i = next++; i < num_segments; i = next++) {
+      init_segment(segs[i]);
+      // An exception must not leave the thread, the segment stops at the bad event
+      try {
+        decode_segment(segs[i], i);
+      } catch (const kj::Exception &e) {
+        ret.errors[i] = e.getDescription().cStr();
+      } catch (const std::exception &e) {
+        ret.errors[i] = e.what();
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (int i = 1; i < num_threads; i++) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto &t : threads) {
+    t.join();
+  }
+
+  ret.columns.resize(num_columns);
+  for (size_t c = 0; c < num_columns; c++) {
+    CANBulkColumn &col = ret.columns[c];
+    size_t size = 0;
+    for (auto &seg : segs) {
+      size += seg.columns[c].ts.size();
+    }
+    col.ts.reserve(size);
+    col.values.reserve(size);
+    for (auto &seg : segs) {
+      col.ts.insert(col.ts.end(), seg.columns[c].ts.begin(), seg.columns[c].ts.end());
+      col.values.insert(col.values.end(), seg.columns[c].values.begin(), seg.columns[c].values.end());
+    }
+  }
+  return ret;
+}
+
+CANBulkResult CANBulkDecoder::decode_frames(const std::vector<std::vector<CANBulkFrame>> &segments, int num_threads) {
+  return decode(segments.size(), num_threads, [&](Segment &seg, size_t i) {
+    for (const auto &f : segments[i]) {
+      if (f.src == bus) {
+        decode_frame(seg, f.sec, f.address, f.dat, f.len);
+      }
+    }
+  });
+}
+
+#ifndef DYNAMIC_CAPNP
+CANBulkResult CANBulkDecoder::decode_events(const std::vector<std::string> &segments, int num_threads) {
+  return decode(segments.size(), num_threads, [&](Segment &seg, size_t i) {
+    // One aligned copy of the segment, the events are read in place
+    const std::string &data = segments[i];
+    kj::Array<capnp::word> buf = kj::heapArray<capnp::word>(data.size() / sizeof(capnp::word) + 1);
+    memcpy(buf.begin(), data.data(), data.size());
+
+    kj::ArrayPtr<const capnp::word> words = buf.slice(0, data.size() / sizeof(capnp::word));
+    while (words.size() > 0) {
+      capnp::FlatArrayMessageReader reader(words);
+      cereal::Event::Reader event = reader.getRoot<cereal::Event>();
+      if (event.isCan()) {
+        uint64_t sec = event.getLogMonoTime();
+        for (auto frame : event.getCan()) {
+          if (frame.getSrc() != bus) continue;
+          auto dat = frame.getDat();
+          decode_frame(seg, sec, frame.getAddress(), dat.begin(), dat.size());
+        }
+      }
+      words = kj::arrayPtr(reader.getEnd(), words.end());
+    }
+  });
+}
+#endif
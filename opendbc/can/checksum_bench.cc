@@ -0,0 +1,251 @@
+// Checksums/sec of each checksum family in common.cc, called once per frame and through the
+// batched check_checksums, against the byte at a time versions they replaced. All of them
+// are checked to agree on every frame.
+//
+// The frames are random data for every message with a checksum in the DBCs, so the mix of
+// addresses and sizes is the one of the cars.
+//
+// usage: checksum_bench
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+#define BENCH_FRAMES_PER_MSG 256
+#define BENCH_MIN_FRAMES 2000000
+
+// The byte at a time versions, for reference
+
+static unsigned int ref_honda_checksum(unsigned int address, uint64_t d, int l) {
+  d >>= ((8-l)*8); // remove padding
+  d >>= 4; // remove checksum
+
+  int s = 0;
+  while (address) { s += (address & 0xF); address >>= 4; }
+  while (d) { s += (d & 0xF); d >>= 4; }
+  s = 8-s;
+  s &= 0xF;
+
+  return s;
+}
+
+static unsigned int ref_toyota_checksum(unsigned int address, uint64_t d, int l) {
+  d >>= ((8-l)*8); // remove padding
+  d >>= 8; // remove checksum
+
+  unsigned int s = l;
+  while (address) { s += address & 0xFF; address >>= 8; }
+  while (d) { s += d & 0xFF; d >>= 8; }
+
+  return s & 0xFF;
+}
+
+static unsigned int ref_subaru_checksum(unsigned int address, uint64_t d, int l) {
+  d >>= ((8-l)*8); // remove padding
+
+  unsigned int s = 0;
+  while (address) { s += address & 0xFF; address >>= 8; }
+  l -= 1; // checksum is first byte
+  while (l) { s += d & 0xFF; d >>= 8; l -= 1; }
+
+  return s & 0xFF;
+}
+
+static unsigned int ref_chrysler_checksum(unsigned int address, uint64_t d, int l) {
+  uint8_t checksum = 0xFF;
+  for (int j = 0; j < (l - 1); j++) {
+    uint8_t shift = 0x80;
+    uint8_t curr = (d >> 8*j) & 0xFF;
+    for (int i=0; i<8; i++) {
+      uint8_t bit_sum = curr & shift;
+      uint8_t temp_chk = checksum & 0x80U;
+      if (bit_sum != 0U) {
+        bit_sum = 0x1C;
+        if (temp_chk != 0U) {
+          bit_sum = 1;
+        }
+        checksum = checksum << 1;
+        temp_chk = checksum | 1U;
+        bit_sum ^= temp_chk;
+      } else {
+        if (temp_chk != 0U) {
+          bit_sum = 0x1D;
+        }
+        checksum = checksum << 1;
+        bit_sum ^= checksum;
+      }
+      checksum = bit_sum;
+      shift = shift >> 1;
+    }
+  }
+  return ~checksum & 0xFF;
+}
+
+static unsigned int ref_pedal_checksum(uint64_t d, int l) {
+  uint8_t crc = 0xFF;
+  uint8_t poly = 0xD5; // standard crc8
+
+  d >>= ((8-l)*8); // remove padding
+  d >>= 8; // remove checksum
+
+  int i, j;
+  for (i = 0; i < l - 1; i++) {
+    crc ^= (d >> (i*8)) & 0xFF;
+    for (j = 0; j < 8; j++) {
+      if ((crc & 0x80) != 0) {
+        crc = (uint8_t)((crc << 1) ^ poly);
+      }
+      else {
+        crc <<= 1;
+      }
+    }
+  }
+  return crc;
+}
+
+struct Family {
+  std::vector<const Msg*> msgs;
+  std::vector<const Signal*> sigs;
+  std::vector<uint8_t> dat;  // BENCH_FRAMES_PER_MSG frames of each message, 8 bytes each
+};
+
+static unsigned int checksum(SignalType type, bool reference, const Msg *msg, const uint8_t *dat) {
+  uint64_t dat_le = read_u64_le(dat);
+  uint64_t dat_be = read_u64_be(dat);
+  switch (type) {
+    case SignalType::HONDA_CHECKSUM:
+      return (reference ? ref_honda_checksum : honda_checksum)(msg->address, dat_be, msg->size);
+    case SignalType::TOYOTA_CHECKSUM:
+      return (reference ? ref_toyota_checksum : toyota_checksum)(msg->address, dat_be, msg->size);
+    case SignalType::SUBARU_CHECKSUM:
+      return (reference ? ref_subaru_checksum : subaru_checksum)(msg->address, dat_be, msg->size);
+    case SignalType::CHRYSLER_CHECKSUM:
+      return (reference ? ref_chrysler_checksum : chrysler_checksum)(msg->address, dat_le, msg->size);
+    case SignalType::PEDAL_CHECKSUM:
+      return (reference ? ref_pedal_checksum : pedal_checksum)(dat_be, msg->size);
+    default:
+      return volkswagen_crc(msg->address, dat_le, msg->size);
+  }
+}
+
+// Raw value of the checksum signal in the frame
+static uint64_t get_checksum(const Signal *sig, const uint8_t *dat) {
+  uint64_t mask = (1ULL << sig->b2) - 1;
+  return sig->is_little_endian ? (read_u64_le(dat) >> sig->b1) & mask : (read_u64_be(dat) >> sig->bo) & mask;
+}
+
+static void set_checksum(const Signal *sig, uint8_t *dat, uint64_t v) {
+  uint64_t mask = (1ULL << sig->b2) - 1;
+  if (sig->is_little_endian) {
+    uint64_t d = (read_u64_le(dat) & ~(mask << sig->b1)) | (v << sig->b1);
+    for (int b = 0; b < 8; b++) dat[b] = d >> (8 * b);
+  } else {
+    uint64_t d = (read_u64_be(dat) & ~(mask << sig->bo)) | (v << sig->bo);
+    for (int b = 0; b < 8; b++) dat[b] = d >> (56 - 8 * b);
+  }
+}
+
+// Frames per second, over whole passes of the family's frames
+template <typename F>
+static double run(Family &f, F pass) {
+  size_t frames = f.msgs.size() * BENCH_FRAMES_PER_MSG;
+  int loops = std::max<int>(1, BENCH_MIN_FRAMES / frames);
+  auto start = std::chrono::steady_clock::now();
+  for (int loop = 0; loop < loops; loop++) {
+    pass();
+  }
+  double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  return frames * loops / s;
+}
+
+int main(int argc, char* argv[]) {
+  init_crc_lookup_tables();
+
+  const std::map<SignalType, const char*> names = {
+    {SignalType::HONDA_CHECKSUM, "honda"},
+    {SignalType::TOYOTA_CHECKSUM, "toyota"},
+    {SignalType::SUBARU_CHECKSUM, "subaru"},
+    {SignalType::CHRYSLER_CHECKSUM, "chrysler"},
+    {SignalType::VOLKSWAGEN_CHECKSUM, "volkswagen"},
+    {SignalType::PEDAL_CHECKSUM, "pedal"},
+  };
+
+  std::map<SignalType, Family> families;
+  for (const DBC *dbc : get_dbcs()) {
+    for (int i = 0; i < dbc->num_msgs; i++) {
+      const Msg *msg = &dbc->msgs[i];
+      for (int j = 0; j < msg->num_sigs; j++) {
+        SignalType type = msg->sigs[j].type;
+        if (names.count(type) == 0) continue;
+
+        // Random data, every other frame with the right checksum
+        Family &f = families[type];
+        f.msgs.push_back(msg);
+        f.sigs.push_back(&msg->sigs[j]);
+        for (int k = 0; k < BENCH_FRAMES_PER_MSG; k++) {
+          uint8_t dat[8];
+          for (int b = 0; b < 8; b++) dat[b] = rand();
+          if (k % 2 == 0) {
+            set_checksum(&msg->sigs[j], dat, checksum(type, false, msg, dat));
+          }
+          f.dat.insert(f.dat.end(), dat, dat + 8);
+        }
+        break;
+      }
+    }
+  }
+
+  printf("%-12s %6s %14s %14s %14s\n", "", "msgs", "byte at a time", "per frame", "batched");
+  for (auto &kv : families) {
+    SignalType type = kv.first;
+    Family &f = kv.second;
+    bool has_reference = type != SignalType::VOLKSWAGEN_CHECKSUM;
+
+    // Same checksums from every version, and the batch passes exactly the frames that match
+    bool ok[BENCH_FRAMES_PER_MSG];
+    size_t mismatches = 0;
+    for (size_t m = 0; m < f.msgs.size(); m++) {
+      const uint8_t *dat = &f.dat[m * BENCH_FRAMES_PER_MSG * 8];
+      check_checksums(f.msgs[m], dat, BENCH_FRAMES_PER_MSG, ok);
+      for (int i = 0; i < BENCH_FRAMES_PER_MSG; i++) {
+        unsigned int c = checksum(type, false, f.msgs[m], &dat[i * 8]);
+        bool match = c == get_checksum(f.sigs[m], &dat[i * 8]);
+        if ((has_reference && c != checksum(type, true, f.msgs[m], &dat[i * 8])) || ok[i] != match) {
+          mismatches++;
+        }
+      }
+    }
+    if (mismatches > 0) {
+      printf("%s: %zu mismatches\n", names.at(type), mismatches);
+      return 1;
+    }
+
+    volatile unsigned int sink = 0;
+    double reference = !has_reference ? 0 : run(f, [&]() {
+      for (size_t i = 0; i < f.dat.size() / 8; i++) {
+        sink += checksum(type, true, f.msgs[i / BENCH_FRAMES_PER_MSG], &f.dat[i * 8]);
+      }
+    });
+    double per_frame = run(f, [&]() {
+      for (size_t i = 0; i < f.dat.size() / 8; i++) {
+        sink += checksum(type, false, f.msgs[i / BENCH_FRAMES_PER_MSG], &f.dat[i * 8]);
+      }
+    });
+    double batched = run(f, [&]() {
+      for (size_t m = 0; m < f.msgs.size(); m++) {
+        sink += check_checksums(f.msgs[m], &f.dat[m * BENCH_FRAMES_PER_MSG * 8], BENCH_FRAMES_PER_MSG, ok);
+      }
+    });
+
+    std::string ref_str = has_reference ? std::to_string((long)reference) : "-";
+    printf("%-12s %6zu %14s %14.0f %14.0f  frames/s\n", names.at(type), f.msgs.size(), ref_str.c_str(), per_frame, batched);
+  }
+  return 0;
+}
@@ -1,76 +1,49 @@
+#include <algorithm>
+#include <mutex>
+
 #include "common.h"
 
+// Sums of all the bytes and of all the nibbles of a word, added up in parallel lanes
+// instead of one at a time
+static inline unsigned int byte_sum(uint64_t d) {
+  d = (d & 0x00FF00FF00FF00FFULL) + ((d >> 8) & 0x00FF00FF00FF00FFULL);
+  return (d * 0x0001000100010001ULL) >> 48;
+}
+
+static inline unsigned int nibble_sum(uint64_t d) {
+  d = (d & 0x0F0F0F0F0F0F0F0FULL) + ((d >> 4) & 0x0F0F0F0F0F0F0F0FULL);
+  return (d * 0x0101010101010101ULL) >> 56;
+}
+
 unsigned int honda_checksum(unsigned int address, uint64_t d, int l) {
   d >>= ((8-l)*8); // remove padding
   d >>= 4; // remove checksum
 
-  int s = 0;
-  while (address) { s += (address & 0xF); address >>= 4; }
-  while (d) { s += (d & 0xF); d >>= 4; }
-  s = 8-s;
-  s &= 0xF;
-
-  return s;
+  unsigned int s = nibble_sum(address) + nibble_sum(d);
+  return (8 - s) & 0xF;
 }
 
 unsigned int toyota_checksum(unsigned int address, uint64_t d, int l) {
   d >>= ((8-l)*8); // remove padding
   d >>= 8; // remove checksum
 
-  unsigned int s = l;
-  while (address) { s += address & 0xFF; address >>= 8; }
-  while (d) { s += d & 0xFF; d >>= 8; }
-
-  return s & 0xFF;
+  return (l + byte_sum(address) + byte_sum(d)) & 0xFF;
 }
 
 unsigned int subaru_checksum(unsigned int address, uint64_t d, int l) {
   d >>= ((8-l)*8); // remove padding
+  d &= (l > 1) ? (~0ULL >> (64 - (l-1)*8)) : 0; // checksum is first byte
 
-  unsigned int s = 0;
-  while (address) { s += address & 0xFF; address >>= 8; }
-  l -= 1; // checksum is first byte
-  while (l) { s += d & 0xFF; d >>= 8; l -= 1; }
-
-  return s & 0xFF;
+  return (byte_sum(address) + byte_sum(d)) & 0xFF;
 }
 
-unsigned int chrysler_checksum(unsigned int address, uint64_t d, int l) {
-  /* This function does not want the checksum byte in the input data.
-  jeep chrysler canbus checksum from http://illmatics.com/Remote%20Car%20Hacking.pdf */
-  uint8_t checksum = 0xFF;
-  for (int j = 0; j < (l - 1); j++) {
-    uint8_t shift = 0x80;
-    uint8_t curr = (d >> 8*j) & 0xFF;
-    for (int i=0; i<8; i++) {
-      uint8_t bit_sum = curr & shift;
-      uint8_t temp_chk = checksum & 0x80U;
-      if (bit_sum != 0U) {
-        bit_sum = 0x1C;
-        if (temp_chk != 0U) {
-          bit_sum = 1;
-        }
-        checksum = checksum << 1;
-        temp_chk = checksum | 1U;
-        bit_sum ^= temp_chk;
-      } else {
-        if (temp_chk != 0U) {
-          bit_sum = 0x1D;
-        }
-        checksum = checksum << 1;
-        bit_sum ^= checksum;
-      }
-      checksum = bit_sum;
-      shift = shift >> 1;
-    }
-  }
-  return ~checksum & 0xFF;
-}
+// Lookup tables for CRC-8, [k][x] is the CRC of byte x followed by k zero bytes. A message
+// is then looked up all at once (slice-by-8), rather than one byte after the other.
+static uint8_t crc8_lut_8h2f[8][256];  // poly 0x2F, aka 8H2F/AUTOSAR
+static uint8_t crc8_lut_j1850[8][256]; // poly 0x1D, SAE J1850
+static uint8_t crc8_lut_d5[8][256];    // poly 0xD5
 
-// Static lookup table for fast computation of CRC8 poly 0x2F, aka 8H2F/AUTOSAR
-uint8_t crc8_lut_8h2f[256];
-
-void gen_crc_lookup_table(uint8_t poly, uint8_t crc_lut[]) {
+void gen_crc_lookup_table(uint8_t poly, uint8_t crc_lut[][256]) {
   uint8_t crc;
   int i, j;
 
@@ -82,14 +55,45 @@ void gen_crc_lookup_table(uint8_t poly, uint8_t crc_lut[]) {
       else
         crc <<= 1;
     }
-    crc_lut[i] = crc;
+    crc_lut[0][i] = crc;
+  }
+
+  for (j = 1; j < 8; j++) {
+    for (i = 0; i < 256; i++) {
+      crc_lut[j][i] = crc_lut[0][crc_lut[j-1][i]];
+    }
   }
 }
 
 void init_crc_lookup_tables() {
-  // At init time, set up static lookup tables for fast CRC computation.
+  // At init time, set up static lookup tables for fast CRC computation. Once, parsers and
+  // packers may be constructed on other threads while these are in use.
+  static std::once_flag once;
+  std::call_once(once, []() {
+    gen_crc_lookup_table(0x2F, crc8_lut_8h2f);    // CRC-8 8H2F/AUTOSAR for Volkswagen
+    gen_crc_lookup_table(0x1D, crc8_lut_j1850);   // CRC-8 SAE J1850 for Chrysler
+    gen_crc_lookup_table(0xD5, crc8_lut_d5);      // CRC-8 for the comma pedal
+  });
+}
+
+// CRC-8 of the n lowest bytes of d, lowest byte first
+static inline uint8_t crc8_slice(const uint8_t crc_lut[][256], uint8_t crc, uint64_t d, int n) {
+  if (n == 0) {
+    return crc;
+  }
 
-  gen_crc_lookup_table(0x2F, crc8_lut_8h2f);    // CRC-8 8H2F/AUTOSAR for Volkswagen
+  uint8_t ret = crc_lut[n-1][(crc ^ d) & 0xFF];
+  for (int i = 1; i < n; i++) {
+    ret ^= crc_lut[n-1-i][(d >> (i*8)) & 0xFF];
+  }
+  return ret;
+}
+
+unsigned int chrysler_checksum(unsigned int address, uint64_t d, int l) {
+  /* This function does not want the checksum byte in the input data.
+  jeep chrysler canbus checksum from http://illmatics.com/Remote%20Car%20Hacking.pdf
+  It is the SAE J1850 CRC-8: poly 0x1D, init and final XOR 0xFF. */
+  return crc8_slice(crc8_lut_j1850, 0xFF, d, l - 1) ^ 0xFF;
 }
 
 unsigned int volkswagen_crc(unsigned int address, uint64_t d, int l) {
@@ -100,10 +104,7 @@ unsigned int volkswagen_crc(unsigned int address, uint64_t d, int l) {
   uint8_t crc = 0xFF; // Standard init value for CRC8 8H2F/AUTOSAR
 
   // CRC the payload first, skipping over the first byte where the CRC lives.
-  for (int i = 1; i < l; i++) {
-    crc ^= (d >> (i*8)) & 0xFF;
-    crc = crc8_lut_8h2f[crc];
-  }
+  crc = crc8_slice(crc8_lut_8h2f, crc, d >> 8, l - 1);
 
   // Look up and apply the magic final CRC padding byte, which permutes by CAN
   // address, and additionally (for SOME addresses) by the message counter.
@@ -165,53 +166,58 @@ unsigned int volkswagen_crc(unsigned int address, uint64_t d, int l) {
       crc ^= (uint8_t[]){0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00}[counter];
       break;
   }
-  crc = crc8_lut_8h2f[crc];
+  crc = crc8_lut_8h2f[0][crc];
 
   return crc ^ 0xFF; // Return after standard final XOR for CRC8 8H2F/AUTOSAR
 }
 
 
 unsigned int pedal_checksum(uint64_t d, int l) {
-  uint8_t crc = 0xFF;
-  uint8_t poly = 0xD5; // standard crc8
-
+  // standard crc8, poly 0xD5
   d >>= ((8-l)*8); // remove padding
   d >>= 8; // remove checksum
 
-  int i, j;
-  for (i = 0; i < l - 1; i++) {
-    crc ^= (d >> (i*8)) & 0xFF;
-    for (j = 0; j < 8; j++) {
-      if ((crc & 0x80) != 0) {
-        crc = (uint8_t)((crc << 1) ^ poly);
-      }
-      else {
-        crc <<= 1;
-      }
-    }
-  }
-  return crc;
+  return crc8_slice(crc8_lut_d5, 0xFF, d, l - 1);
 }
 
-
-uint64_t read_u64_be(const uint8_t* v) {
-  return (((uint64_t)v[0] << 56)
-          | ((uint64_t)v[1] << 48)
-          | ((uint64_t)v[2] << 40)
-          | ((uint64_t)v[3] << 32)
-          | ((uint64_t)v[4] << 24)
-          | ((uint64_t)v[5] << 16)
-          | ((uint64_t)v[6] << 8)
-          | (uint64_t)v[7]);
+template <typename F>
+static size_t check_frames(const Signal &sig, const uint8_t *dat, size_t n, bool *ok, F checksum) {
+  const uint64_t mask = (1ULL << sig.b2) - 1;
+  size_t passed = 0;
+  for (size_t i = 0; i < n; i++) {
+    uint64_t dat_le = read_u64_le(&dat[i*8]);
+    uint64_t dat_be = read_u64_be(&dat[i*8]);
+    uint64_t expected = (sig.is_little_endian ? (dat_le >> sig.b1) : (dat_be >> sig.bo)) & mask;
+    ok[i] = checksum(dat_le, dat_be) == expected;
+    passed += ok[i];
+  }
+  return passed;
 }
 
-uint64_t read_u64_le(const uint8_t* v) {
-  return ((uint64_t)v[0]
-          | ((uint64_t)v[1] << 8)
-          | ((uint64_t)v[2] << 16)
-          | ((uint64_t)v[3] << 24)
-          | ((uint64_t)v[4] << 32)
-          | ((uint64_t)v[5] << 40)
-          | ((uint64_t)v[6] << 48)
-          | ((uint64_t)v[7] << 56));
+size_t check_checksums(const Msg *msg, const uint8_t *dat, size_t n, bool *ok) {
+  // One loop per checksum type, with the checksum inlined into it
+  const unsigned int address = msg->address;
+  const int size = msg->size;
+  for (int i = 0; i < msg->num_sigs; i++) {
+    const Signal &sig = msg->sigs[i];
+    switch (sig.type) {
+      case SignalType::HONDA_CHECKSUM:
+        return check_frames(sig, dat, n, ok, [=](uint64_t le, uint64_t be) { return honda_checksum(address, be, size); });
+      case SignalType::TOYOTA_CHECKSUM:
+        return check_frames(sig, dat, n, ok, [=](uint64_t le, uint64_t be) { return toyota_checksum(address, be, size); });
+      case SignalType::SUBARU_CHECKSUM:
+        return check_frames(sig, dat, n, ok, [=](uint64_t le, uint64_t be) { return subaru_checksum(address, be, size); });
+      case SignalType::CHRYSLER_CHECKSUM:
+        return check_frames(sig, dat, n, ok, [=](uint64_t le, uint64_t be) { return chrysler_checksum(address, le, size); });
+      case SignalType::VOLKSWAGEN_CHECKSUM:
+        return check_frames(sig, dat, n, ok, [=](uint64_t le, uint64_t be) { return volkswagen_crc(address, le, size); });
+      case SignalType::PEDAL_CHECKSUM:
+        return check_frames(sig, dat, n, ok, [=](uint64_t le, uint64_t be) { return pedal_checksum(be, size); });
+      default:
+        break;
+    }
+  }
+
+  std::fill(ok, ok + n, true);
+  return n;
 }
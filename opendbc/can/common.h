@@ -14,24 +14,19 @@
 
 #define MAX_BAD_COUNTER 5
 
-// Helper functions
-unsigned int honda_checksum(unsigned int address, uint64_t d, int l);
-unsigned int toyota_checksum(unsigned int address, uint64_t d, int l);
-unsigned int subaru_checksum(unsigned int address, uint64_t d, int l);
-unsigned int chrysler_checksum(unsigned int address, uint64_t d, int l);
-void init_crc_lookup_tables();
-unsigned int volkswagen_crc(unsigned int address, uint64_t d, int l);
-unsigned int pedal_checksum(uint64_t d, int l);
-uint64_t read_u64_be(const uint8_t* v);
-uint64_t read_u64_le(const uint8_t* v);
-
 class MessageState {
 public:
   uint32_t address;
   unsigned int size;
 
-  std::vector<Signal> parse_sigs;
-  std::vector<double> vals;
+  std::vector<const Signal*> parse_sigs;  // into the DBC's tables
+  double *vals = nullptr;  // parse_sigs.size() values, owned by the CANParser
+
+  // Generated decoder of the message, the signals are picked from its output by index
+  MsgDecodeFunc decode = nullptr;
+  std::vector<double> all_vals;
+  std::vector<int> sig_idx;
+  int counter_size = 0;
 
   uint16_t ts;
   uint64_t seen;
@@ -40,20 +35,45 @@ public:
   uint8_t counter;
   uint8_t counter_fail;
 
+  bool updated = false;  // parsed since the last query_updated
+
   bool ignore_checksum = false;
   bool ignore_counter = false;
 
+  void init(const Msg *msg);
+  void add_signal(const Msg *msg, int i);
   bool parse(uint64_t sec, uint16_t ts_, uint8_t * dat);
+  bool parse_generic(uint8_t * dat);
   bool update_counter_generic(int64_t v, int cnt_size);
 };
 
 class CANParser {
 private:
+  friend class CANParserGroup;
   const int bus;
   kj::Array<capnp::word> aligned_buf;
 
   const DBC *dbc = NULL;
-  std::unordered_map<uint32_t, MessageState> message_states;
+
+  // Sorted by address, with the values of all their signals in one array
+  std::vector<MessageState> message_states;
+  std::vector<double> vals;
+
+  // Open addressing from address to message state, at most half full
+  struct IndexEntry {
+    uint32_t address;
+    uint32_t state;
+  };
+  std::vector<IndexEntry> index;
+  int index_shift = 32;
+
+  // Positions in message_states of the messages parsed since the last query_updated
+  std::vector<uint32_t> updated_states;
+
+  MessageState &add_state(const Msg *msg);
+  void add_signal(MessageState &state, const Msg *msg, int i, double default_value);
+  void init_states();
+  MessageState *find_state(uint32_t address);
 
 public:
   bool can_valid = false;
@@ -63,23 +83,118 @@ public:
             const std::vector<MessageParseOptions> &options,
             const std::vector<SignalParseOptions> &sigoptions);
   CANParser(int abus, const std::string& dbc_name, bool ignore_checksum, bool ignore_counter);
+  CANParser(const CANParser&) = delete;
+  CANParser& operator=(const CANParser&) = delete;
   #ifndef DYNAMIC_CAPNP
   void update_string(const std::string &data, bool sendcan);
   void UpdateCans(uint64_t sec, const capnp::List<cereal::CanData>::Reader& cans);
   #endif
   void UpdateCans(uint64_t sec, const capnp::DynamicStruct::Reader& cans);
+  void UpdateFrame(uint64_t sec, uint8_t src, uint32_t address, uint16_t bus_time, const uint8_t *dat, size_t len);
   void UpdateValid(uint64_t sec);
   std::vector<SignalValue> query_latest();
+  // Like query_latest, but for the messages parsed since the last call, and into a buffer the
+  // caller keeps around. The first call returns every message, with the default values.
+  void query_updated(std::vector<SignalValue> &vals);
+};
+
+#ifndef DYNAMIC_CAPNP
+// Parsers on different buses fed from the same events. Each event is read once and its
+// frames go straight to the parsers of their bus.
+class CANParserGroup {
+private:
+  kj::Array<capnp::word> aligned_buf;
+  std::vector<CANParser*> parsers;
+  std::vector<std::vector<CANParser*>> bus_parsers;
+
+public:
+  CANParserGroup();
+  void add(CANParser *parser);
+  void update_string(const std::string &data, bool sendcan);
+};
+#endif
+
+// One signal of CANBulkDecoder's output, a value at every time its message was received
+struct CANBulkColumn {
+  std::vector<uint64_t> ts;
+  std::vector<double> values;
+};
+
+// What CANBulkDecoder decoded, with the error that stopped each segment, empty for the
+// segments that were decoded completely
+struct CANBulkResult {
+  std::vector<CANBulkColumn> columns;
+  std::vector<std::string> errors;
+};
+
+struct CANBulkFrame {
+  uint64_t sec;
+  uint32_t address;
+  uint8_t src;
+  uint8_t len;
+  uint8_t dat[CANFD_MAX_SIZE];
+};
+
+// Decodes logged CAN of one bus in bulk, for offline analysis. The log segments are decoded
+// in parallel on a pool of threads, each with counters of its own, and the columns of the
+// signals come out in the order of the signals, concatenated in the order of the segments.
+class CANBulkDecoder {
+private:
+  const int bus;
+  const DBC *dbc = NULL;
+
+  // Of the requested messages, sorted by address. Copied for each segment.
+  std::vector<MessageState> states;
+  std::vector<std::vector<int>> columns;  // of the parse_sigs of each state, -1 for checks only
+  size_t num_columns = 0;
+
+  struct Segment {
+    std::vector<MessageState> states;
+    std::vector<double> vals;
+    std::vector<CANBulkColumn> columns;
+  };
+  void init_segment(Segment &seg);
+  void decode_frame(Segment &seg, uint64_t sec, uint32_t address, const uint8_t *dat, size_t len);
+  template <typename F>
+  CANBulkResult decode(size_t num_segments, int num_threads, F decode_segment);
+
+public:
+  CANBulkDecoder(int abus, const std::string& dbc_name, const std::vector<SignalParseOptions> &signals,
+                 bool ignore_checksum, bool ignore_counter);
+  // num_threads <= 0 uses all cores
+  CANBulkResult decode_frames(const std::vector<std::vector<CANBulkFrame>> &segments, int num_threads);
+  #ifndef DYNAMIC_CAPNP
+  // Each segment is serialized events back to back, like an uncompressed rlog. Only the can
+  // events are decoded. A corrupt or truncated segment keeps the values before the bad event.
+  CANBulkResult decode_events(const std::vector<std::string> &segments, int num_threads);
+  #endif
+};
+
+// The signals of a message resolved once by CANPacker::prepare, packing them is then only
+// bit arithmetic
+struct CANPackHandle {
+  uint32_t address = 0;
+  unsigned int size = 0;
+  std::vector<const Signal*> sigs;  // in the order of the values, NULL if not in the message
+  const Signal *counter = NULL;
+  const Signal *checksum = NULL;
 };
 
 class CANPacker {
 private:
   const DBC *dbc = NULL;
-  std::map<std::pair<uint32_t, std::string>, Signal> signal_lookup;
-  std::map<uint32_t, Msg> message_lookup;
+  const DBCIndex *dbc_idx = NULL;
+  std::unordered_map<uint32_t, CANPackHandle> message_handles;  // counter and checksum of each message
+
+  uint64_t set_counter_and_checksum(const CANPackHandle &handle, uint64_t ret, int counter);
 
 public:
   CANPacker(const std::string& dbc_name);
+  // Messages of at most 8 bytes, packed into a uint64_t
   uint64_t pack(uint32_t address, const std::vector<SignalPackValue> &values, int counter);
-  Msg* lookup_message(uint32_t address);
+  CANPackHandle prepare(uint32_t address, const std::vector<std::string> &signal_names);
+  uint64_t pack(const CANPackHandle &handle, const double *values, int counter);
+  // Into the handle.size bytes at dat, the only way to pack CAN FD messages. Returns the size.
+  size_t pack(const CANPackHandle &handle, const double *values, int counter, uint8_t *dat);
+  const Msg* lookup_message(uint32_t address);
 };
@@ -1,7 +1,7 @@
 # distutils: language = c++
 #cython: language_level=3
 
-from libc.stdint cimport uint32_t, uint64_t, uint16_t
+from libc.stdint cimport uint8_t, uint32_t, uint64_t, uint16_t
 from libcpp.vector cimport vector
 from libcpp.map cimport map
 from libcpp.string cimport string
@@ -10,6 +10,9 @@ from libcpp cimport bool
 
 
 cdef extern from "common_dbc.h":
+  cdef enum:
+    CANFD_MAX_SIZE
+
   ctypedef enum SignalType:
     DEFAULT,
     HONDA_CHECKSUM,
@@ -25,6 +28,7 @@ cdef extern from "common_dbc.h":
   cdef struct Signal:
     const char* name
     int b1, b2, bo
+    int byte_offset
     bool is_signed
     double factor, offset
     SignalType type
@@ -72,13 +76,40 @@ cdef extern from "common_dbc.h":
 
 cdef extern from "common.h":
   cdef const DBC* dbc_lookup(const string);
+  cdef const DBC* dbc_load(const string, const string);
 
   cdef cppclass CANParser:
     bool can_valid
     CANParser(int, string, vector[MessageParseOptions], vector[SignalParseOptions])
     void update_string(string, bool)
     vector[SignalValue] query_latest()
+    void query_updated(vector[SignalValue]&)
+
+  cdef cppclass CANParserGroup:
+    CANParserGroup()
+    void add(CANParser *)
+    void update_string(string, bool)
+
+  cdef struct CANBulkColumn:
+    vector[uint64_t] ts
+    vector[double] values
+
+  cdef struct CANBulkResult:
+    vector[CANBulkColumn] columns
+    vector[string] errors
+
+  cdef cppclass CANBulkDecoder:
+    CANBulkDecoder(int, string, vector[SignalParseOptions], bool, bool)
+    CANBulkResult decode_events(const vector[string]&, int) nogil
+
+  cdef cppclass CANPackHandle:
+   uint32_t address
+   unsigned int size
+   vector[const Signal*] sigs
 
   cdef cppclass CANPacker:
    CANPacker(string)
    uint64_t pack(uint32_t, vector[SignalPackValue], int counter)
+   CANPackHandle prepare(uint32_t, vector[string])
+   uint64_t pack(const CANPackHandle&, const double*, int counter)
+   size_t pack(const CANPackHandle&, const double*, int counter, uint8_t*)
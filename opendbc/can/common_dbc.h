@@ -3,9 +3,11 @@
 #include <cstddef>
 #include <cstdint>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #define ARRAYSIZE(x) (sizeof(x)/sizeof(x[0]))
+#define CANFD_MAX_SIZE 64
 
 struct SignalPackValue {
   const char* name;
@@ -46,18 +48,28 @@ enum SignalType {
 struct Signal {
   const char* name;
   int b1, b2, bo;
+  // Start of the 8 data bytes b1 and bo count in. Only CAN FD messages, which are longer
+  // than that, have signals at a non-zero offset.
+  int byte_offset;
   bool is_signed;
   double factor, offset;
   bool is_little_endian;
   SignalType type;
 };
 
+// Generated per message: decodes all signals from the data into vals, in the order of
+// Msg::sigs. The data is zero padded to at least 8 bytes, CAN FD messages to their size.
+// Returns false on a checksum mismatch when check_checksum is set, and writes the raw
+// counter value for messages with a checked counter signal.
+typedef bool (*MsgDecodeFunc)(const uint8_t *dat, double *vals, bool check_checksum, int64_t *counter);
+
 struct Msg {
   const char* name;
   uint32_t address;
   unsigned int size;
   size_t num_sigs;
   const Signal *sigs;
+  MsgDecodeFunc decode;
 };
 
 struct Val {
@@ -75,11 +87,110 @@ struct DBC {
   size_t num_vals;
 };
 
+// Helper functions
+unsigned int honda_checksum(unsigned int address, uint64_t d, int l);
+unsigned int toyota_checksum(unsigned int address, uint64_t d, int l);
+unsigned int subaru_checksum(unsigned int address, uint64_t d, int l);
+unsigned int chrysler_checksum(unsigned int address, uint64_t d, int l);
+void init_crc_lookup_tables();
+unsigned int volkswagen_crc(unsigned int address, uint64_t d, int l);
+unsigned int pedal_checksum(uint64_t d, int l);
+
+// Checks the checksums of n frames of msg, the 8 data bytes of frame i at dat + 8*i. Sets
+// ok[i] for each frame and returns how many passed. Messages without a checksum always pass,
+// there are none on CAN FD messages.
+size_t check_checksums(const Msg *msg, const uint8_t *dat, size_t n, bool *ok);
+
+inline uint64_t read_u64_be(const uint8_t* v) {
+  return (((uint64_t)v[0] << 56)
+          | ((uint64_t)v[1] << 48)
+          | ((uint64_t)v[2] << 40)
+          | ((uint64_t)v[3] << 32)
+          | ((uint64_t)v[4] << 24)
+          | ((uint64_t)v[5] << 16)
+          | ((uint64_t)v[6] << 8)
+          | (uint64_t)v[7]);
+}
+
+inline uint64_t read_u64_le(const uint8_t* v) {
+  return ((uint64_t)v[0]
+          | ((uint64_t)v[1] << 8)
+          | ((uint64_t)v[2] << 16)
+          | ((uint64_t)v[3] << 24)
+          | ((uint64_t)v[4] << 32)
+          | ((uint64_t)v[5] << 40)
+          | ((uint64_t)v[6] << 48)
+          | ((uint64_t)v[7] << 56));
+}
+
+// Hashes of the open addressing tables of DBCIndex and the DBC cache, the top bits of a
+// Fibonacci hash. CAN addresses are mostly small and clustered.
+inline uint32_t address_hash(uint32_t address, uint32_t shift) {
+  return (uint32_t)(address * 2654435769U) >> shift;
+}
+
+inline uint32_t name_hash(std::string_view name, uint32_t shift, uint32_t seed = 0) {
+  uint32_t h = 2166136261U ^ seed;  // FNV-1a
+  for (char c : name) {
+    h = (h ^ (uint8_t)c) * 16777619U;
+  }
+  return (uint32_t)(h * 2654435769U) >> shift;
+}
+
+// Raw value of a signal at shift in d, which is read_u64_le or read_u64_be of the data
+// depending on the signal's endianness. Used by the generated decoders, where all the
+// arguments are constants.
+template <int shift, int size, bool is_signed>
+inline int64_t get_raw_value(uint64_t d) {
+  constexpr uint64_t mask = (size >= 64) ? ~0ULL : ((1ULL << size) - 1);
+  // A few DBCs have signals running past the end of the data, their missing bits read as 0
+  int64_t tmp = ((shift >= 0) ? (d >> (shift & 63)) : (d << (-shift & 63))) & mask;
+  if constexpr (is_signed && size < 64) {
+    tmp -= (tmp >> (size - 1)) ? (1LL << size) : 0;
+  }
+  return tmp;
+}
+
 std::vector<const DBC*>& get_dbcs();
 const DBC* dbc_lookup(const std::string& dbc_name);
 
 void dbc_register(const DBC* dbc);
 
+// Loads a DBC from its text at runtime and registers it, for DBCs that aren't built in or
+// changed since. The DBC is parsed once into a binary cache in cache_dir, rebuilt when the
+// .dbc changes, which is mapped read-only so all processes share it. Its messages have no
+// generated decoders. Returns NULL if the DBC can't be read or breaks the process_dbc.py rules.
+const DBC* dbc_load(const std::string &dbc_fn, const std::string &cache_dir);
+
+// Message by address or name, through the cache's hash indexes for a loaded DBC and the
+// DBCIndex otherwise
+const Msg* dbc_find_msg(const DBC *dbc, uint32_t address);
+const Msg* dbc_find_msg(const DBC *dbc, const std::string &name);
+
+// Lookups into the tables of a DBC, built once by dbc_index and shared by all the parsers and
+// packers of the DBC. Open addressing tables at most half full, pointing into the DBC's
+// tables, which live as long as the process.
+struct DBCIndex {
+  struct SignalEntry {
+    uint32_t address;
+    // A few messages have several signals of the same name. The parsers take the first, the
+    // packers the last.
+    const Signal *first;
+    const Signal *last;
+  };
+  uint32_t msg_shift, sig_shift;
+  std::vector<const Msg*> msgs;       // by address
+  std::vector<const Msg*> msg_names;  // by name
+  std::vector<SignalEntry> sigs;      // by address and name
+
+  const Msg *find_msg(uint32_t address) const;
+  const Msg *find_msg(std::string_view name) const;
+  const Signal *find_signal(uint32_t address, std::string_view name, bool last = false) const;
+};
+
+// Safe to call from several threads, the index is built by the first call for the DBC
+const DBCIndex *dbc_index(const DBC *dbc);
+
 #define dbc_init(dbc) \
 static void __attribute__((constructor)) do_dbc_init_ ## dbc(void) { \
   dbc_register(&dbc); \
@@ -1,3 +1,8 @@
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "common_dbc.h"
@@ -7,17 +12,109 @@ std::vector<const DBC*>& get_dbcs() {
   return vec;
 }
 
+// By name, the last registered one wins so a DBC loaded at runtime replaces a built in one
+static std::unordered_map<std::string, const DBC*>& get_dbc_names() {
+  static std::unordered_map<std::string, const DBC*> names;
+  return names;
+}
+
 const DBC* dbc_lookup(const std::string& dbc_name) {
-  for (const auto& dbci : get_dbcs()) {
-    if (dbc_name == dbci->name) {
-      return dbci;
-    }
-  }
-  return NULL;
+  auto &names = get_dbc_names();
+  auto it = names.find(dbc_name);
+  return it == names.end() ? NULL : it->second;
 }
 
 void dbc_register(const DBC* dbc) {
   get_dbcs().push_back(dbc);
+  get_dbc_names()[dbc->name] = dbc;
+}
+
+const Msg *DBCIndex::find_msg(uint32_t address) const {
+  size_t mask = msgs.size() - 1;
+  for (size_t pos = address_hash(address, msg_shift) & mask; msgs[pos]; pos = (pos + 1) & mask) {
+    if (msgs[pos]->address == address) return msgs[pos];
+  }
+  return NULL;
+}
+
+const Msg *DBCIndex::find_msg(std::string_view name) const {
+  size_t mask = msg_names.size() - 1;
+  for (size_t pos = name_hash(name, msg_shift) & mask; msg_names[pos]; pos = (pos + 1) & mask) {
+    if (name == msg_names[pos]->name) return msg_names[pos];
+  }
+  return NULL;
+}
+
+const Signal *DBCIndex::find_signal(uint32_t address, std::string_view name, bool last) const {
+  size_t mask = sigs.size() - 1;
+  for (size_t pos = name_hash(name, sig_shift, address) & mask; sigs[pos].first; pos = (pos + 1) & mask) {
+    const SignalEntry &e = sigs[pos];
+    if (e.address == address && name == e.first->name) return last ? e.last : e.first;
+  }
+  return NULL;
+}
+
+// Table size and shift for n entries, at most half full
+static size_t table_size(size_t n, uint32_t &shift) {
+  size_t size = 2;
+  shift = 31;
+  while (size < 2 * n) {
+    size *= 2;
+    shift--;
+  }
+  return size;
+}
+
+static std::unique_ptr<DBCIndex> build_index(const DBC *dbc) {
+  auto index = std::make_unique<DBCIndex>();
+  size_t num_sigs = 0;
+  for (size_t i = 0; i < dbc->num_msgs; i++) {
+    num_sigs += dbc->msgs[i].num_sigs;
+  }
+  index->msgs.assign(table_size(dbc->num_msgs, index->msg_shift), NULL);
+  index->msg_names.assign(index->msgs.size(), NULL);
+  index->sigs.assign(table_size(num_sigs, index->sig_shift), {});
+
+  size_t msg_mask = index->msgs.size() - 1, sig_mask = index->sigs.size() - 1;
+  for (size_t i = 0; i < dbc->num_msgs; i++) {
+    const Msg *msg = &dbc->msgs[i];
+    size_t pos = address_hash(msg->address, index->msg_shift) & msg_mask;
+    while (index->msgs[pos]) pos = (pos + 1) & msg_mask;
+    index->msgs[pos] = msg;
+
+    // the first one of a name, like a linear search
+    if (!index->find_msg(msg->name)) {
+      pos = name_hash(msg->name, index->msg_shift) & msg_mask;
+      while (index->msg_names[pos]) pos = (pos + 1) & msg_mask;
+      index->msg_names[pos] = msg;
+    }
+
+    for (size_t j = 0; j < msg->num_sigs; j++) {
+      const Signal *sig = &msg->sigs[j];
+      pos = name_hash(sig->name, index->sig_shift, msg->address) & sig_mask;
+      while (index->sigs[pos].first && !(index->sigs[pos].address == msg->address && strcmp(index->sigs[pos].first->name, sig->name) == 0)) {
+        pos = (pos + 1) & sig_mask;
+      }
+      DBCIndex::SignalEntry &e = index->sigs[pos];
+      if (!e.first) {
+        e = {.address = msg->address, .first = sig};
+      }
+      e.last = sig;
+    }
+  }
+  return index;
+}
+
+const DBCIndex *dbc_index(const DBC *dbc) {
+  static std::mutex lock;
+  static std::unordered_map<const DBC*, std::unique_ptr<DBCIndex>> indexes;
+
+  std::lock_guard<std::mutex> lk(lock);
+  auto &index = indexes[dbc];
+  if (!index) {
+    index = build_index(dbc);
+  }
+  return index.get();
 }
 
 extern "C" {
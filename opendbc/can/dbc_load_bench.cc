@@ -0,0 +1,214 @@
+// Startup cost of the DBCs loaded at runtime against the built in tables: parsing the .dbc
+// text into the binary cache, mapping the cache once it exists, and constructing a CANParser
+// for all signals from either. Every loaded DBC is checked to match its built in tables.
+//
+// First, the time and RSS of a car's startup with every built in DBC: a CANParser with
+// checks on every message and a CANPacker each, then the same again on all cores at once.
+//
+// A process loads each DBC once, so the loads from the cache run in a fresh process. The cache
+// goes to a new directory under the tmp directory, so the first load is always cold.
+//
+// usage: dbc_load_bench <dbc directory> [tmp directory]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "common.h"
+
+static double now() {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static long rss_kb() {
+  std::ifstream f("/proc/self/status");
+  std::string line;
+  while (std::getline(f, line)) {
+    if (line.compare(0, 6, "VmRSS:") == 0) return atol(line.c_str() + 6);
+  }
+  return 0;
+}
+
+// A parser and a packer of every DBC on num_threads threads, returns the seconds it took
+static double construct_all(const std::vector<const DBC*> &dbcs, int num_threads,
+                            std::vector<CANParser*> &parsers, std::vector<CANPacker*> &packers) {
+  size_t first = parsers.size();
+  parsers.resize(first + dbcs.size());
+  packers.resize(first + dbcs.size());
+
+  double start = now();
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    for (size_t i = next++; i < dbcs.size(); i = next++) {
+      const DBC *dbc = dbcs[i];
+      std::vector<MessageParseOptions> options;
+      std::vector<SignalParseOptions> sigoptions;
+      for (size_t j = 0; j < dbc->num_msgs; j++) {
+        const Msg &msg = dbc->msgs[j];
+        options.push_back({.address = msg.address, .check_frequency = 100});
+        for (size_t k = 0; k < msg.num_sigs; k++) {
+          sigoptions.push_back({.address = msg.address, .name = msg.sigs[k].name, .default_value = 0});
+        }
+      }
+      parsers[first + i] = new CANParser(0, dbc->name, options, sigoptions);
+      packers[first + i] = new CANPacker(dbc->name);
+    }
+  };
+  std::vector<std::thread> threads;
+  for (int i = 1; i < num_threads; i++) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto &t : threads) {
+    t.join();
+  }
+  return now() - start;
+}
+
+static bool same_signal(const Signal &a, const Signal &b) {
+  return strcmp(a.name, b.name) == 0 && a.b1 == b.b1 && a.b2 == b.b2 && a.bo == b.bo && a.byte_offset == b.byte_offset &&
+         a.is_signed == b.is_signed && a.factor == b.factor && a.offset == b.offset &&
+         a.is_little_endian == b.is_little_endian && a.type == b.type;
+}
+
+static size_t compare(const DBC *a, const DBC *b) {
+  size_t mismatches = 0;
+  if (a->num_msgs != b->num_msgs || a->num_vals != b->num_vals) {
+    printf("%s: %zu/%zu messages, %zu/%zu values\n", a->name, a->num_msgs, b->num_msgs, a->num_vals, b->num_vals);
+    return 1;
+  }
+  for (size_t i = 0; i < a->num_msgs; i++) {
+    const Msg &ma = a->msgs[i], &mb = b->msgs[i];
+    bool same = strcmp(ma.name, mb.name) == 0 && ma.address == mb.address && ma.size == mb.size && ma.num_sigs == mb.num_sigs;
+    for (size_t j = 0; same && j < ma.num_sigs; j++) {
+      same = same_signal(ma.sigs[j], mb.sigs[j]);
+    }
+    same = same && dbc_find_msg(b, ma.address) == &mb && dbc_find_msg(b, std::string(ma.name)) == &mb;
+    if (!same) {
+      printf("%s: message %s differs\n", a->name, ma.name);
+      mismatches++;
+    }
+  }
+  for (size_t i = 0; i < a->num_vals; i++) {
+    const Val &va = a->vals[i], &vb = b->vals[i];
+    if (strcmp(va.name, vb.name) != 0 || va.address != vb.address || strcmp(va.def_val, vb.def_val) != 0) {
+      printf("%s: values of %s differ\n", a->name, va.name);
+      mismatches++;
+    }
+  }
+  return mismatches;
+}
+
+// Loads every DBC, returns the seconds it took
+static double load_all(const std::vector<const DBC*> &dbcs, const std::string &dbc_dir, const std::string &cache_dir,
+                       std::vector<const DBC*> &loaded) {
+  double start = now();
+  for (auto dbc : dbcs) {
+    loaded.push_back(dbc_load(dbc_dir + "/" + dbc->name + ".dbc", cache_dir));
+  }
+  return now() - start;
+}
+
+static double construct_parsers(const std::vector<const DBC*> &dbcs) {
+  double start = now();
+  for (auto dbc : dbcs) {
+    CANParser parser(0, dbc->name, false, false);
+  }
+  return now() - start;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    printf("usage: %s <dbc directory> [tmp directory]\n", argv[0]);
+    return 1;
+  }
+  bool cached = strcmp(argv[1], "--cached") == 0;
+  std::string dbc_dir = argv[cached ? 2 : 1];
+  std::string cache_dir = cached ? argv[3] : std::string((argc > 2) ? argv[2] : "/tmp") + "/dbc_load_bench.XXXXXX";
+  if (!cached && mkdtemp(&cache_dir[0]) == NULL) {
+    printf("can't create %s\n", cache_dir.c_str());
+    return 1;
+  }
+
+  // The built in ones, before the loaded ones replace them in dbc_lookup
+  std::vector<const DBC*> builtin = get_dbcs();
+  if (cached) {
+    std::vector<const DBC*> loaded;
+    double load_s = load_all(builtin, dbc_dir, cache_dir, loaded);
+    double parsers_s = construct_parsers(loaded);
+    printf("  load from cache        %10.1f us\n", load_s * 1e6);
+    printf("  CANParsers, loaded     %10.1f us\n", parsers_s * 1e6);
+    return 0;
+  }
+
+  double lookup_s = now();
+  for (auto dbc : builtin) {
+    dbc_lookup(dbc->name);
+  }
+  lookup_s = now() - lookup_s;
+  std::vector<CANParser*> parsers;
+  std::vector<CANPacker*> packers;
+  int cores = std::max(1U, std::thread::hardware_concurrency());
+  long rss = rss_kb();
+  double startup_s = construct_all(builtin, 1, parsers, packers);
+  long startup_kb = rss_kb() - rss;
+  double parallel_s = construct_all(builtin, cores, parsers, packers);
+  long parallel_kb = rss_kb() - rss - startup_kb;
+  for (size_t i = 0; i < parsers.size(); i++) {
+    delete parsers[i];
+    delete packers[i];
+  }
+
+  double builtin_parsers_s = construct_parsers(builtin);
+
+  std::vector<const DBC*> loaded;
+  double cold_s = load_all(builtin, dbc_dir, cache_dir, loaded);
+  size_t mismatches = 0;
+  for (size_t i = 0; i < builtin.size(); i++) {
+    if (!loaded[i]) {
+      printf("can't load %s\n", builtin[i]->name);
+      return 1;
+    }
+    mismatches += compare(builtin[i], loaded[i]);
+  }
+  if (mismatches > 0) {
+    printf("%zu mismatches between built in and loaded DBCs\n", mismatches);
+    return 1;
+  }
+
+  printf("%zu DBCs\n", builtin.size());
+  printf("  parsers and packers    %10.1f us  %6ld kB\n", startup_s * 1e6, startup_kb);
+  printf("    again on %2d threads  %10.1f us  %6ld kB\n", cores, parallel_s * 1e6, parallel_kb);
+  printf("  built in lookup        %10.1f us\n", lookup_s * 1e6);
+  printf("  load, parse and cache  %10.1f us\n", cold_s * 1e6);
+  printf("  CANParsers, built in   %10.1f us\n", builtin_parsers_s * 1e6);
+  fflush(stdout);
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    execl(argv[0], argv[0], "--cached", dbc_dir.c_str(), cache_dir.c_str(), (char *)NULL);
+    return 1;
+  }
+  int status;
+  waitpid(pid, &status, 0);
+
+  if (DIR *dir = opendir(cache_dir.c_str())) {
+    while (struct dirent *e = readdir(dir)) {
+      if (e->d_name[0] != '.') unlink((cache_dir + "/" + e->d_name).c_str());
+    }
+    closedir(dir);
+  }
+  rmdir(cache_dir.c_str());
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
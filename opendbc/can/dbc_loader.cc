@@ -0,0 +1,740 @@
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <initializer_list>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common_dbc.h"
+
+#define WARN printf
+
+// Binary cache of a DBC, as processed by process_dbc.py: messages sorted by address, their
+// signals with the layout and type of the generated tables, and hash indexes by message
+// address and name. Native byte order, the cache is rebuilt on a version or source mismatch.
+#define DBC_CACHE_MAGIC 0x43434244  // "DBCC"
+#define DBC_CACHE_VERSION 1
+
+namespace {
+
+struct CacheHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t source_size;
+  int64_t source_mtime;  // ns
+  uint32_t num_msgs;
+  uint32_t num_sigs;
+  uint32_t num_vals;
+  uint32_t index_size;  // slots of each index, a power of 2 at least twice num_msgs
+  uint32_t index_shift;
+  uint32_t strings_size;
+};
+
+struct CacheMsg {
+  uint32_t name;  // offsets into the strings
+  uint32_t address;
+  uint32_t size;
+  uint32_t first_sig;
+  uint32_t num_sigs;
+};
+
+struct CacheSignal {
+  uint32_t name;
+  int32_t b1, b2, bo, byte_offset;
+  uint8_t is_signed, is_little_endian;
+  uint16_t type;
+  double factor, offset;
+};
+
+struct CacheVal {
+  uint32_t name;
+  uint32_t address;
+  uint32_t def_val;
+};
+
+static_assert(sizeof(CacheHeader) % 8 == 0 && sizeof(CacheSignal) % 8 == 0, "cache sections are 8 byte aligned");
+
+// Byte offsets of the sections
+struct CacheLayout {
+  size_t msgs, sigs, vals, address_index, name_index, strings, size;
+
+  CacheLayout(const CacheHeader &h) {
+    auto align = [](size_t n) { return (n + 7) & ~7; };
+    msgs = sizeof(CacheHeader);
+    sigs = align(msgs + h.num_msgs * sizeof(CacheMsg));
+    vals = sigs + h.num_sigs * sizeof(CacheSignal);
+    address_index = align(vals + h.num_vals * sizeof(CacheVal));
+    name_index = address_index + h.index_size * sizeof(uint32_t);
+    strings = name_index + h.index_size * sizeof(uint32_t);
+    size = strings + h.strings_size;
+  }
+};
+
+// A DBC loaded at runtime. The names point into the cache, which stays mapped.
+struct LoadedDBC {
+  std::string name;
+  DBC dbc;
+  std::vector<Msg> msgs;
+  std::vector<Signal> sigs;
+  std::vector<Val> vals;
+
+  const uint8_t *cache = NULL;
+  size_t cache_size = 0;
+  std::vector<uint8_t> cache_buf;  // when the cache couldn't be written
+  const uint32_t *address_index;
+  const uint32_t *name_index;
+  uint32_t index_size, index_shift;
+};
+
+std::mutex loaded_lock;
+std::map<std::string, LoadedDBC*> loaded_by_path;
+std::unordered_map<const DBC*, const LoadedDBC*> loaded_by_dbc;
+
+// Parsing of the DBC text, the way dbc.py and process_dbc.py read it
+
+struct TextSignal {
+  std::string name;
+  int start_bit, size;
+  bool is_little_endian, is_signed;
+  double factor, offset;
+};
+
+struct TextMsg {
+  std::string name;
+  uint32_t size;
+  std::vector<TextSignal> sigs;
+};
+
+struct TextDBC {
+  std::string name;
+  std::map<uint32_t, TextMsg> msgs;
+  std::map<uint32_t, std::vector<std::pair<std::string, std::string>>> def_vals;
+};
+
+class LineReader {
+public:
+  LineReader(const std::string &line) : s(line) {}
+
+  bool literal(const char *lit) {
+    size_t n = strlen(lit);
+    if (s.compare(pos, n, lit) != 0) return false;
+    pos += n;
+    return true;
+  }
+  void spaces() {
+    while (pos < s.size() && s[pos] == ' ') pos++;
+  }
+  bool word(std::string &out) {
+    size_t start = pos;
+    while (pos < s.size() && (isalnum((uint8_t)s[pos]) || s[pos] == '_')) pos++;
+    out = s.substr(start, pos - start);
+    return !out.empty();
+  }
+  bool number(double &out) {
+    size_t start = pos;
+    while (pos < s.size() && (isdigit((uint8_t)s[pos]) || strchr(".+-eE", s[pos]))) pos++;
+    std::string n = s.substr(start, pos - start);
+    char *end;
+    out = strtod(n.c_str(), &end);
+    return !n.empty() && *end == '\0';
+  }
+  bool integer(int &out) {
+    size_t start = pos;
+    while (pos < s.size() && isdigit((uint8_t)s[pos])) pos++;
+    out = atoi(s.substr(start, pos - start).c_str());
+    return pos > start;
+  }
+  std::string rest() { return s.substr(pos); }
+
+private:
+  const std::string &s;
+  size_t pos = 0;
+};
+
+bool parse_bo(const std::string &line, TextDBC &dbc) {
+  // BO_ <address> <name> : <size> <transmitter>
+  LineReader r(line);
+  std::string address, name, size, node;
+  if (!(r.literal("BO_ ") && r.word(address) && r.literal(" ") && r.word(name))) return false;
+  r.spaces();
+  if (!(r.literal(": ") && r.word(size) && r.literal(" ") && r.word(node))) return false;
+
+  uint32_t addr = strtoul(address.c_str(), NULL, 0);
+  if (dbc.msgs.count(addr) > 0) {
+    WARN("Duplicate address detected %u %s\n", addr, dbc.name.c_str());
+    return false;
+  }
+  dbc.msgs[addr] = {.name = name, .size = (uint32_t)strtoul(size.c_str(), NULL, 10)};
+  return true;
+}
+
+bool parse_sg(const std::string &line, TextSignal &sig) {
+  // SG_ <name> [<multiplexing>] : <start>|<size>@<endianness><sign> (<factor>,<offset>) [<min>|<max>] "<unit>" <receivers>
+  LineReader r(line);
+  std::string mux;
+  if (!(r.literal("SG_ ") && r.word(sig.name) && r.literal(" "))) return false;
+  if (r.word(mux)) {
+    r.spaces();
+  }
+
+  int endianness;
+  double min, max;
+  if (!(r.literal(": ") && r.integer(sig.start_bit) && r.literal("|") && r.integer(sig.size) &&
+        r.literal("@") && r.integer(endianness))) return false;
+  sig.is_little_endian = endianness == 1;
+  if (r.literal("+")) {
+    sig.is_signed = false;
+  } else if (r.literal("-")) {
+    sig.is_signed = true;
+  } else {
+    return false;
+  }
+  return r.literal(" (") && r.number(sig.factor) && r.literal(",") && r.number(sig.offset) &&
+         r.literal(") [") && r.number(min) && r.literal("|") && r.number(max) && r.literal("] \"");
+}
+
+bool parse_val(const std::string &line, TextDBC &dbc) {
+  // VAL_ <address> <signal> <value> "<description>" ... ;
+  LineReader r(line);
+  std::string address, name;
+  if (!(r.literal("VAL_ ") && r.word(address) && r.literal(" ") && r.word(name) && r.literal(" "))) return false;
+
+  // Up to the first ; after the first description
+  std::string defs = r.rest();
+  size_t open = defs.find('"');
+  size_t close = (open == std::string::npos || open + 2 > defs.size()) ? std::string::npos : defs.find('"', open + 2);
+  if (close == std::string::npos) return false;
+  defs = defs.substr(0, defs.find(';', close + 1));
+
+  // Descriptions in UPPER_CASE_WITH_UNDERSCORES, without their quotes
+  std::vector<std::string> parts;
+  std::stringstream ss(defs);
+  std::string part;
+  while (std::getline(ss, part, '"')) {
+    parts.push_back(part);
+  }
+  if (!defs.empty() && defs.back() == '"') {
+    parts.push_back("");
+  }
+  std::string def_val;
+  for (size_t i = 0; i + 1 < parts.size(); i++) {
+    std::string p = parts[i];
+    if (i % 2 == 1) {
+      p.erase(0, p.find_first_not_of(" \t"));
+      p.erase(p.find_last_not_of(" \t") + 1);
+      for (auto &c : p) c = (c == ' ') ? '_' : toupper(c);
+    }
+    def_val += p;
+  }
+  dbc.def_vals[strtoul(address.c_str(), NULL, 0)].push_back({name, def_val});
+  return true;
+}
+
+bool parse_dbc(const std::string &fn, TextDBC &dbc) {
+  std::ifstream f(fn);
+  if (!f) return false;
+
+  std::string line;
+  uint32_t last_address = 0;
+  while (std::getline(f, line)) {
+    line.erase(0, line.find_first_not_of(" \t\r\n"));
+    line.erase(line.find_last_not_of(" \t\r\n") + 1);
+
+    if (line.compare(0, 4, "BO_ ") == 0) {
+      if (!parse_bo(line, dbc)) {
+        WARN("bad BO %s\n", line.c_str());
+        return false;
+      }
+      last_address = strtoul(line.c_str() + 4, NULL, 0);
+    } else if (line.compare(0, 4, "SG_ ") == 0) {
+      TextSignal sig;
+      if (dbc.msgs.count(last_address) == 0 || !parse_sg(line, sig)) {
+        WARN("bad SG %s\n", line.c_str());
+        return false;
+      }
+      dbc.msgs[last_address].sigs.push_back(sig);
+    } else if (line.compare(0, 5, "VAL_ ") == 0) {
+      if (!parse_val(line, dbc)) {
+        WARN("bad VAL %s\n", line.c_str());
+        return false;
+      }
+    }
+  }
+
+  for (auto &kv : dbc.msgs) {
+    auto &sigs = kv.second.sigs;
+    std::stable_sort(sigs.begin(), sigs.end(), [](const TextSignal &a, const TextSignal &b) {
+      return a.start_bit < b.start_bit;
+    });
+    // counter and checksum first
+    std::stable_partition(sigs.begin(), sigs.end(), [](const TextSignal &s) {
+      return s.name == "COUNTER" || s.name == "CHECKSUM";
+    });
+  }
+  return true;
+}
+
+// The checksum and counter rules of process_dbc.py
+
+struct ChecksumRules {
+  std::string type;
+  int checksum_size, counter_size, checksum_start_bit, counter_start_bit;
+  bool little_endian;
+};
+
+ChecksumRules checksum_rules(const std::string &name) {
+  auto starts_with = [&](std::initializer_list<const char*> prefixes) {
+    return std::any_of(prefixes.begin(), prefixes.end(), [&](const char *p) { return name.rfind(p, 0) == 0; });
+  };
+  if (starts_with({"honda_", "acura_"})) {
+    return {"honda", 4, 2, 3, 5, false};
+  } else if (starts_with({"toyota_", "lexus_"})) {
+    return {"toyota", 8, -1, 7, -1, false};
+  } else if (starts_with({"vw_", "volkswagen_", "audi_", "seat_", "skoda_"})) {
+    return {"volkswagen", 8, 4, 0, 0, true};
+  } else if (starts_with({"subaru_global_"})) {
+    return {"subaru", 8, -1, 0, -1, true};
+  } else if (starts_with({"chrysler_"})) {
+    return {"chrysler", 8, -1, 7, -1, false};
+  }
+  return {"", -1, -1, -1, -1, false};
+}
+
+SignalType signal_type(const std::string &checksum_type, uint32_t address, const std::string &name) {
+  if (checksum_type == "honda" && name == "CHECKSUM") return SignalType::HONDA_CHECKSUM;
+  if (checksum_type == "honda" && name == "COUNTER") return SignalType::HONDA_COUNTER;
+  if (checksum_type == "toyota" && name == "CHECKSUM") return SignalType::TOYOTA_CHECKSUM;
+  if (checksum_type == "volkswagen" && name == "CHECKSUM") return SignalType::VOLKSWAGEN_CHECKSUM;
+  if (checksum_type == "volkswagen" && name == "COUNTER") return SignalType::VOLKSWAGEN_COUNTER;
+  if (checksum_type == "subaru" && name == "CHECKSUM") return SignalType::SUBARU_CHECKSUM;
+  if (checksum_type == "chrysler" && name == "CHECKSUM") return SignalType::CHRYSLER_CHECKSUM;
+  if ((address == 512 || address == 513) && name == "CHECKSUM_PEDAL") return SignalType::PEDAL_CHECKSUM;
+  if ((address == 512 || address == 513) && name == "COUNTER_PEDAL") return SignalType::PEDAL_COUNTER;
+  return SignalType::DEFAULT;
+}
+
+bool is_checksum(SignalType type) {
+  return type == SignalType::HONDA_CHECKSUM || type == SignalType::TOYOTA_CHECKSUM || type == SignalType::PEDAL_CHECKSUM ||
+         type == SignalType::VOLKSWAGEN_CHECKSUM || type == SignalType::SUBARU_CHECKSUM || type == SignalType::CHRYSLER_CHECKSUM;
+}
+
+bool check_rules(const TextDBC &dbc, const ChecksumRules &rules) {
+  std::map<std::string, int> names;
+  for (auto &kv : dbc.msgs) {
+    if (!kv.second.sigs.empty() && names[kv.second.name]++ > 0) {
+      WARN("%s: Duplicate message name in DBC file %s\n", dbc.name.c_str(), kv.second.name.c_str());
+      return false;
+    }
+  }
+
+  for (auto &kv : dbc.msgs) {
+    const TextMsg &msg = kv.second;
+    std::string dbc_msg_name = dbc.name + " " + msg.name;
+    if (msg.size > CANFD_MAX_SIZE) {
+      WARN("%s: longer than %d bytes\n", dbc_msg_name.c_str(), CANFD_MAX_SIZE);
+      return false;
+    }
+
+    for (const auto &sig : msg.sigs) {
+      if (!rules.type.empty()) {
+        if (sig.name == "CHECKSUM" && (sig.size != rules.checksum_size || sig.start_bit % 8 != rules.checksum_start_bit ||
+                                       sig.is_little_endian != rules.little_endian)) {
+          WARN("%s: CHECKSUM doesn't follow the %s rules\n", dbc_msg_name.c_str(), rules.type.c_str());
+          return false;
+        }
+        if (sig.name == "COUNTER" && ((rules.counter_size >= 0 && sig.size != rules.counter_size) ||
+                                      (rules.counter_start_bit >= 0 && sig.start_bit % 8 != rules.counter_start_bit) ||
+                                      sig.is_little_endian != rules.little_endian)) {
+          WARN("%s: COUNTER doesn't follow the %s rules\n", dbc_msg_name.c_str(), rules.type.c_str());
+          return false;
+        }
+      }
+      if (msg.size > 8 && is_checksum(signal_type(rules.type, kv.first, sig.name))) {
+        WARN("%s: checksums of CAN FD messages are not supported\n", dbc_msg_name.c_str());
+        return false;
+      }
+      if ((kv.first == 0x200 || kv.first == 0x201) && ((sig.name == "COUNTER_PEDAL" && sig.size != 4) ||
+                                                       (sig.name == "CHECKSUM_PEDAL" && sig.size != 8))) {
+        WARN("%s: %s has the wrong size\n", dbc_msg_name.c_str(), sig.name.c_str());
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Same as signal_layout in process_dbc.py
+void signal_layout(const TextSignal &sig, uint32_t size, CacheSignal &out) {
+  int b1 = sig.is_little_endian ? sig.start_bit : (sig.start_bit / 8) * 8 + (7 - sig.start_bit % 8);
+  int byte_offset = std::max(0, std::min(b1 / 8, (int)size - 8));
+  out.b1 = b1 - 8 * byte_offset;
+  out.bo = 64 - (out.b1 + sig.size);
+  out.byte_offset = byte_offset;
+}
+
+bool build_cache(const TextDBC &dbc, const struct stat &st, std::vector<uint8_t> &out) {
+  ChecksumRules rules = checksum_rules(dbc.name);
+  if (!check_rules(dbc, rules)) {
+    return false;
+  }
+
+  std::string strings;
+  auto add_string = [&](const std::string &s) {
+    uint32_t offset = strings.size();
+    strings.append(s.c_str(), s.size() + 1);
+    return offset;
+  };
+
+  std::vector<CacheMsg> msgs;
+  std::vector<CacheSignal> sigs;
+  for (auto &kv : dbc.msgs) {
+    const TextMsg &msg = kv.second;
+    if (msg.sigs.empty()) continue;
+
+    msgs.push_back({.name = add_string(msg.name), .address = kv.first, .size = msg.size,
+                    .first_sig = (uint32_t)sigs.size(), .num_sigs = (uint32_t)msg.sigs.size()});
+    for (const auto &s : msg.sigs) {
+      CacheSignal sig = {
+        .name = add_string(s.name),
+        .b2 = s.size,
+        .is_signed = s.is_signed,
+        .is_little_endian = s.is_little_endian,
+        .type = (uint16_t)signal_type(rules.type, kv.first, s.name),
+        .factor = s.factor,
+        .offset = s.offset,
+      };
+      signal_layout(s, msg.size, sig);
+      if (msg.size > 8 && sig.b1 + sig.b2 > 64) {
+        WARN("%s %s: %s spans more than 8 bytes\n", dbc.name.c_str(), msg.name.c_str(), s.name.c_str());
+        return false;
+      }
+      sigs.push_back(sig);
+    }
+  }
+
+  std::vector<CacheVal> vals;
+  for (auto &kv : dbc.def_vals) {
+    // without duplicates, sorted like process_dbc.py
+    auto defs = kv.second;
+    std::sort(defs.begin(), defs.end());
+    defs.erase(std::unique(defs.begin(), defs.end()), defs.end());
+    for (auto &d : defs) {
+      vals.push_back({.name = add_string(d.first), .address = kv.first, .def_val = add_string(d.second)});
+    }
+  }
+
+  CacheHeader h = {
+    .magic = DBC_CACHE_MAGIC,
+    .version = DBC_CACHE_VERSION,
+    .source_size = (uint64_t)st.st_size,
+    .source_mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec,
+    .num_msgs = (uint32_t)msgs.size(),
+    .num_sigs = (uint32_t)sigs.size(),
+    .num_vals = (uint32_t)vals.size(),
+    .index_size = 2,
+    .index_shift = 31,
+    .strings_size = (uint32_t)strings.size(),
+  };
+  while (h.index_size < 2 * msgs.size()) {
+    h.index_size *= 2;
+    h.index_shift--;
+  }
+
+  CacheLayout layout(h);
+  out.assign(layout.size, 0);
+  memcpy(&out[0], &h, sizeof(h));
+  memcpy(&out[layout.msgs], msgs.data(), msgs.size() * sizeof(CacheMsg));
+  memcpy(&out[layout.sigs], sigs.data(), sigs.size() * sizeof(CacheSignal));
+  memcpy(&out[layout.vals], vals.data(), vals.size() * sizeof(CacheVal));
+  memcpy(&out[layout.strings], strings.data(), strings.size());
+
+  uint32_t *address_index = (uint32_t *)&out[layout.address_index];
+  uint32_t *name_index = (uint32_t *)&out[layout.name_index];
+  uint32_t mask = h.index_size - 1;
+  std::fill(address_index, address_index + h.index_size, UINT32_MAX);
+  std::fill(name_index, name_index + h.index_size, UINT32_MAX);
+  for (uint32_t i = 0; i < msgs.size(); i++) {
+    uint32_t pos = address_hash(msgs[i].address, h.index_shift) & mask;
+    while (address_index[pos] != UINT32_MAX) pos = (pos + 1) & mask;
+    address_index[pos] = i;
+
+    pos = name_hash(&strings[msgs[i].name], h.index_shift) & mask;
+    while (name_index[pos] != UINT32_MAX) pos = (pos + 1) & mask;
+    name_index[pos] = i;
+  }
+  return true;
+}
+
+// Checkouts share a cache directory, so the cache is named after the full path of the DBC
+std::string cache_name(const std::string &dbc_fn, const std::string &name) {
+  char *real = realpath(dbc_fn.c_str(), NULL);
+  std::string path = real ? real : dbc_fn;
+  free(real);
+
+  uint64_t h = 14695981039346656037ULL;  // FNV-1a
+  for (char c : path) {
+    h = (h ^ (uint8_t)c) * 1099511628211ULL;
+  }
+  char hex[17];
+  snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)h);
+  return name + "-" + hex + ".bin";
+}
+
+// mkdir -p, the cache directory itself is private to the user
+void make_dirs(const std::string &dir) {
+  for (size_t pos = dir.find('/', 1); pos != std::string::npos; pos = dir.find('/', pos + 1)) {
+    mkdir(dir.substr(0, pos).c_str(), 0755);
+  }
+  mkdir(dir.c_str(), 0700);
+}
+
+bool write_cache(const std::string &fn, const std::vector<uint8_t> &cache) {
+  // Atomically, other processes may be mapping it
+  std::string tmp_fn = fn + ".tmp" + std::to_string(getpid());
+  unlink(tmp_fn.c_str());
+  int fd = open(tmp_fn.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+  if (fd < 0) return false;
+
+  bool ok = write(fd, cache.data(), cache.size()) == (ssize_t)cache.size();
+  ok = (close(fd) == 0) && ok;
+  if (!ok || rename(tmp_fn.c_str(), fn.c_str()) != 0) {
+    unlink(tmp_fn.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Everything init_loaded and the lookups follow in the cache stays inside it, so a corrupt
+// or foreign cache is rebuilt instead of read out of bounds
+bool check_cache(const uint8_t *cache, size_t cache_size) {
+  if (cache_size < sizeof(CacheHeader)) return false;
+  const CacheHeader *h = (const CacheHeader *)cache;
+  if (h->magic != DBC_CACHE_MAGIC || h->version != DBC_CACHE_VERSION) return false;
+
+  // The index has a free slot to end every probe, and index_shift matches its size
+  if (h->index_size < 2 || h->index_size > (1U << 31) || (h->index_size & (h->index_size - 1)) != 0 ||
+      h->index_size < 2ULL * h->num_msgs || h->index_shift < 1 || h->index_shift > 31 ||
+      (1ULL << (32 - h->index_shift)) != h->index_size) {
+    return false;
+  }
+  CacheLayout layout(*h);
+  if (layout.size != cache_size) return false;
+
+  // All strings end inside the string section
+  const char *strings = (const char *)(cache + layout.strings);
+  if (h->strings_size == 0 || strings[h->strings_size - 1] != '\0') return false;
+
+  const CacheMsg *msgs = (const CacheMsg *)(cache + layout.msgs);
+  const CacheSignal *sigs = (const CacheSignal *)(cache + layout.sigs);
+  const CacheVal *vals = (const CacheVal *)(cache + layout.vals);
+  for (uint32_t i = 0; i < h->num_msgs; i++) {
+    const CacheMsg &m = msgs[i];
+    if (m.name >= h->strings_size || m.size > CANFD_MAX_SIZE ||
+        (uint64_t)m.first_sig + m.num_sigs > h->num_sigs) {
+      return false;
+    }
+    // The parser and packer read and write the 8 bytes at byte_offset
+    int max_byte_offset = std::max(0, (int)m.size - 8);
+    for (uint32_t j = m.first_sig; j < m.first_sig + m.num_sigs; j++) {
+      const CacheSignal &sig = sigs[j];
+      if (sig.name >= h->strings_size || sig.b1 < 0 || sig.b1 > 63 || sig.b2 < 1 || sig.b2 > 64 || sig.bo != 64 - (sig.b1 + sig.b2) ||
+          sig.byte_offset < 0 || sig.byte_offset > max_byte_offset || sig.type > CHRYSLER_CHECKSUM) {
+        return false;
+      }
+    }
+  }
+  for (uint32_t i = 0; i < h->num_vals; i++) {
+    if (vals[i].name >= h->strings_size || vals[i].def_val >= h->strings_size) return false;
+  }
+
+  // Each message once in each index
+  const uint32_t *address_index = (const uint32_t *)(cache + layout.address_index);
+  const uint32_t *name_index = (const uint32_t *)(cache + layout.name_index);
+  uint32_t used = 0;
+  for (uint32_t i = 0; i < h->index_size; i++) {
+    if (address_index[i] != UINT32_MAX && address_index[i] >= h->num_msgs) return false;
+    if (name_index[i] != UINT32_MAX && name_index[i] >= h->num_msgs) return false;
+    used += (address_index[i] != UINT32_MAX) + (name_index[i] != UINT32_MAX);
+  }
+  return used == 2 * h->num_msgs;
+}
+
+bool map_cache(const std::string &fn, const struct stat &st, LoadedDBC *l) {
+  int fd = open(fn.c_str(), O_RDONLY | O_NOFOLLOW);
+  if (fd < 0) return false;
+
+  // Only a cache this user wrote, and nobody else can have changed
+  struct stat cache_st;
+  void *mem = MAP_FAILED;
+  if (fstat(fd, &cache_st) == 0 && S_ISREG(cache_st.st_mode) && cache_st.st_uid == geteuid() &&
+      !(cache_st.st_mode & (S_IWGRP | S_IWOTH)) && cache_st.st_size >= (off_t)sizeof(CacheHeader)) {
+    mem = mmap(NULL, cache_st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (mem == MAP_FAILED) return false;
+
+  const CacheHeader *h = (const CacheHeader *)mem;
+  bool valid = check_cache((const uint8_t *)mem, cache_st.st_size) &&
+               h->source_size == (uint64_t)st.st_size &&
+               h->source_mtime == st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+  if (!valid) {
+    munmap(mem, cache_st.st_size);
+    return false;
+  }
+  l->cache = (const uint8_t *)mem;
+  l->cache_size = cache_st.st_size;
+  return true;
+}
+
+const Msg *find_msg(const LoadedDBC *l, uint32_t address) {
+  uint32_t mask = l->index_size - 1;
+  for (uint32_t pos = address_hash(address, l->index_shift) & mask; l->address_index[pos] != UINT32_MAX; pos = (pos + 1) & mask) {
+    const Msg *msg = &l->msgs[l->address_index[pos]];
+    if (msg->address == address) return msg;
+  }
+  return NULL;
+}
+
+const Msg *find_msg(const LoadedDBC *l, const std::string &name) {
+  uint32_t mask = l->index_size - 1;
+  for (uint32_t pos = name_hash(name.c_str(), l->index_shift) & mask; l->name_index[pos] != UINT32_MAX; pos = (pos + 1) & mask) {
+    const Msg *msg = &l->msgs[l->name_index[pos]];
+    if (name == msg->name) return msg;
+  }
+  return NULL;
+}
+
+const LoadedDBC *find_loaded(const DBC *dbc) {
+  std::lock_guard<std::mutex> lk(loaded_lock);
+  auto it = loaded_by_dbc.find(dbc);
+  return it == loaded_by_dbc.end() ? NULL : it->second;
+}
+
+void init_loaded(LoadedDBC *l) {
+  const CacheHeader *h = (const CacheHeader *)l->cache;
+  CacheLayout layout(*h);
+  const CacheMsg *msgs = (const CacheMsg *)(l->cache + layout.msgs);
+  const CacheSignal *sigs = (const CacheSignal *)(l->cache + layout.sigs);
+  const CacheVal *vals = (const CacheVal *)(l->cache + layout.vals);
+  const char *strings = (const char *)(l->cache + layout.strings);
+
+  for (uint32_t i = 0; i < h->num_sigs; i++) {
+    const CacheSignal &s = sigs[i];
+    l->sigs.push_back({
+      .name = strings + s.name,
+      .b1 = s.b1,
+      .b2 = s.b2,
+      .bo = s.bo,
+      .byte_offset = s.byte_offset,
+      .is_signed = (bool)s.is_signed,
+      .factor = s.factor,
+      .offset = s.offset,
+      .is_little_endian = (bool)s.is_little_endian,
+      .type = (SignalType)s.type,
+    });
+  }
+  for (uint32_t i = 0; i < h->num_msgs; i++) {
+    // Without a generated decoder, the parser takes the generic path
+    const CacheMsg &m = msgs[i];
+    l->msgs.push_back({
+      .name = strings + m.name,
+      .address = m.address,
+      .size = m.size,
+      .num_sigs = m.num_sigs,
+      .sigs = &l->sigs[m.first_sig],
+      .decode = nullptr,
+    });
+  }
+  l->address_index = (const uint32_t *)(l->cache + layout.address_index);
+  l->name_index = (const uint32_t *)(l->cache + layout.name_index);
+  l->index_size = h->index_size;
+  l->index_shift = h->index_shift;
+  l->dbc = {
+    .name = l->name.c_str(),
+    .num_msgs = l->msgs.size(),
+    .msgs = l->msgs.data(),
+  };
+
+  for (uint32_t i = 0; i < h->num_vals; i++) {
+    const Msg *msg = find_msg(l, vals[i].address);
+    l->vals.push_back({
+      .name = strings + vals[i].name,
+      .address = vals[i].address,
+      .def_val = strings + vals[i].def_val,
+      .sigs = msg ? msg->sigs : NULL,
+    });
+  }
+  l->dbc.vals = l->vals.data();
+  l->dbc.num_vals = l->vals.size();
+}
+
+}  // namespace
+
+const DBC* dbc_load(const std::string &dbc_fn, const std::string &cache_dir) {
+  std::lock_guard<std::mutex> lk(loaded_lock);
+  auto it = loaded_by_path.find(dbc_fn);
+  if (it != loaded_by_path.end()) {
+    return &it->second->dbc;
+  }
+
+  struct stat st;
+  if (stat(dbc_fn.c_str(), &st) != 0) {
+    WARN("can't read DBC %s\n", dbc_fn.c_str());
+    return NULL;
+  }
+  std::string name = dbc_fn.substr(dbc_fn.find_last_of('/') + 1);
+  name = name.substr(0, name.rfind(".dbc"));
+  std::string cache_fn = cache_dir + "/" + cache_name(dbc_fn, name);
+
+  LoadedDBC *l = new LoadedDBC();
+  if (!map_cache(cache_fn, st, l)) {
+    TextDBC text = {.name = name};
+    if (!parse_dbc(dbc_fn, text) || !build_cache(text, st, l->cache_buf)) {
+      WARN("can't load DBC %s\n", dbc_fn.c_str());
+      delete l;
+      return NULL;
+    }
+
+    make_dirs(cache_dir);
+    if (!write_cache(cache_fn, l->cache_buf) || !map_cache(cache_fn, st, l)) {
+      WARN("can't write DBC cache %s\n", cache_fn.c_str());
+      l->cache = l->cache_buf.data();
+      l->cache_size = l->cache_buf.size();
+    } else {
+      l->cache_buf = std::vector<uint8_t>();
+    }
+  }
+
+  l->name = name;
+  init_loaded(l);
+  loaded_by_path[dbc_fn] = l;
+  loaded_by_dbc[&l->dbc] = l;
+  dbc_register(&l->dbc);
+  return &l->dbc;
+}
+
+const Msg* dbc_find_msg(const DBC *dbc, uint32_t address) {
+  if (const LoadedDBC *l = find_loaded(dbc)) {
+    return find_msg(l, address);
+  }
+  return dbc_index(dbc)->find_msg(address);
+}
+
+const Msg* dbc_find_msg(const DBC *dbc, const std::string &name) {
+  if (const LoadedDBC *l = find_loaded(dbc)) {
+    return find_msg(l, name);
+  }
+  return dbc_index(dbc)->find_msg(name);
+}
@@ -6,43 +6,51 @@ namespace {
 const Signal sigs_{{address}}[] = {
   {% for sig in sigs %}
     {
-      {% if sig.is_little_endian %}
-        {% set b1 = sig.start_bit %}
-      {% else %}
-        {% set b1 = (sig.start_bit//8)*8  + (-sig.start_bit-1) % 8 %}
-      {% endif %}
+      {% set b1, bo, byte_offset = signal_layout(sig, msg_size) %}
       .name = "{{sig.name}}",
       .b1 = {{b1}},
       .b2 = {{sig.size}},
-      .bo = {{64 - (b1 + sig.size)}},
+      .bo = {{bo}},
+      .byte_offset = {{byte_offset}},
       .is_signed = {{"true" if sig.is_signed else "false"}},
       .factor = {{sig.factor}},
       .offset = {{sig.offset}},
       .is_little_endian = {{"true" if sig.is_little_endian else "false"}},
-      {% if checksum_type == "honda" and sig.name == "CHECKSUM" %}
-      .type = SignalType::HONDA_CHECKSUM,
-      {% elif checksum_type == "honda" and sig.name == "COUNTER" %}
-      .type = SignalType::HONDA_COUNTER,
-      {% elif checksum_type == "toyota" and sig.name == "CHECKSUM" %}
-      .type = SignalType::TOYOTA_CHECKSUM,
-      {% elif checksum_type == "volkswagen" and sig.name == "CHECKSUM" %}
-      .type = SignalType::VOLKSWAGEN_CHECKSUM,
-      {% elif checksum_type == "volkswagen" and sig.name == "COUNTER" %}
-      .type = SignalType::VOLKSWAGEN_COUNTER,
-      {% elif checksum_type == "subaru" and sig.name == "CHECKSUM" %}
-      .type = SignalType::SUBARU_CHECKSUM,
-      {% elif checksum_type == "chrysler" and sig.name == "CHECKSUM" %}
-      .type = SignalType::CHRYSLER_CHECKSUM,
-      {% elif address in [512, 513] and sig.name == "CHECKSUM_PEDAL" %}
-      .type = SignalType::PEDAL_CHECKSUM,
-      {% elif address in [512, 513] and sig.name == "COUNTER_PEDAL" %}
-      .type = SignalType::PEDAL_COUNTER,
-      {% else %}
-      .type = SignalType::DEFAULT,
-      {% endif %}
+      .type = SignalType::{{signal_type(checksum_type, address, sig)}},
     },
   {% endfor %}
 };
+
+bool decode_{{address}}(const uint8_t *dat, double *vals, bool check_checksum, int64_t *counter) {
+  {% set words = data_words(checksum_type, address, msg_size, sigs) %}
+  {% if "dat_le" in words %}
+  const uint64_t dat_le = read_u64_le(dat);
+  {% endif %}
+  {% if "dat_be" in words %}
+  const uint64_t dat_be = read_u64_be(dat);
+  {% endif %}
+  int64_t tmp;
+  {% for sig in sigs %}
+    {% set type = signal_type(checksum_type, address, sig) %}
+    {% set b1, bo, byte_offset = signal_layout(sig, msg_size) %}
+    {% if msg_size > 8 and sig.is_little_endian %}
+  tmp = get_raw_value<{{b1}}, {{sig.size}}, {{"true" if sig.is_signed else "false"}}>(read_u64_le(dat + {{byte_offset}}));
+    {% elif msg_size > 8 %}
+  tmp = get_raw_value<{{bo}}, {{sig.size}}, {{"true" if sig.is_signed else "false"}}>(read_u64_be(dat + {{byte_offset}}));
+    {% elif sig.is_little_endian %}
+  tmp = get_raw_value<{{b1}}, {{sig.size}}, {{"true" if sig.is_signed else "false"}}>(dat_le);
+    {% else %}
+  tmp = get_raw_value<{{bo}}, {{sig.size}}, {{"true" if sig.is_signed else "false"}}>(dat_be);
+    {% endif %}
+    {% if checksum_func(type, address, msg_size) %}
+  if (check_checksum && {{checksum_func(type, address, msg_size)}} != tmp) return false;
+    {% elif type.endswith("_COUNTER") %}
+  *counter = tmp;
+    {% endif %}
+  vals[{{loop.index0}}] = tmp * {{sig.factor}} + {{sig.offset}};
+  {% endfor %}
+  return true;
+}
 {% endfor %}
 
 const Msg msgs[] = {
@@ -54,6 +62,7 @@ const Msg msgs[] = {
     .size = {{msg_size}},
     .num_sigs = ARRAYSIZE(sigs_{{address}}),
     .sigs = sigs_{{address}},
+    .decode = decode_{{address}},
   },
 {% endfor %}
 };
@@ -1,7 +1,6 @@
 #include <cassert>
-#include <utility>
+#include <cstring>
 #include <algorithm>
-#include <map>
 #include <cmath>
 
 #include "common.h"
@@ -33,49 +32,126 @@ static uint64_t set_value(uint64_t ret, const Signal& sig, int64_t ival) {
   return ret;
 }
 
+// Same on the 8 bytes at the signal's byte_offset, for CAN FD messages
+static void set_value(uint8_t *dat, const Signal& sig, int64_t ival) {
+  uint8_t *word = dat + sig.byte_offset;
+  uint64_t ret = set_value(read_u64_be(word), sig, ival);
+  for (int b = 0; b < 8; b++) {
+    word[b] = ret >> (56 - 8 * b);
+  }
+}
+
+static int64_t raw_value(const Signal& sig, double value) {
+  int64_t ival = (int64_t)(round((value - sig.offset) / sig.factor));
+  if (ival < 0) {
+    ival = (1ULL << sig.b2) + ival;
+  }
+  return ival;
+}
+
 CANPacker::CANPacker(const std::string& dbc_name) {
   dbc = dbc_lookup(dbc_name);
   assert(dbc);
+  dbc_idx = dbc_index(dbc);
 
+  message_handles.reserve(dbc->num_msgs);
   for (int i=0; i<dbc->num_msgs; i++) {
     const Msg* msg = &dbc->msgs[i];
-    message_lookup[msg->address] = *msg;
-    for (int j=0; j<msg->num_sigs; j++) {
-      const Signal* sig = &msg->sigs[j];
-      signal_lookup[std::make_pair(msg->address, std::string(sig->name))] = *sig;
-    }
+    message_handles[msg->address] = prepare(msg->address, {});
   }
   init_crc_lookup_tables();
 }
 
 uint64_t CANPacker::pack(uint32_t address, const std::vector<SignalPackValue> &signals, int counter) {
+  // CAN FD messages don't fit, they go through pack(handle, values, counter, dat)
+  const CANPackHandle &handle = message_handles[address];
+  assert(handle.size <= 8);
+
   uint64_t ret = 0;
   for (const auto& sigval : signals) {
-    std::string name = std::string(sigval.name);
-    double value = sigval.value;
+    const Signal *sig = dbc_idx->find_signal(address, sigval.name, true);
+    if (!sig) {
+      WARN("undefined signal %s - %d\n", sigval.name, address);
+      continue;
+    }
+
+    ret = set_value(ret, *sig, raw_value(*sig, sigval.value));
+  }
+
+  return set_counter_and_checksum(handle, ret, counter);
+}
+
+CANPackHandle CANPacker::prepare(uint32_t address, const std::vector<std::string> &signal_names) {
+  CANPackHandle handle = {.address = address};
+
+  const Msg* msg = dbc_idx->find_msg(address);
+  if (!msg) {
+    WARN("undefined message %d\n", address);
+    handle.sigs.resize(signal_names.size(), NULL);
+    return handle;
+  }
+  handle.size = msg->size;
 
-    auto sig_it = signal_lookup.find(std::make_pair(address, name));
-    if (sig_it == signal_lookup.end()) {
+  for (const auto& name : signal_names) {
+    const Signal *sig = dbc_idx->find_signal(address, name, true);
+    if (!sig) {
       WARN("undefined signal %s - %d\n", name.c_str(), address);
-      continue;
     }
-    const auto& sig = sig_it->second;
+    handle.sigs.push_back(sig);
+  }
+  handle.counter = dbc_idx->find_signal(address, "COUNTER", true);
+  handle.checksum = dbc_idx->find_signal(address, "CHECKSUM", true);
+  return handle;
+}
 
-    int64_t ival = (int64_t)(round((value - sig.offset) / sig.factor));
-    if (ival < 0) {
-      ival = (1ULL << sig.b2) + ival;
+uint64_t CANPacker::pack(const CANPackHandle &handle, const double *values, int counter) {
+  assert(handle.size <= 8);
+
+  uint64_t ret = 0;
+  for (size_t i = 0; i < handle.sigs.size(); i++) {
+    const Signal *sig = handle.sigs[i];
+    if (sig) {
+      ret = set_value(ret, *sig, raw_value(*sig, values[i]));
     }
+  }
+
+  return set_counter_and_checksum(handle, ret, counter);
+}
 
-    ret = set_value(ret, sig, ival);
+size_t CANPacker::pack(const CANPackHandle &handle, const double *values, int counter, uint8_t *dat) {
+  if (handle.size <= 8) {
+    uint64_t ret = pack(handle, values, counter);
+    for (unsigned int b = 0; b < handle.size; b++) {
+      dat[b] = ret >> (56 - 8 * b);
+    }
+    return handle.size;
   }
 
+  // CAN FD, without checksums
+  memset(dat, 0, handle.size);
+  for (size_t i = 0; i < handle.sigs.size(); i++) {
+    const Signal *sig = handle.sigs[i];
+    if (sig) {
+      set_value(dat, *sig, raw_value(*sig, values[i]));
+    }
+  }
+  if (counter >= 0) {
+    if (handle.counter) {
+      set_value(dat, *handle.counter, counter);
+    } else {
+      WARN("COUNTER not defined\n");
+    }
+  }
+  return handle.size;
+}
+
+uint64_t CANPacker::set_counter_and_checksum(const CANPackHandle &handle, uint64_t ret, int counter) {
   if (counter >= 0){
-    auto sig_it = signal_lookup.find(std::make_pair(address, "COUNTER"));
-    if (sig_it == signal_lookup.end()) {
+    if (!handle.counter) {
       WARN("COUNTER not defined\n");
       return ret;
     }
-    const auto& sig = sig_it->second;
+    const auto& sig = *handle.counter;
 
     if ((sig.type != SignalType::HONDA_COUNTER) && (sig.type != SignalType::VOLKSWAGEN_COUNTER)) {
       WARN("COUNTER signal type not valid\n");
@@ -84,26 +160,26 @@ uint64_t CANPacker::pack(uint32_t address, const std::vector<SignalPackValue> &s
     ret = set_value(ret, sig, counter);
   }
 
-  auto sig_it_checksum = signal_lookup.find(std::make_pair(address, "CHECKSUM"));
-  if (sig_it_checksum != signal_lookup.end()) {
-    const auto& sig = sig_it_checksum->second;
+  if (handle.checksum) {
+    const uint32_t address = handle.address;
+    const auto& sig = *handle.checksum;
     if (sig.type == SignalType::HONDA_CHECKSUM) {
-      unsigned int chksm = honda_checksum(address, ret, message_lookup[address].size);
+      unsigned int chksm = honda_checksum(address, ret, handle.size);
       ret = set_value(ret, sig, chksm);
     } else if (sig.type == SignalType::TOYOTA_CHECKSUM) {
-      unsigned int chksm = toyota_checksum(address, ret, message_lookup[address].size);
+      unsigned int chksm = toyota_checksum(address, ret, handle.size);
       ret = set_value(ret, sig, chksm);
     } else if (sig.type == SignalType::VOLKSWAGEN_CHECKSUM) {
       // FIXME: Hackish fix for an endianness issue. The message is in reverse byte order
       // until later in the pack process. Checksums can be run backwards, CRCs not so much.
       // The correct fix is unclear but this works for the moment.
-      unsigned int chksm = volkswagen_crc(address, ReverseBytes(ret), message_lookup[address].size);
+      unsigned int chksm = volkswagen_crc(address, ReverseBytes(ret), handle.size);
       ret = set_value(ret, sig, chksm);
     } else if (sig.type == SignalType::SUBARU_CHECKSUM) {
-      unsigned int chksm = subaru_checksum(address, ret, message_lookup[address].size);
+      unsigned int chksm = subaru_checksum(address, ret, handle.size);
       ret = set_value(ret, sig, chksm);
     } else if (sig.type == SignalType::CHRYSLER_CHECKSUM) {
-      unsigned int chksm = chrysler_checksum(address, ReverseBytes(ret), message_lookup[address].size);
+      unsigned int chksm = chrysler_checksum(address, ReverseBytes(ret), handle.size);
       ret = set_value(ret, sig, chksm);
     } else {
       //WARN("CHECKSUM signal type not valid\n");
@@ -113,6 +189,6 @@ uint64_t CANPacker::pack(uint32_t address, const std::vector<SignalPackValue> &s
   return ret;
 }
 
-Msg* CANPacker::lookup_message(uint32_t address) {
-  return &message_lookup[address];
+const Msg* CANPacker::lookup_message(uint32_t address) {
+  return dbc_idx->find_msg(address);
 }
@@ -1,7 +1,7 @@
 # distutils: language = c++
 # cython: c_string_encoding=ascii, language_level=3
 
-from libc.stdint cimport uint32_t, uint64_t
+from libc.stdint cimport uint8_t, uint32_t, uint64_t
 from libcpp.vector cimport vector
 from libcpp.map cimport map
 from libcpp.string cimport string
@@ -9,7 +9,11 @@ from libcpp cimport bool
 from posix.dlfcn cimport dlopen, dlsym, RTLD_LAZY
 
 from .common cimport CANPacker as cpp_CANPacker
-from .common cimport dbc_lookup, SignalPackValue, DBC
+from .common cimport CANPackHandle, dbc_lookup, dbc_load, SignalPackValue, DBC, CANFD_MAX_SIZE
+
+import os
+
+from opendbc import DBC_PATH, DBC_CACHE_DIR
 
 
 cdef class CANPacker:
@@ -18,9 +22,14 @@ cdef class CANPacker:
     const DBC *dbc
     map[string, (int, int)] name_to_address_and_size
     map[int, int] address_to_size
+    vector[CANPackHandle] handles
+    vector[double] handle_values
 
   def __init__(self, dbc_name):
     self.dbc = dbc_lookup(dbc_name)
+    if not self.dbc:
+      # not built in, parsed from the .dbc at runtime
+      self.dbc = dbc_load(os.path.join(DBC_PATH, dbc_name + ".dbc"), DBC_CACHE_DIR)
     if not self.dbc:
       raise RuntimeError(f"Can't lookup {dbc_name}")
 
@@ -31,6 +40,19 @@ cdef class CANPacker:
       self.name_to_address_and_size[string(msg.name)] = (msg.address, msg.size)
       self.address_to_size[msg.address] = msg.size
 
+  def prepare(self, name_or_addr, signal_names):
+    # The signals are looked up once, make_can_msg_prepared takes their values in this order
+    cdef vector[string] names
+    for name in signal_names:
+      names.push_back(name.encode('utf8'))
+
+    if type(name_or_addr) == int:
+      addr = name_or_addr
+    else:
+      addr, _ = self.name_to_address_and_size[name_or_addr.encode('utf8')]
+    self.handles.push_back(self.packer.prepare(addr, names))
+    return self.handles.size() - 1
+
   cdef uint64_t pack(self, addr, values, counter):
     cdef vector[SignalPackValue] values_thing
     cdef SignalPackValue spv
@@ -45,7 +67,7 @@ cdef class CANPacker:
       spv.value = value
       values_thing.push_back(spv)
 
-    return self.packer.pack(addr, values_thing, counter)
+    return self.packer.pack(<uint32_t>addr, values_thing, <int>counter)
 
   cdef inline uint64_t ReverseBytes(self, uint64_t x):
     return (((x & 0xff00000000000000ull) >> 56) |
@@ -64,6 +86,30 @@ cdef class CANPacker:
       size = self.address_to_size[name_or_addr]
     else:
       addr, size = self.name_to_address_and_size[name_or_addr.encode('utf8')]
+    if size > 8:
+      # CAN FD messages only pack into a buffer, through a handle for these signals
+      names = [name.encode('utf8') for name in values]
+      return [addr, 0, self.pack_handle(self.packer.prepare(addr, names), list(values.values()), counter), bus]
+
     cdef uint64_t val = self.pack(addr, values, counter)
     val = self.ReverseBytes(val)
     return [addr, 0, (<char *>&val)[:size], bus]
+
+  cpdef make_can_msg_prepared(self, size_t handle, bus, values, counter=-1):
+    if handle >= self.handles.size():
+      raise IndexError(f"Unknown handle: {handle}")
+    cdef CANPackHandle *h = &self.handles[handle]
+    if len(values) != h.sigs.size():
+      raise ValueError(f"Expected {h.sigs.size()} values, got {len(values)}")
+
+    return [h.address, 0, self.pack_handle(h[0], values, counter), bus]
+
+  cdef bytes pack_handle(self, const CANPackHandle &h, values, counter):
+    cdef size_t i
+    self.handle_values.resize(len(values))
+    for i in range(len(values)):
+      self.handle_values[i] = values[i]
+
+    cdef uint8_t dat[CANFD_MAX_SIZE]
+    cdef size_t size = self.packer.pack(h, self.handle_values.data(), <int>counter, dat)
+    return (<char *>dat)[:size]
@@ -6,6 +6,7 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <algorithm>
+#include <unordered_set>
 
 #include "common.h"
 
@@ -13,18 +14,64 @@
 // #define DEBUG printf
 #define INFO printf
 
+void MessageState::init(const Msg *msg) {
+  address = msg->address;
+  size = msg->size;
+  decode = msg->decode;
+  all_vals.resize(msg->num_sigs);
+
+  for (int i = 0; i < msg->num_sigs; i++) {
+    SignalType type = msg->sigs[i].type;
+    if (type == SignalType::HONDA_COUNTER || type == SignalType::VOLKSWAGEN_COUNTER || type == SignalType::PEDAL_COUNTER) {
+      counter_size = msg->sigs[i].b2;
+    }
+  }
+}
+
+void MessageState::add_signal(const Msg *msg, int i) {
+  parse_sigs.push_back(&msg->sigs[i]);
+  sig_idx.push_back(i);
+}
+
 bool MessageState::parse(uint64_t sec, uint16_t ts_, uint8_t * dat) {
+  if (decode) {
+    // Generated for this message, with the shifts and the checksum known at compile time
+    int64_t cnt = 0;
+    if (!decode(dat, all_vals.data(), !ignore_checksum, &cnt)) {
+      INFO("0x%X CHECKSUM FAIL\n", address);
+      return false;
+    }
+    if (!ignore_counter && counter_size > 0 && !update_counter_generic(cnt, counter_size)) {
+      return false;
+    }
+    for (int i = 0; i < sig_idx.size(); i++) {
+      vals[i] = all_vals[sig_idx[i]];
+    }
+  } else if (!parse_generic(dat)) {
+    return false;
+  }
+
+  ts = ts_;
+  seen = sec;
+
+  return true;
+}
+
+bool MessageState::parse_generic(uint8_t * dat) {
   uint64_t dat_le = read_u64_le(dat);
   uint64_t dat_be = read_u64_be(dat);
 
   for (int i=0; i < parse_sigs.size(); i++) {
-    auto& sig = parse_sigs[i];
+    const Signal &sig = *parse_sigs[i];
     int64_t tmp;
 
+    // CAN FD signals past the first 8 bytes read the 8 that hold them
     if (sig.is_little_endian){
-      tmp = (dat_le >> sig.b1) & ((1ULL << sig.b2)-1);
+      uint64_t d = sig.byte_offset ? read_u64_le(dat + sig.byte_offset) : dat_le;
+      tmp = (d >> sig.b1) & ((1ULL << sig.b2)-1);
     } else {
-      tmp = (dat_be >> sig.bo) & ((1ULL << sig.b2)-1);
+      uint64_t d = sig.byte_offset ? read_u64_be(dat + sig.byte_offset) : dat_be;
+      tmp = (d >> sig.bo) & ((1ULL << sig.b2)-1);
     }
 
     if (sig.is_signed) {
@@ -84,8 +131,6 @@ bool MessageState::parse(uint64_t sec, uint16_t ts_, uint8_t * dat) {
 
     vals[i] = tmp * sig.factor + sig.offset;
   }
-  ts = ts_;
-  seen = sec;
 
   return true;
 }
@@ -109,6 +154,65 @@ bool MessageState::update_counter_generic(int64_t v, int cnt_size) {
 }
 
 
+MessageState &CANParser::add_state(const Msg *msg) {
+  message_states.emplace_back();
+  MessageState &state = message_states.back();
+  state.init(msg);
+  return state;
+}
+
+void CANParser::add_signal(MessageState &state, const Msg *msg, int i, double default_value) {
+  state.add_signal(msg, i);
+  vals.push_back(default_value);
+}
+
+void CANParser::init_states() {
+  // The values were added message by message, in the order of the states
+  size_t offset = 0;
+  for (auto &state : message_states) {
+    state.vals = &vals[offset];
+    offset += state.parse_sigs.size();
+  }
+
+  std::sort(message_states.begin(), message_states.end(), [](const MessageState &a, const MessageState &b) {
+    return a.address < b.address;
+  });
+
+  size_t size = 2;
+  index_shift = 31;
+  while (size < 2 * message_states.size()) {
+    size *= 2;
+    index_shift--;
+  }
+  index.assign(size, {.address = UINT32_MAX, .state = 0});
+
+  for (uint32_t i = 0; i < message_states.size(); i++) {
+    size_t pos = ((uint32_t)(message_states[i].address * 2654435769U) >> index_shift) & (size - 1);
+    while (index[pos].address != UINT32_MAX) {
+      pos = (pos + 1) & (size - 1);
+    }
+    index[pos] = {.address = message_states[i].address, .state = i};
+  }
+
+  // The defaults go out with the first query
+  for (uint32_t i = 0; i < message_states.size(); i++) {
+    message_states[i].updated = true;
+    updated_states.push_back(i);
+  }
+}
+
+MessageState *CANParser::find_state(uint32_t address) {
+  // Fibonacci hashing, CAN addresses are mostly small and clustered
+  size_t mask = index.size() - 1;
+  for (size_t pos = ((uint32_t)(address * 2654435769U) >> index_shift) & mask; ; pos = (pos + 1) & mask) {
+    if (index[pos].address == address) {
+      return &message_states[index[pos].state];
+    } else if (index[pos].address == UINT32_MAX) {
+      return nullptr;
+    }
+  }
+}
+
 CANParser::CANParser(int abus, const std::string& dbc_name,
           const std::vector<MessageParseOptions> &options,
           const std::vector<SignalParseOptions> &sigoptions)
@@ -117,55 +221,58 @@ CANParser::CANParser(int abus, const std::string& dbc_name,
   dbc = dbc_lookup(dbc_name);
   assert(dbc);
   init_crc_lookup_tables();
+  const DBCIndex *dbc_idx = dbc_index(dbc);
 
-  for (const auto& op : options) {
-    MessageState &state = message_states[op.address];
-    state.address = op.address;
-    // state.check_frequency = op.check_frequency,
+  // The requested signals grouped by message, in their order
+  std::vector<const SignalParseOptions*> sorted_sigoptions;
+  sorted_sigoptions.reserve(sigoptions.size());
+  for (const auto& sigop : sigoptions) {
+    sorted_sigoptions.push_back(&sigop);
+  }
+  auto by_address = [](const SignalParseOptions *a, const SignalParseOptions *b) { return a->address < b->address; };
+  std::stable_sort(sorted_sigoptions.begin(), sorted_sigoptions.end(), by_address);
 
-    // msg is not valid if a message isn't received for 10 consecutive steps
-    if (op.check_frequency > 0) {
-      state.check_threshold = (1000000000ULL / op.check_frequency) * 10;
+  std::unordered_set<uint32_t> seen;
+  for (const auto& op : options) {
+    if (!seen.insert(op.address).second) {
+      // the signals were added with the first entry of the message
+      continue;
     }
 
-    const Msg* msg = NULL;
-    for (int i = 0; i < dbc->num_msgs; i++) {
-      if (dbc->msgs[i].address == op.address) {
-        msg = &dbc->msgs[i];
-        break;
-      }
-    }
+    const Msg* msg = dbc_find_msg(dbc, op.address);
     if (!msg) {
       fprintf(stderr, "CANParser: could not find message 0x%X in DBC %s\n", op.address, dbc_name.c_str());
       assert(false);
     }
 
-    state.size = msg->size;
+    MessageState &state = add_state(msg);
+    // state.check_frequency = op.check_frequency,
+
+    // msg is not valid if a message isn't received for 10 consecutive steps
+    if (op.check_frequency > 0) {
+      state.check_threshold = (1000000000ULL / op.check_frequency) * 10;
+    }
 
     // track checksums and counters for this message
     for (int i = 0; i < msg->num_sigs; i++) {
       const Signal *sig = &msg->sigs[i];
       if (sig->type != SignalType::DEFAULT) {
-        state.parse_sigs.push_back(*sig);
-        state.vals.push_back(0);
+        add_signal(state, msg, i, 0);
       }
     }
 
     // track requested signals for this message
-    for (const auto& sigop : sigoptions) {
-      if (sigop.address != op.address) continue;
-
-      for (int i = 0; i < msg->num_sigs; i++) {
-        const Signal *sig = &msg->sigs[i];
-        if (strcmp(sig->name, sigop.name) == 0
-            && sig->type == SignalType::DEFAULT) {
-          state.parse_sigs.push_back(*sig);
-          state.vals.push_back(sigop.default_value);
-          break;
-        }
+    SignalParseOptions key = {.address = op.address};
+    auto range = std::equal_range(sorted_sigoptions.begin(), sorted_sigoptions.end(), &key, by_address);
+    for (auto it = range.first; it != range.second; ++it) {
+      const SignalParseOptions *sigop = *it;
+      const Signal *sig = dbc_idx->find_signal(msg->address, sigop->name);
+      if (sig && sig->type == SignalType::DEFAULT) {
+        add_signal(state, msg, sig - msg->sigs, sigop->default_value);
       }
     }
   }
+  init_states();
 }
 
 CANParser::CANParser(int abus, const std::string& dbc_name, bool ignore_checksum, bool ignore_counter)
@@ -178,21 +285,15 @@ CANParser::CANParser(int abus, const std::string& dbc_name, bool ignore_checksum
 
   for (int i = 0; i < dbc->num_msgs; i++) {
     const Msg* msg = &dbc->msgs[i];
-    MessageState state = {
-      .address = msg->address,
-      .size = msg->size,
-      .ignore_checksum = ignore_checksum,
-      .ignore_counter = ignore_counter,
-    };
+    MessageState &state = add_state(msg);
+    state.ignore_checksum = ignore_checksum;
+    state.ignore_counter = ignore_counter;
 
     for (int j = 0; j < msg->num_sigs; j++) {
-      const Signal *sig = &msg->sigs[j];
-      state.parse_sigs.push_back(*sig);
-      state.vals.push_back(0);
+      add_signal(state, msg, j, 0);
     }
-
-    message_states[state.address] = state;
   }
+  init_states();
 }
 
 #ifndef DYNAMIC_CAPNP
@@ -216,6 +317,47 @@ void CANParser::update_string(const std::string &data, bool sendcan) {
   UpdateValid(last_sec);
 }
 
+CANParserGroup::CANParserGroup() : aligned_buf(kj::heapArray<capnp::word>(1024)) {
+}
+
+void CANParserGroup::add(CANParser *parser) {
+  parsers.push_back(parser);
+  if (parser->bus >= (int)bus_parsers.size()) {
+    bus_parsers.resize(parser->bus + 1);
+  }
+  bus_parsers[parser->bus].push_back(parser);
+}
+
+void CANParserGroup::update_string(const std::string &data, bool sendcan) {
+  const size_t buf_size = (data.length() / sizeof(capnp::word)) + 1;
+  if (aligned_buf.size() < buf_size) {
+    aligned_buf = kj::heapArray<capnp::word>(buf_size);
+  }
+  memcpy(aligned_buf.begin(), data.data(), data.length());
+
+  capnp::FlatArrayMessageReader cmsg(aligned_buf.slice(0, buf_size));
+  cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
+
+  uint64_t sec = event.getLogMonoTime();
+  for (auto parser : parsers) {
+    parser->last_sec = sec;
+  }
+
+  for (auto frame : sendcan ? event.getSendcan() : event.getCan()) {
+    uint8_t src = frame.getSrc();
+    if (src >= bus_parsers.size()) continue;
+
+    auto dat = frame.getDat();
+    for (auto parser : bus_parsers[src]) {
+      parser->UpdateFrame(sec, src, frame.getAddress(), frame.getBusTime(), dat.begin(), dat.size());
+    }
+  }
+
+  for (auto parser : parsers) {
+    parser->UpdateValid(sec);
+  }
+}
+
 void CANParser::UpdateCans(uint64_t sec, const capnp::List<cereal::CanData>::Reader& cans) {
   int msg_count = cans.size();
 
@@ -228,17 +370,8 @@ void CANParser::UpdateCans(uint64_t sec, const capnp::List<cereal::CanData>::Rea
       // DEBUG("skip %d: wrong bus\n", cmsg.getAddress());
       continue;
     }
-    auto state_it = message_states.find(cmsg.getAddress());
-    if (state_it == message_states.end()) {
-      // DEBUG("skip %d: not specified\n", cmsg.getAddress());
-      continue;
-    }
-
-    if (cmsg.getDat().size() > 8) continue; //shouldn't ever happen
-    uint8_t dat[8] = {0};
-    memcpy(dat, cmsg.getDat().begin(), cmsg.getDat().size());
-
-    state_it->second.parse(sec, cmsg.getBusTime(), dat);
+    auto dat = cmsg.getDat();
+    UpdateFrame(sec, bus, cmsg.getAddress(), cmsg.getBusTime(), dat.begin(), dat.size());
   }
 }
 #endif
@@ -252,23 +385,33 @@ void CANParser::UpdateCans(uint64_t sec, const capnp::DynamicStruct::Reader& cms
     return;
   }
 
-  auto state_it = message_states.find(cmsg.get("address").as<uint32_t>());
-  if (state_it == message_states.end()) {
-    DEBUG("skip %d: not specified\n", cmsg.get("address").as<uint32_t>());
+  auto dat = cmsg.get("dat").as<capnp::Data>();
+  UpdateFrame(sec, bus, cmsg.get("address").as<uint32_t>(), cmsg.get("busTime").as<uint16_t>(), dat.begin(), dat.size());
+}
+
+void CANParser::UpdateFrame(uint64_t sec, uint8_t src, uint32_t address, uint16_t bus_time, const uint8_t *dat, size_t len) {
+  if (src != bus) {
     return;
   }
 
-  auto dat = cmsg.get("dat").as<capnp::Data>();
-  if (dat.size() > 8) return; //shouldn't ever happen
-  uint8_t data[8] = {0};
-  memcpy(data, dat.begin(), dat.size());
-  state_it->second.parse(sec, cmsg.get("busTime").as<uint16_t>(), data);
+  MessageState *state = find_state(address);
+  if (state == nullptr) {
+    // DEBUG("skip %d: not specified\n", address);
+    return;
+  }
+
+  if (len > CANFD_MAX_SIZE) return; //shouldn't ever happen
+  uint8_t data[CANFD_MAX_SIZE] = {0};
+  memcpy(data, dat, len);
+  if (state->parse(sec, bus_time, data) && !state->updated) {
+    state->updated = true;
+    updated_states.push_back(state - message_states.data());
+  }
 }
 
 void CANParser::UpdateValid(uint64_t sec) {
   can_valid = true;
-  for (const auto& kv : message_states) {
-    const auto& state = kv.second;
+  for (const auto& state : message_states) {
     if (state.check_threshold > 0 && (sec - state.seen) > state.check_threshold) {
       if (state.seen > 0) {
         DEBUG("0x%X TIMEOUT\n", state.address);
@@ -282,17 +425,16 @@ void CANParser::UpdateValid(uint64_t sec) {
 
 std::vector<SignalValue> CANParser::query_latest() {
   std::vector<SignalValue> ret;
+  ret.reserve(vals.size());
 
-  for (const auto& kv : message_states) {
-    const auto& state = kv.second;
+  for (const auto& state : message_states) {
     if (last_sec != 0 && state.seen != last_sec) continue;
 
     for (int i=0; i<state.parse_sigs.size(); i++) {
-      const Signal &sig = state.parse_sigs[i];
       ret.push_back((SignalValue){
         .address = state.address,
         .ts = state.ts,
-        .name = sig.name,
+        .name = state.parse_sigs[i]->name,
         .value = state.vals[i],
       });
     }
@@ -300,3 +442,22 @@ std::vector<SignalValue> CANParser::query_latest() {
 
   return ret;
 }
+
+void CANParser::query_updated(std::vector<SignalValue> &ret) {
+  ret.clear();
+
+  for (uint32_t i : updated_states) {
+    MessageState &state = message_states[i];
+    state.updated = false;
+
+    for (int j = 0; j < state.parse_sigs.size(); j++) {
+      ret.push_back((SignalValue){
+        .address = state.address,
+        .ts = state.ts,
+        .name = state.parse_sigs[j]->name,
+        .value = state.vals[j],
+      });
+    }
+  }
+  updated_states.clear();
+}
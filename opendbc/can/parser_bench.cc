@@ -0,0 +1,331 @@
+// Frames/sec of MessageState::parse with the generated per-message decoders against the
+// generic signal loop, on every signal of every message in the DBC. Both are checked to
+// agree on every frame.
+//
+// The stream is a candump log ("(1614556800.123456) can0 1D0#0011223344556677") recorded
+// on the car when one is given, otherwise it cycles through the DBC's messages packed by
+// CANPacker, so checksums and counters are valid.
+//
+// With --event, one CANParser per bus runs over the same can event, like a car port's pt,
+// radar and cam parsers: every parser sees every frame, then UpdateValid and query_updated.
+//
+// With --bulk, CANBulkDecoder decodes every signal of the DBC from log segments on 1, 2, 4 ...
+// threads up to the number of cores. Every thread count is checked to give the same columns.
+//
+// usage: parser_bench <dbc name> [candump.log]
+//        parser_bench --event <pt dbc> <radar dbc> <cam dbc>
+//        parser_bench --bulk <dbc name>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <initializer_list>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+
+#define BENCH_ROUNDS 64
+#define BENCH_MIN_FRAMES 2000000
+#define BENCH_EVENTS 20000
+#define BENCH_SEGMENTS 64
+#define BENCH_SEGMENT_ROUNDS 1024
+
+struct Frame {
+  uint32_t address;
+  uint8_t src;
+  uint8_t dat[8];
+};
+
+static std::vector<Frame> pack_frames(const DBC *dbc, int rounds=BENCH_ROUNDS) {
+  CANPacker packer(dbc->name);
+  std::vector<Frame> frames;
+
+  for (int round = 0; round < rounds; round++) {
+    for (int i = 0; i < dbc->num_msgs; i++) {
+      const Msg *msg = &dbc->msgs[i];
+      if (msg->size > 8) continue;  // CAN FD, the frames here are classic
+
+      std::vector<SignalPackValue> values;
+      int counter = -1;
+
+      for (int j = 0; j < msg->num_sigs; j++) {
+        const Signal &sig = msg->sigs[j];
+        if (strcmp(sig.name, "COUNTER") == 0) {
+          counter = round % (1 << sig.b2);
+        } else if (sig.type == SignalType::DEFAULT) {
+          int64_t raw = rand() % (1LL << std::min(sig.b2, 16));
+          values.push_back({sig.name, raw * sig.factor + sig.offset});
+        }
+      }
+
+      uint64_t packed = packer.pack(msg->address, values, counter);
+      Frame f = {.address = msg->address};
+      for (int b = 0; b < 8; b++) {
+        f.dat[b] = packed >> (56 - 8 * b);
+      }
+      frames.push_back(f);
+    }
+  }
+  return frames;
+}
+
+static std::vector<Frame> read_candump(const char *fn) {
+  std::vector<Frame> frames;
+  std::ifstream f(fn);
+  std::string line;
+  while (std::getline(f, line)) {
+    size_t hash = line.find('#');
+    size_t space = line.rfind(' ', hash);
+    if (hash == std::string::npos || space == std::string::npos) continue;
+
+    Frame frame = {.address = (uint32_t)strtoul(line.substr(space + 1, hash - space - 1).c_str(), NULL, 16)};
+    std::string data = line.substr(hash + 1);
+    for (int b = 0; b < 8 && 2 * b + 1 < data.size(); b++) {
+      frame.dat[b] = strtoul(data.substr(2 * b, 2).c_str(), NULL, 16);
+    }
+    frames.push_back(frame);
+  }
+  return frames;
+}
+
+static std::unordered_map<uint32_t, MessageState> make_states(const DBC *dbc, bool generated, std::vector<double> &vals) {
+  std::unordered_map<uint32_t, MessageState> states;
+  size_t num_vals = 0;
+  for (int i = 0; i < dbc->num_msgs; i++) {
+    num_vals += dbc->msgs[i].num_sigs;
+  }
+  vals.assign(num_vals, 0);
+
+  double *next = vals.data();
+  for (int i = 0; i < dbc->num_msgs; i++) {
+    const Msg *msg = &dbc->msgs[i];
+    MessageState &state = states[msg->address];
+    state.init(msg);
+    if (!generated) {
+      state.decode = nullptr;
+    }
+    for (int j = 0; j < msg->num_sigs; j++) {
+      state.add_signal(msg, j);
+    }
+    state.vals = next;
+    next += msg->num_sigs;
+  }
+  return states;
+}
+
+static double run(std::unordered_map<uint32_t, MessageState> &states, std::vector<Frame> &frames, int loops) {
+  auto start = std::chrono::steady_clock::now();
+  for (int loop = 0; loop < loops; loop++) {
+    for (size_t i = 0; i < frames.size(); i++) {
+      auto it = states.find(frames[i].address);
+      if (it == states.end()) continue;
+      it->second.parse(loop * frames.size() + i + 1, 0, frames[i].dat);
+    }
+  }
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static int bench_event(char* dbc_names[]) {
+  std::vector<CANParser*> parsers;
+  std::vector<Frame> event;
+  for (int bus = 0; bus < 3; bus++) {
+    const DBC *dbc = dbc_lookup(dbc_names[bus]);
+    if (!dbc) {
+      printf("can't find DBC: %s\n", dbc_names[bus]);
+      return 1;
+    }
+    parsers.push_back(new CANParser(bus, dbc->name, false, true));
+
+    for (auto &f : pack_frames(dbc, 1)) {
+      f.src = bus;
+      event.push_back(f);
+    }
+  }
+
+  std::vector<SignalValue> values;
+  size_t num_values = 0;
+  uint64_t sec = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < BENCH_EVENTS; i++) {
+    sec += 10000000ULL;
+    for (auto p : parsers) {
+      p->last_sec = sec;
+      for (auto &f : event) {
+        p->UpdateFrame(sec, f.src, f.address, 0, f.dat, 8);
+      }
+      p->UpdateValid(sec);
+      p->query_updated(values);
+      num_values += values.size();
+    }
+  }
+  double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  printf("3 parsers, %zu frames per event, %zu values per event\n", event.size(), num_values / BENCH_EVENTS);
+  printf("  %10.0f events/s  %8.2f us/event\n", BENCH_EVENTS / s, s / BENCH_EVENTS * 1e6);
+  return 0;
+}
+
+static int bench_bulk(const char *dbc_name) {
+  const DBC *dbc = dbc_lookup(dbc_name);
+  if (!dbc) {
+    printf("can't find DBC: %s\n", dbc_name);
+    return 1;
+  }
+
+  std::vector<SignalParseOptions> signals;
+  for (int i = 0; i < dbc->num_msgs; i++) {
+    for (int j = 0; j < dbc->msgs[i].num_sigs; j++) {
+      const Signal &sig = dbc->msgs[i].sigs[j];
+      if (sig.type == SignalType::DEFAULT) {
+        signals.push_back({.address = dbc->msgs[i].address, .name = sig.name, .default_value = 0});
+      }
+    }
+  }
+
+  // Checksum and counter failures print, keep them out. pack_frames only counts the counters
+  // named COUNTER. Every segment starts where the last one ended, so the counters keep counting.
+  std::vector<std::vector<CANBulkFrame>> segments(BENCH_SEGMENTS);
+  std::vector<Frame> frames;
+  for (auto &f : pack_frames(dbc, BENCH_SEGMENT_ROUNDS)) {
+    const Msg *msg = dbc_find_msg(dbc, f.address);
+    bool ok;
+    check_checksums(msg, f.dat, 1, &ok);
+    for (int j = 0; j < msg->num_sigs; j++) {
+      SignalType type = msg->sigs[j].type;
+      bool is_counter = type == SignalType::HONDA_COUNTER || type == SignalType::VOLKSWAGEN_COUNTER || type == SignalType::PEDAL_COUNTER;
+      ok = ok && !(is_counter && strcmp(msg->sigs[j].name, "COUNTER") != 0);
+    }
+    if (ok) frames.push_back(f);
+  }
+  size_t num_frames = 0;
+  uint64_t sec = 0;
+  for (auto &segment : segments) {
+    for (auto &f : frames) {
+      sec += 100000;
+      CANBulkFrame bf = {.sec = sec, .address = f.address, .src = 0, .len = 8};
+      memcpy(bf.dat, f.dat, 8);
+      segment.push_back(bf);
+    }
+    num_frames += segment.size();
+  }
+
+  CANBulkDecoder decoder(0, dbc->name, signals, false, false);
+  std::vector<CANBulkColumn> reference;
+  double reference_s = 0;
+  int cores = std::max(1U, std::thread::hardware_concurrency());
+
+  printf("%s: %zu signals, %d segments of %zu frames\n", dbc->name, signals.size(), BENCH_SEGMENTS, frames.size());
+  for (int threads = 1; ; threads = std::min(2 * threads, cores)) {
+    auto start = std::chrono::steady_clock::now();
+    std::vector<CANBulkColumn> columns = decoder.decode_frames(segments, threads).columns;
+    double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    if (threads == 1) {
+      reference = columns;
+      reference_s = s;
+      size_t num_values = 0;
+      for (auto &col : columns) {
+        num_values += col.values.size();
+      }
+      printf("  %zu values\n", num_values);
+    } else {
+      for (size_t c = 0; c < columns.size(); c++) {
+        if (columns[c].ts != reference[c].ts || columns[c].values != reference[c].values) {
+          printf("%d threads: column of %s differs\n", threads, signals[c].name);
+          return 1;
+        }
+      }
+    }
+    printf("  %3d threads %12.0f frames/s  (%.2fx)\n", threads, num_frames / s, reference_s / s);
+    if (threads == cores) break;
+  }
+  return 0;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    printf("usage: %s <dbc name> [candump.log]\n", argv[0]);
+    printf("       %s --event <pt dbc> <radar dbc> <cam dbc>\n", argv[0]);
+    printf("       %s --bulk <dbc name>\n", argv[0]);
+    return 1;
+  }
+  if (strcmp(argv[1], "--bulk") == 0) {
+    if (argc < 3) {
+      printf("--bulk needs a DBC\n");
+      return 1;
+    }
+    return bench_bulk(argv[2]);
+  }
+  if (strcmp(argv[1], "--event") == 0) {
+    if (argc < 5) {
+      printf("--event needs three DBCs\n");
+      return 1;
+    }
+    return bench_event(&argv[2]);
+  }
+
+  const DBC *dbc = dbc_lookup(argv[1]);
+  if (!dbc) {
+    printf("can't find DBC: %s\n", argv[1]);
+    return 1;
+  }
+  init_crc_lookup_tables();
+
+  std::vector<Frame> frames = (argc > 2) ? read_candump(argv[2]) : pack_frames(dbc);
+  if (frames.empty()) {
+    printf("no frames\n");
+    return 1;
+  }
+
+  // Counter failures would pile up when looping over the stream
+  std::vector<double> generic_vals, generated_vals;
+  auto generic = make_states(dbc, false, generic_vals);
+  auto generated = make_states(dbc, true, generated_vals);
+  for (auto states : {&generic, &generated}) {
+    for (auto &kv : *states) {
+      kv.second.ignore_counter = true;
+    }
+  }
+
+  // Same result for every frame. On a checksum failure the generic loop may have
+  // updated some values already, the generated decoders leave them all alone.
+  size_t mismatches = 0;
+  std::vector<Frame> valid;
+  for (size_t i = 0; i < frames.size(); i++) {
+    auto it = generic.find(frames[i].address);
+    if (it == generic.end()) continue;
+    MessageState &a = it->second, &b = generated[frames[i].address];
+    bool ok = a.parse(i + 1, 0, frames[i].dat);
+    if (ok != b.parse(i + 1, 0, frames[i].dat) || (ok && !std::equal(a.vals, a.vals + a.parse_sigs.size(), b.vals))) {
+      mismatches++;
+    }
+    if (ok) valid.push_back(frames[i]);
+  }
+  if (mismatches > 0) {
+    printf("%zu mismatches between generic and generated decoding\n", mismatches);
+    return 1;
+  }
+
+  // Checksum failures print, keep them out of the timing
+  frames = valid;
+  if (frames.empty()) {
+    printf("no valid frames\n");
+    return 1;
+  }
+  int loops = std::max<int>(1, BENCH_MIN_FRAMES / frames.size());
+
+  double generic_s = run(generic, frames, loops);
+  double generated_s = run(generated, frames, loops);
+  double total = (double)frames.size() * loops;
+
+  printf("%s: %zu frames x %d\n", dbc->name, frames.size(), loops);
+  printf("  generic   %12.0f frames/s\n", total / generic_s);
+  printf("  generated %12.0f frames/s  (%.2fx)\n", total / generated_s, generic_s / generated_s);
+  return 0;
+}
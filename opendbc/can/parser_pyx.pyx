@@ -9,12 +9,18 @@ from libcpp.map cimport map
 from libcpp cimport bool
 
 from .common cimport CANParser as cpp_CANParser
-from .common cimport SignalParseOptions, MessageParseOptions, dbc_lookup, SignalValue, DBC
+from .common cimport CANParserGroup as cpp_CANParserGroup
+from .common cimport CANBulkDecoder as cpp_CANBulkDecoder
+from .common cimport CANBulkResult
+from .common cimport SignalParseOptions, MessageParseOptions, dbc_lookup, dbc_load, SignalValue, DBC
 
 import os
 import numbers
+import numpy as np
 from collections import defaultdict
 
+from opendbc import DBC_PATH, DBC_CACHE_DIR
+
 cdef int CAN_INVALID_CNT = 5
 
 cdef class CANParser:
@@ -39,6 +45,9 @@ cdef class CANParser:
     self.can_valid = True
     self.dbc_name = dbc_name
     self.dbc = dbc_lookup(dbc_name)
+    if not self.dbc:
+      # not built in, parsed from the .dbc at runtime
+      self.dbc = dbc_load(os.path.join(DBC_PATH, dbc_name + ".dbc"), DBC_CACHE_DIR)
     if not self.dbc:
       raise RuntimeError(f"Can't find DBC: {dbc_name}")
     self.vl = {}
@@ -54,10 +63,9 @@ cdef class CANParser:
 
       self.msg_name_to_address[name] = msg.address
       self.address_to_msg_name[msg.address] = name
-      self.vl[msg.address] = {}
-      self.vl[name] = {}
-      self.ts[msg.address] = {}
-      self.ts[name] = {}
+      # Same dicts under both keys, so every value is stored once
+      self.vl[msg.address] = self.vl[name] = {}
+      self.ts[msg.address] = self.ts[name] = {}
 
     # Convert message names into addresses
     for i in range(len(signals)):
@@ -104,10 +112,13 @@ cdef class CANParser:
     self.update_vl()
 
   cdef unordered_set[uint32_t] update_vl(self):
-    cdef string sig_name
     cdef unordered_set[uint32_t] updated_val
+    cdef const SignalValue *cv
+    cdef uint32_t address = 0
+    cdef size_t i
 
-    can_values = self.can.query_latest()
+    # Only the messages parsed since the last update, into a buffer that is reused
+    self.can.query_updated(self.can_values)
     valid = self.can.can_valid
 
     # Update invalid flag
@@ -116,18 +127,20 @@ cdef class CANParser:
         self.can_invalid_cnt = 0
     self.can_valid = self.can_invalid_cnt < CAN_INVALID_CNT
 
-    for cv in can_values:
+    # The signals of a message are next to each other
+    vl = ts = None
+    for i in range(self.can_values.size()):
+      cv = &self.can_values[i]
+      if vl is None or cv.address != address:
+        address = cv.address
+        vl = self.vl[address]
+        ts = self.ts[address]
+        updated_val.insert(address)
+
       # Cast char * directly to unicode
-      name = <unicode>self.address_to_msg_name[cv.address].c_str()
       cv_name = <unicode>cv.name
-
-      self.vl[cv.address][cv_name] = cv.value
-      self.ts[cv.address][cv_name] = cv.ts
-
-      self.vl[name][cv_name] = cv.value
-      self.ts[name][cv_name] = cv.ts
-
-      updated_val.insert(cv.address)
+      vl[cv_name] = cv.value
+      ts[cv_name] = cv.ts
 
     return updated_val
 
@@ -144,6 +157,96 @@ cdef class CANParser:
 
     return updated_vals
 
+cdef class CANParserGroup:
+  cdef:
+    cpp_CANParserGroup *group
+    list parsers
+
+  def __init__(self, parsers):
+    self.group = new cpp_CANParserGroup()
+    self.parsers = list(parsers)
+    for p in self.parsers:
+      self.group.add((<CANParser>p).can)
+
+  def __dealloc__(self):
+    del self.group
+
+  def update_strings(self, strings, sendcan=False):
+    # one set of updated addresses per parser, like CANParser.update_strings
+    updated_vals = [set() for _ in self.parsers]
+
+    for s in strings:
+      self.group.update_string(s, sendcan)
+      for i in range(len(self.parsers)):
+        updated_vals[i].update((<CANParser>self.parsers[i]).update_vl())
+
+    return updated_vals
+
+cdef class CANBulkDecoder:
+  """Decodes logged can events into a (ts, values) pair of arrays per signal.
+
+  signals are (signal name, message name or address) tuples. Checksums and counters are
+  only checked with check=True. decode takes segments of serialized events back to back,
+  like uncompressed rlogs, and decodes them on num_threads threads, all cores by default.
+  It returns the values and a dict of the segments that failed to decode, by index, with
+  the error. Those keep the values decoded before the bad event.
+  """
+  cdef:
+    cpp_CANBulkDecoder *decoder
+    list signals
+
+  def __init__(self, dbc_name, signals, bus=0, check=False):
+    cdef const DBC *dbc = dbc_lookup(dbc_name)
+    if not dbc:
+      # not built in, parsed from the .dbc at runtime
+      dbc = dbc_load(os.path.join(DBC_PATH, dbc_name + ".dbc"), DBC_CACHE_DIR)
+    if not dbc:
+      raise RuntimeError(f"Can't find DBC: {dbc_name}")
+
+    msg_name_to_address = {}
+    for i in range(dbc[0].num_msgs):
+      msg_name_to_address[dbc[0].msgs[i].name.decode('utf8')] = dbc[0].msgs[i].address
+
+    self.signals = []
+    cdef vector[SignalParseOptions] signal_options_v
+    cdef SignalParseOptions spo
+    for sig_name, msg in signals:
+      address = msg if isinstance(msg, numbers.Number) else msg_name_to_address[msg]
+      self.signals.append((sig_name, msg, address))
+      spo.address = address
+      spo.name = sig_name
+      spo.default_value = 0
+      signal_options_v.push_back(spo)
+
+    self.decoder = new cpp_CANBulkDecoder(bus, dbc_name, signal_options_v, not check, not check)
+
+  def __dealloc__(self):
+    del self.decoder
+
+  def decode(self, segments, int num_threads=0):
+    cdef vector[string] segments_v = segments
+    cdef CANBulkResult result
+    with nogil:
+      result = self.decoder.decode_events(segments_v, num_threads)
+
+    # Under the message name or address, like CANParser.vl
+    cdef uint64_t[:] ts_view
+    cdef double[:] values_view
+    out = defaultdict(dict)
+    for i, (sig_name, msg, address) in enumerate(self.signals):
+      n = result.columns[i].ts.size()
+      if n == 0:
+        ts, values = np.zeros(0, dtype=np.uint64), np.zeros(0, dtype=np.double)
+      else:
+        ts_view = <uint64_t[:n]>result.columns[i].ts.data()
+        values_view = <double[:n]>result.columns[i].values.data()
+        ts = np.copy(np.asarray(ts_view, dtype=np.uint64, order="C"))
+        values = np.copy(np.asarray(values_view, dtype=np.double, order="C"))
+      out[msg][sig_name] = (ts, values)
+
+    errors = {i: result.errors[i].decode('utf8', 'replace') for i in range(result.errors.size()) if result.errors[i].size() > 0}
+    return dict(out), errors
+
 cdef class CANDefine():
   cdef:
     const DBC *dbc
@@ -155,6 +258,9 @@ cdef class CANDefine():
   def __init__(self, dbc_name):
     self.dbc_name = dbc_name
     self.dbc = dbc_lookup(dbc_name)
+    if not self.dbc:
+      # not built in, parsed from the .dbc at runtime
+      self.dbc = dbc_load(os.path.join(DBC_PATH, dbc_name + ".dbc"), DBC_CACHE_DIR)
     if not self.dbc:
       raise RuntimeError(f"Can't find DBC: '{dbc_name}'")
 
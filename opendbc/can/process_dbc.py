@@ -8,6 +8,65 @@ import jinja2
 from collections import Counter
 from opendbc.can.dbc import dbc
 
+def signal_type(checksum_type, address, sig):
+  if checksum_type == "honda" and sig.name == "CHECKSUM":
+    return "HONDA_CHECKSUM"
+  elif checksum_type == "honda" and sig.name == "COUNTER":
+    return "HONDA_COUNTER"
+  elif checksum_type == "toyota" and sig.name == "CHECKSUM":
+    return "TOYOTA_CHECKSUM"
+  elif checksum_type == "volkswagen" and sig.name == "CHECKSUM":
+    return "VOLKSWAGEN_CHECKSUM"
+  elif checksum_type == "volkswagen" and sig.name == "COUNTER":
+    return "VOLKSWAGEN_COUNTER"
+  elif checksum_type == "subaru" and sig.name == "CHECKSUM":
+    return "SUBARU_CHECKSUM"
+  elif checksum_type == "chrysler" and sig.name == "CHECKSUM":
+    return "CHRYSLER_CHECKSUM"
+  elif address in [512, 513] and sig.name == "CHECKSUM_PEDAL":
+    return "PEDAL_CHECKSUM"
+  elif address in [512, 513] and sig.name == "COUNTER_PEDAL":
+    return "PEDAL_COUNTER"
+  return "DEFAULT"
+
+CANFD_MAX_SIZE = 64
+
+# checksum computed by the generated decoder, from the data as it is read for that checksum
+CHECKSUM_FUNCS = {
+  "HONDA_CHECKSUM": "honda_checksum(0x{address:X}, dat_be, {size})",
+  "TOYOTA_CHECKSUM": "toyota_checksum(0x{address:X}, dat_be, {size})",
+  "VOLKSWAGEN_CHECKSUM": "volkswagen_crc(0x{address:X}, dat_le, {size})",
+  "SUBARU_CHECKSUM": "subaru_checksum(0x{address:X}, dat_be, {size})",
+  "CHRYSLER_CHECKSUM": "chrysler_checksum(0x{address:X}, dat_le, {size})",
+  "PEDAL_CHECKSUM": "pedal_checksum(dat_be, {size})",
+}
+
+def checksum_func(sig_type, address, size):
+  return CHECKSUM_FUNCS[sig_type].format(address=address, size=size) if sig_type in CHECKSUM_FUNCS else None
+
+def signal_layout(sig, size):
+  # b1 from the lsb of the little endian data or the msb of the big endian data, bo the shift
+  # of a big endian signal. CAN FD messages are longer than the 64 bits a signal is read from,
+  # their signals count from the 8 data bytes at byte_offset that hold them.
+  if sig.is_little_endian:
+    b1 = sig.start_bit
+  else:
+    b1 = (sig.start_bit//8)*8 + (-sig.start_bit-1) % 8
+  byte_offset = max(0, min(b1 // 8, size - 8))
+  b1 -= 8 * byte_offset
+  return b1, 64 - (b1 + sig.size), byte_offset
+
+def data_words(checksum_type, address, size, sigs):
+  # only read the data the way the decoder needs it, CAN FD signals read their own
+  if size > 8:
+    return set()
+  words = set("dat_le" if sig.is_little_endian else "dat_be" for sig in sigs)
+  for sig in sigs:
+    func = checksum_func(signal_type(checksum_type, address, sig), address, size)
+    if func is not None:
+      words.update(w for w in ("dat_le", "dat_be") if w in func)
+  return words
+
 def process(in_fn, out_fn):
   dbc_name = os.path.split(out_fn)[-1].replace('.cc', '')
   # print("processing %s: %s -> %s" % (dbc_name, in_fn, out_fn))
@@ -70,7 +129,9 @@ def process(in_fn, out_fn):
     little_endian = None
 
   # sanity checks on expected COUNTER and CHECKSUM rules, as packer and parser auto-compute those signals
-  for address, msg_name, _, sigs in msgs:
+  for address, msg_name, msg_size, sigs in msgs:
+    if msg_size > CANFD_MAX_SIZE:
+      sys.exit("%s %s: longer than %d bytes" % (dbc_name, msg_name, CANFD_MAX_SIZE))
     dbc_msg_name = dbc_name + " " + msg_name
     for sig in sigs:
       if checksum_type is not None:
@@ -91,6 +152,13 @@ def process(in_fn, out_fn):
             sys.exit("%s: COUNTER starts at wrong bit" % dbc_msg_name)
           if little_endian != sig.is_little_endian:
             sys.exit("%s: COUNTER has wrong endianness" % dbc_msg_name)
+      # CAN FD rules
+      if msg_size > 8:
+        if checksum_func(signal_type(checksum_type, address, sig), address, msg_size) is not None:
+          sys.exit("%s: checksums of CAN FD messages are not supported" % dbc_msg_name)
+        b1, _, _ = signal_layout(sig, msg_size)
+        if b1 + sig.size > 64:
+          sys.exit("%s: %s spans more than 8 bytes" % (dbc_msg_name, sig.name))
       # pedal rules
       if address in [0x200, 0x201]:
         if sig.name == "COUNTER_PEDAL" and sig.size != 4:
@@ -104,7 +172,9 @@ def process(in_fn, out_fn):
     if count > 1:
       sys.exit("%s: Duplicate message name in DBC file %s" % (dbc_name, name))
 
-  parser_code = template.render(dbc=can_dbc, checksum_type=checksum_type, msgs=msgs, def_vals=def_vals, len=len)
+  parser_code = template.render(dbc=can_dbc, checksum_type=checksum_type, msgs=msgs, def_vals=def_vals, len=len,
+                                signal_type=signal_type, checksum_func=checksum_func, data_words=data_words,
+                                signal_layout=signal_layout)
 
   with open(out_fn, "a+") as out_f:
     out_f.seek(0)
@@ -197,7 +197,7 @@ void can_send_thread(bool fake_send) {
 
   // run as fast as messages come in
   while (!do_exit && panda->connected) {
-    Message * msg = subscriber->receive();
+    Message * msg = subscriber->receive_borrow();
 
     if (!msg){
       if (errno == EINTR) {
@@ -206,7 +206,16 @@ void can_send_thread(bool fake_send) {
       continue;
     }
 
-    capnp::FlatArrayMessageReader cmsg(aligned_buf.align(msg));
+    // Single copy straight out of the queue, validated before anything goes on the bus
+    auto words = aligned_buf.align(msg);
+    bool valid = subscriber->borrow_valid();
+    subscriber->release_borrow();
+    if (!valid) {
+      LOGE("sendcan overwritten while reading");
+      continue;
+    }
+
+    capnp::FlatArrayMessageReader cmsg(words);
     cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
 
     //Dont send if older than 1 second
@@ -215,8 +224,6 @@ void can_send_thread(bool fake_send) {
         panda->can_send(event.getSendcan());
       }
     }
-
-    delete msg;
   }
 
   delete subscriber;
@@ -229,26 +236,22 @@ void can_recv_thread() {
   // can = 8006
   PubMaster pm({"can"});
 
-  // run at 100hz
-  const uint64_t dt = 10000000ULL;
-  uint64_t next_frame_time = nanos_since_boot() + dt;
+  // run at 100hz, the timer keeps the period when can_recv is late
+  Poller *poller = Poller::create();
+  int timer = poller->registerTimer(10);
 
   while (!do_exit && panda->connected) {
-    can_recv(pm);
+    poller->poll(100);
+    uint64_t expirations = poller->timerExpirations(timer);
+    if (expirations == 0) continue;
 
-    uint64_t cur_time = nanos_since_boot();
-    int64_t remaining = next_frame_time - cur_time;
-    if (remaining > 0) {
-      std::this_thread::sleep_for(std::chrono::nanoseconds(remaining));
-    } else {
-      if (ignition){
-        LOGW("missed cycles (%d) %lld", (int)-1*remaining/dt, remaining);
-      }
-      next_frame_time = cur_time;
+    if (expirations > 1 && ignition){
+      LOGW("missed cycles (%d)", (int)(expirations - 1));
     }
-
-    next_frame_time += dt;
+    can_recv(pm);
   }
+
+  delete poller;
 }
 
 void panda_state_thread(bool spoofing_started) {
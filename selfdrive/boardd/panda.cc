@@ -2,6 +2,7 @@
 
 #include <unistd.h>
 
+#include <algorithm>
 #include <cassert>
 #include <stdexcept>
 #include <vector>
@@ -261,26 +262,49 @@ void Panda::send_heartbeat(){
   usb_write(0xf3, 1, 0);
 }
 
+// CAN frames over USB are two header words and the data: the address in the first word, the
+// DLC, bus and bus time in the second. Classic frames always carry 8 data bytes, so they are
+// 0x10 bytes each like before CAN FD. CAN FD frames carry the length of their DLC.
+static const uint8_t dlc_to_len[] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64};
+
+// A classic frame with a DLC of 9-15 still carries 8 bytes
+static int frame_len(uint32_t header, bool canfd) {
+  int len = dlc_to_len[header & 0xF];
+  return canfd ? len : std::min(len, 8);
+}
+
+static int frame_size(uint32_t header, bool canfd) {
+  return 8 + std::max(8, frame_len(header, canfd));
+}
+
 void Panda::can_send(capnp::List<cereal::CanData>::Reader can_data_list){
   static std::vector<uint32_t> send;
-  const int msg_count = can_data_list.size();
+  send.clear();
 
-  send.resize(msg_count*0x10);
+  for (auto cmsg : can_data_list) {
+    auto can_data = cmsg.getDat();
+    if (can_data.size() > (has_canfd ? 64 : 8)) {
+      LOGW("CAN frame to 0x%X too long: %zu bytes", cmsg.getAddress(), can_data.size());
+      continue;
+    }
 
-  for (int i = 0; i < msg_count; i++) {
-    auto cmsg = can_data_list[i];
+    uint32_t dlc = 0;
+    while (dlc_to_len[dlc] < can_data.size()) {
+      dlc++;
+    }
+
+    size_t i = send.size();
+    send.resize(i + frame_size(dlc, has_canfd) / 4, 0);
     if (cmsg.getAddress() >= 0x800) { // extended
-      send[i*4] = (cmsg.getAddress() << 3) | 5;
+      send[i] = (cmsg.getAddress() << 3) | 5;
     } else { // normal
-      send[i*4] = (cmsg.getAddress() << 21) | 1;
+      send[i] = (cmsg.getAddress() << 21) | 1;
     }
-    auto can_data = cmsg.getDat();
-    assert(can_data.size() <= 8);
-    send[i*4+1] = can_data.size() | (cmsg.getSrc() << 4);
-    memcpy(&send[i*4+2], can_data.begin(), can_data.size());
+    send[i+1] = dlc | (cmsg.getSrc() << 4);
+    memcpy(&send[i+2], can_data.begin(), can_data.size());
   }
 
-  usb_bulk_write(3, (unsigned char*)send.data(), send.size(), 5);
+  usb_bulk_write(3, (unsigned char*)send.data(), send.size() * 4, 5);
 }
 
 int Panda::can_receive(kj::Array<capnp::word>& out_buf) {
@@ -294,26 +318,37 @@ int Panda::can_receive(kj::Array<capnp::word>& out_buf) {
     LOGW("Receive buffer full");
   }
 
-  size_t num_msg = recv / 0x10;
+  // The frames are of different sizes with CAN FD, count them first
+  size_t num_msg = 0;
+  int pos = 0;
+  while (pos + 8 <= recv && pos + frame_size(data[pos/4 + 1], has_canfd) <= recv) {
+    pos += frame_size(data[pos/4 + 1], has_canfd);
+    num_msg++;
+  }
+  if (pos != recv) {
+    LOGW("Truncated CAN frame in receive buffer");
+  }
+
   MessageBuilder msg;
   auto evt = msg.initEvent();
   evt.setValid(comms_healthy);
 
   // populate message
   auto canData = evt.initCan(num_msg);
+  const uint32_t *frame = data;
   for (int i = 0; i < num_msg; i++) {
-    if (data[i*4] & 4) {
+    if (frame[0] & 4) {
       // extended
-      canData[i].setAddress(data[i*4] >> 3);
-      //printf("got extended: %x\n", data[i*4] >> 3);
+      canData[i].setAddress(frame[0] >> 3);
+      //printf("got extended: %x\n", frame[0] >> 3);
     } else {
       // normal
-      canData[i].setAddress(data[i*4] >> 21);
+      canData[i].setAddress(frame[0] >> 21);
     }
-    canData[i].setBusTime(data[i*4+1] >> 16);
-    int len = data[i*4+1]&0xF;
-    canData[i].setDat(kj::arrayPtr((uint8_t*)&data[i*4+2], len));
-    canData[i].setSrc((data[i*4+1] >> 4) & 0xff);
+    canData[i].setBusTime(frame[1] >> 16);
+    canData[i].setDat(kj::arrayPtr((uint8_t*)&frame[2], frame_len(frame[1], has_canfd)));
+    canData[i].setSrc((frame[1] >> 4) & 0xff);
+    frame += frame_size(frame[1], has_canfd) / 4;
   }
   out_buf = capnp::messageToFlatArray(msg);
   return recv;
@@ -10,6 +10,7 @@ from selfdrive.config import Conversions as CV
 from selfdrive.controls.lib.drive_helpers import V_CRUISE_MAX
 from selfdrive.controls.lib.events import Events
 from selfdrive.controls.lib.vehicle_model import VehicleModel
+from opendbc.can.parser import CANParserGroup
 
 GearShifter = car.CarState.GearShifter
 EventName = car.CarEvent.EventName
@@ -34,6 +35,8 @@ class CarInterfaceBase():
       self.cp = self.CS.get_can_parser(CP)
       self.cp_cam = self.CS.get_cam_can_parser(CP)
       self.cp_body = self.CS.get_body_can_parser(CP)
+      # every event is read once for all of the parsers
+      self.can_parsers = CANParserGroup([cp for cp in (self.cp, self.cp_cam, self.cp_body) if cp is not None])
 
     self.CC = None
     if CarController is not None:
@@ -0,0 +1,119 @@
+#!/usr/bin/env python3
+import importlib
+import os
+import random
+import unittest
+import numpy as np
+from parameterized import parameterized
+
+from cereal import log
+from opendbc import DBC_PATH
+from opendbc.can.dbc import dbc
+from opendbc.can.parser import CANParser, CANBulkDecoder
+from selfdrive.boardd.boardd import can_list_to_can_capnp
+
+# Also compare on a recorded route when one is given, e.g. CAN_BULK_ROUTE="<dongle id>|<route>"
+ROUTE = os.environ.get("CAN_BULK_ROUTE")
+DBC_NAMES = sorted(f[:-4] for f in os.listdir(DBC_PATH) if f.endswith(".dbc"))
+NUM_SEGMENTS = 3
+
+
+def get_signals(dbc_name):
+  # Every signal of the DBC but the checksums and counters, which both check anyway
+  msgs = dbc(os.path.join(DBC_PATH, dbc_name + ".dbc")).msgs
+  signals = {(sig.name, address) for address, (_, sigs) in msgs.items() for sig in sigs
+             if sig.name not in ("CHECKSUM", "COUNTER", "CHECKSUM_PEDAL", "COUNTER_PEDAL")}
+  return sorted(signals), msgs
+
+
+def parse_segment(dbc_name, signals, events):
+  # What CANParser gives for every event, at the event's logMonoTime. A new parser for
+  # every segment, like the counters of the bulk decoder.
+  cp = CANParser(dbc_name, [(s, address, 0) for s, address in signals], [], enforce_checks=False)
+  out = {sig: ([], []) for sig in signals}
+  for e in events:
+    t = log.Event.from_bytes(e).logMonoTime
+    for address in cp.update_string(e):
+      for name, value in cp.vl[address].items():
+        if (name, address) in out:
+          out[(name, address)][0].append(t)
+          out[(name, address)][1].append(value)
+  return out
+
+
+class TestCANBulkDecoder(unittest.TestCase):
+
+  def compare(self, dbc_name, signals, segments):
+    decoder = CANBulkDecoder(dbc_name, signals, check=True)
+    values, errors = decoder.decode([b"".join(events) for events in segments], num_threads=2)
+    self.assertEqual(errors, {})
+
+    expected = {sig: ([], []) for sig in signals}
+    for events in segments:
+      for sig, (ts, vals) in parse_segment(dbc_name, signals, events).items():
+        expected[sig][0].extend(ts)
+        expected[sig][1].extend(vals)
+
+    for (name, address), (ts, vals) in expected.items():
+      out_ts, out_vals = values[address][name]
+      np.testing.assert_array_equal(out_ts, np.array(ts, dtype=np.uint64), err_msg=f"{name} of {hex(address)}")
+      np.testing.assert_array_equal(out_vals, np.array(vals, dtype=np.double), err_msg=f"{name} of {hex(address)}")
+
+  def random_events(self, msgs, rng, n):
+    # Random payloads of every message on two buses, so checksums and counters both pass and fail
+    events = []
+    for _ in range(n):
+      frames = [[address, 0, bytes(rng.getrandbits(8) for _ in range(size)), rng.choice((0, 0, 1))]
+                for address, ((_, size), _) in msgs.items() if rng.random() < 0.7]
+      events.append(can_list_to_can_capnp(frames, msgtype='can'))
+    return events
+
+  @parameterized.expand([(name,) for name in DBC_NAMES])
+  def test_random_frames(self, dbc_name):
+    signals, msgs = get_signals(dbc_name)
+    rng = random.Random(dbc_name)
+    segments = [self.random_events(msgs, rng, 100) for _ in range(NUM_SEGMENTS)]
+    self.compare(dbc_name, signals, segments)
+
+  def test_corrupt_segments(self):
+    # A bad segment is reported and keeps the values before the bad event, the others decode fully
+    dbc_name = DBC_NAMES[0]
+    signals, msgs = get_signals(dbc_name)
+    rng = random.Random(dbc_name)
+    good = self.random_events(msgs, rng, 50)
+    cut = self.random_events(msgs, rng, 50)
+
+    truncated = b"".join(cut)
+    truncated = truncated[:len(truncated) - len(cut[-1]) // 2]
+    garbage = bytes(rng.getrandbits(8) for _ in range(4096))
+    decoder = CANBulkDecoder(dbc_name, signals, check=True)
+    values, errors = decoder.decode([b"".join(good), truncated, garbage], num_threads=2)
+    self.assertIn(1, errors)
+    self.assertNotIn(0, errors)
+
+    expected = parse_segment(dbc_name, signals, good)
+    for sig, (ts, _) in parse_segment(dbc_name, signals, cut[:-1]).items():
+      expected[sig][0].extend(ts)
+    for (name, address), (ts, _) in expected.items():
+      out_ts = values[address][name][0]
+      np.testing.assert_array_equal(out_ts[:len(ts)], np.array(ts, dtype=np.uint64))
+
+  @unittest.skipIf(ROUTE is None, "no route given")
+  def test_route(self):
+    from tools.lib.route import Route
+    from tools.lib.logreader import MultiLogIterator
+    from selfdrive.car.car_helpers import interfaces
+
+    lr = list(MultiLogIterator(Route(ROUTE).log_paths()[:NUM_SEGMENTS], wraparound=False))
+    car_name = next(m.carParams.carFingerprint for m in lr if m.which() == 'carParams')
+    brand = interfaces[car_name][0].__module__.split('.')[-2]
+    dbc_name = importlib.import_module(f'selfdrive.car.{brand}.values').DBC[car_name]['pt']
+
+    signals, _ = get_signals(dbc_name)
+    events = [m.as_builder().to_bytes() for m in lr if m.which() == 'can']
+    self.assertGreater(len(events), 0)
+    self.compare(dbc_name, signals, [events])
+
+
+if __name__ == "__main__":
+  unittest.main()
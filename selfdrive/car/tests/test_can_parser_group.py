@@ -0,0 +1,76 @@
+#!/usr/bin/env python3
+import os
+import random
+import unittest
+from parameterized import parameterized
+
+from opendbc.can.parser import CANParserGroup
+from selfdrive.boardd.boardd import can_list_to_can_capnp
+from selfdrive.car.car_helpers import interfaces
+from selfdrive.car.fingerprints import all_known_cars
+from selfdrive.car.fingerprints import _FINGERPRINTS as FINGERPRINTS
+
+# Also compare on a recorded route when one is given, e.g. CAN_GROUP_ROUTE="<dongle id>|<route>"
+ROUTE = os.environ.get("CAN_GROUP_ROUTE")
+STRINGS_PER_UPDATE = 5  # like the can strings controlsd drains per cycle
+
+
+def get_parsers(CarInterface, CarState, car_name):
+  CP = CarInterface.get_params(car_name)
+  parsers = [CarState.get_can_parser(CP), CarState.get_cam_can_parser(CP), CarState.get_body_can_parser(CP)]
+  if hasattr(CarState, 'get_adas_can_parser'):
+    parsers.append(CarState.get_adas_can_parser(CP))
+  return [p for p in parsers if p is not None]
+
+
+class TestCANParserGroup(unittest.TestCase):
+
+  def compare(self, car_name, can_strings):
+    CarInterface, _, CarState = interfaces[car_name]
+    grouped = get_parsers(CarInterface, CarState, car_name)
+    single = get_parsers(CarInterface, CarState, car_name)
+    group = CANParserGroup(grouped)
+
+    for i in range(0, len(can_strings), STRINGS_PER_UPDATE):
+      strings = can_strings[i:i + STRINGS_PER_UPDATE]
+      updated = group.update_strings(strings)
+      for j, cp in enumerate(single):
+        self.assertEqual(updated[j], cp.update_strings(strings))
+        self.assertEqual(grouped[j].vl, cp.vl)
+        self.assertEqual(grouped[j].ts, cp.ts)
+        self.assertEqual(grouped[j].can_valid, cp.can_valid)
+
+  @parameterized.expand([(car,) for car in all_known_cars()])
+  def test_random_frames(self, car_name):
+    # Every message of the car's DBCs on every bus, with random payloads and missing frames,
+    # so both valid and invalid checksums, counters and timeouts are covered
+    CarInterface, _, CarState = interfaces[car_name]
+    fingerprint = FINGERPRINTS[car_name][0] if car_name in FINGERPRINTS else {}
+    addresses = {a for cp in get_parsers(CarInterface, CarState, car_name) for a in cp.vl if isinstance(a, int)}
+    sizes = {a: fingerprint.get(a, 8) for a in sorted(addresses)}
+    rng = random.Random(car_name)
+
+    can_strings = []
+    for _ in range(500):
+      frames = []
+      for address, size in sizes.items():
+        for bus in (0, 1, 2):
+          if rng.random() < 0.8:
+            frames.append([address, 0, bytes(rng.getrandbits(8) for _ in range(size)), bus])
+      can_strings.append(can_list_to_can_capnp(frames, msgtype='can'))
+    self.compare(car_name, can_strings)
+
+  @unittest.skipIf(ROUTE is None, "no route given")
+  def test_route(self):
+    from tools.lib.route import Route
+    from tools.lib.logreader import MultiLogIterator
+
+    lr = list(MultiLogIterator(Route(ROUTE).log_paths()[:2], wraparound=False))
+    car_name = next(m.carParams.carFingerprint for m in lr if m.which() == 'carParams')
+    can_strings = [m.as_builder().to_bytes() for m in lr if m.which() == 'can']
+    self.assertGreater(len(can_strings), 0)
+    self.compare(car_name, can_strings)
+
+
+if __name__ == "__main__":
+  unittest.main()
@@ -46,6 +46,7 @@ const int MAX_CAM_IDX = Hardware::TICI() ? LOG_CAMERA_ID_ECAMERA : LOG_CAMERA_ID
 const int DCAM_BITRATE = Hardware::TICI() ? MAIN_BITRATE : 2500000;
 
 #define NO_CAMERA_PATIENCE 500 // fall back to time-based rotation if all cameras are dead
+#define LOG_BATCH_SIZE 100 // messages drained per socket between do_exit checks
 
 const int SEGMENT_LENGTH = getenv("LOGGERD_TEST") ? atoi(getenv("LOGGERD_SEGMENT_LENGTH")) : 60;
 
@@ -368,7 +369,8 @@ int main(int argc, char** argv) {
 
   uint64_t msg_count = 0;
   uint64_t bytes_count = 0;
-  AlignedBuffer aligned_buf;
+  std::vector<capnp::word> batch_words;
+  std::vector<std::pair<size_t, size_t>> batch_msgs;  // word offset and byte size of each message in the batch
 
   double start_ts = seconds_since_boot();
   double last_rotate_tms = millis_since_boot();
@@ -378,54 +380,70 @@ int main(int argc, char** argv) {
     // poll for new messages on all sockets
     for (auto sock : poller->poll(1000)) {
 
-      // drain socket
-      Message * last_msg = nullptr;
-      while (!do_exit) {
-        Message * msg = sock->receive(true);
-        if (!msg){
+      int fpkt_id = -1;
+      for (int cid = 0; cid <=MAX_CAM_IDX; cid++) {
+        if (sock == s.rotate_state[cid].fpkt_sock) {
+          fpkt_id=cid;
           break;
         }
-        delete last_msg;
-        last_msg = msg;
+      }
 
-        QlogState& qs = qlog_states[sock];
-        logger_log(&s.logger, (uint8_t*)msg->getData(), msg->getSize(), qs.counter == 0 && qs.freq != -1);
-        if (qs.freq != -1) {
-          qs.counter = (qs.counter + 1) % qs.freq;
-        }
+      // drain socket in batches. Each batch is copied out of the queue and only logged once
+      // the queue confirms it wasn't overwritten while being copied
+      QlogState& qs = qlog_states[sock];
+      int64_t last_frame_id = -1;
+      auto copy_msg = [&](char *data, size_t size) {
+        size_t offset = batch_words.size();
+        batch_words.resize(offset + (size + sizeof(capnp::word) - 1) / sizeof(capnp::word));
+        memcpy(&batch_words[offset], data, size);
+        batch_msgs.push_back({offset, size});
+      };
 
-        bytes_count += msg->getSize();
-        if ((++msg_count % 1000) == 0) {
-          double ts = seconds_since_boot();
-          LOGD("%lu messages, %.2f msg/sec, %.2f KB/sec", msg_count, msg_count * 1.0 / (ts - start_ts), bytes_count * 0.001 / (ts - start_ts));
+      while (!do_exit) {
+        batch_words.clear();
+        batch_msgs.clear();
+        int n = sock->receive_batch(LOG_BATCH_SIZE, copy_msg);
+        if (n < 0) {
+          LOGE("messages overwritten while logging");
+          continue;
         }
-      }
 
-      if (last_msg) {
-        int fpkt_id = -1;
-        for (int cid = 0; cid <=MAX_CAM_IDX; cid++) {
-          if (sock == s.rotate_state[cid].fpkt_sock) {
-            fpkt_id=cid;
-            break;
+        for (auto [offset, size] : batch_msgs) {
+          const capnp::word *data = &batch_words[offset];
+          logger_log(&s.logger, (uint8_t*)data, size, qs.counter == 0 && qs.freq != -1);
+          if (qs.freq != -1) {
+            qs.counter = (qs.counter + 1) % qs.freq;
+          }
+
+          bytes_count += size;
+          if ((++msg_count % 1000) == 0) {
+            double ts = seconds_since_boot();
+            LOGD("%lu messages, %.2f msg/sec, %.2f KB/sec", msg_count, msg_count * 1.0 / (ts - start_ts), bytes_count * 0.001 / (ts - start_ts));
           }
         }
-        if (fpkt_id >= 0) {
-          // track camera frames to sync to encoder
-          // only process last frame
-          capnp::FlatArrayMessageReader cmsg(aligned_buf.align(last_msg));
+
+        if (fpkt_id >= 0 && !batch_msgs.empty()) {
+          // track camera frames to sync to encoder, only the last one of the batch is needed
+          auto [offset, size] = batch_msgs.back();
+          capnp::FlatArrayMessageReader cmsg(kj::ArrayPtr<const capnp::word>(&batch_words[offset], size / sizeof(capnp::word)));
           cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
 
           if (fpkt_id == LOG_CAMERA_ID_FCAMERA) {
-            s.rotate_state[fpkt_id].setLogFrameId(event.getRoadCameraState().getFrameId());
+            last_frame_id = event.getRoadCameraState().getFrameId();
           } else if (fpkt_id == LOG_CAMERA_ID_DCAMERA) {
-            s.rotate_state[fpkt_id].setLogFrameId(event.getDriverCameraState().getFrameId());
+            last_frame_id = event.getDriverCameraState().getFrameId();
           } else if (fpkt_id == LOG_CAMERA_ID_ECAMERA) {
-            s.rotate_state[fpkt_id].setLogFrameId(event.getWideRoadCameraState().getFrameId());
+            last_frame_id = event.getWideRoadCameraState().getFrameId();
           }
-          last_camera_seen_tms = millis_since_boot();
         }
+        if (n < LOG_BATCH_SIZE) break;
+      }
+
+      // only process last frame
+      if (last_frame_id >= 0) {
+        s.rotate_state[fpkt_id].setLogFrameId(last_frame_id);
+        last_camera_seen_tms = millis_since_boot();
       }
-      delete last_msg;
     }
 
     bool new_segment = s.logger.part == -1;